@@ -18,6 +18,12 @@
 #include <SIMDString.h>
 
 #include <PoolAllocator.h> // use the extracted allocator instead
+#include <ArenaAllocator.h>
+#include <SIMDStringBatch.h>
+
+#ifdef ReplaceOperatorNew
+    #include <PoolOperatorNew.h> // std::string etc. allocate from the pool too
+#endif
 
 #include <string>
 #include <iostream>
@@ -128,6 +134,30 @@ int main()
 #endif
 #endif
 
+    // 7. use an arena for frame-scoped strings, released all at once
+    G3D::Arena frameArena;
+    G3D::arena_allocator<char> frameAlloc(frameArena);
+
+    using SIMDStringArena = ::SIMDString<64, G3D::arena_allocator<char>>;
+    for (int frame = 0; frame < 3; ++frame) {
+       SIMDStringArena simdstringXXL("0123456789abcdefghijklmnopqrstuvwxyz hjhjkhkhjkhjkhjkhjkhjkhjkhjkhjkkhjkjhkhjhjkhjhjkjkhhjkhjkhjkhjkkhjhjkhjk", frameAlloc);
+       simdstringXXL.append("xxxx");
+       SIMDStringArena simdstringCopy(simdstringXXL + simdstringXXL);
+
+       std::cout << "\n" << "Arena frame " << frame << ": " << frameArena.bytesAllocated() << " bytes allocated, " 
+                 << frameArena.bytesReserved() << " bytes reserved\n";
+       frameArena.reset();
+    }
+
+    // 8. build a table of strings at once, allocating all their buffers under one lock
+    std::vector<std::string_view> rows = { "0123456789abcdefghijklmnopqrstuvwxyz hjhjkhkhjkhjkhjkhjkhjkhjkhjkhjkkhjkjhkhjhjkhjhjkjkhhjkhjkhjkhjkkhjhjkhjk", 
+                                           "short", 
+                                           "0123456789abcdefghijklmnopqrstuvwxyz 0123456789abcdefghijklmnopqrstuvwxyz" };
+    std::vector<SIMDString> table = G3D::makeSIMDStrings(rows);
+    table[1].append(" and appended");
+
+    std::cout << "\n" << "String table: " << table.size() << " strings, 2nd = " << table[1] << "\n";
+
     // done
     std::cout << "\n --> done!\n";
 }
@@ -37,6 +37,8 @@ SOFTWARE.
 #include <iostream>
 #include <string_view>
 #include <initializer_list>
+#include <type_traits>
+#include <utility>
 
 #if defined(USE_SSE_MEMCPY) && USE_SSE_MEMCPY
 #   if (defined(__arm__) || defined(__arm64__)) 
@@ -84,6 +86,62 @@ bool inConstSegment(const char* c);
 
 constexpr size_t SSO_ALIGNMENT = 16;
 
+// Allocator propagation traits, defaulting to false like std::allocator_traits. They are 
+// detected directly because std::allocator_traits requires a value_type, which the memory
+// resources that may be used as the Allocator do not have.
+template<class Alloc, class = void> 
+struct SIMDStringPropagateOnCopy : std::false_type {};
+template<class Alloc> 
+struct SIMDStringPropagateOnCopy<Alloc, std::void_t<typename Alloc::propagate_on_container_copy_assignment>> 
+    : Alloc::propagate_on_container_copy_assignment {};
+
+template<class Alloc, class = void> 
+struct SIMDStringPropagateOnMove : std::false_type {};
+template<class Alloc> 
+struct SIMDStringPropagateOnMove<Alloc, std::void_t<typename Alloc::propagate_on_container_move_assignment>> 
+    : Alloc::propagate_on_container_move_assignment {};
+
+template<class Alloc, class = void> 
+struct SIMDStringPropagateOnSwap : std::false_type {};
+template<class Alloc> 
+struct SIMDStringPropagateOnSwap<Alloc, std::void_t<typename Alloc::propagate_on_container_swap>> 
+    : Alloc::propagate_on_container_swap {};
+
+// Optional allocator extensions that let a string grow its heap buffer without allocate + copy +
+// deallocate; allocators without them are used like std::allocator.
+//   bool try_expand_in_place(p, n, newN): true if the storage p of allocate(n) can hold newN 
+//       elements without moving, after which it is deallocated with newN
+//   char* reallocate(p, n, newN): storage of newN elements that holds the first min(n, newN) 
+//       elements of p, which it releases; nullptr, leaving p allocated, on failure
+template<class Alloc, class = void>
+struct SIMDStringCanExpandInPlace : std::false_type {};
+template<class Alloc>
+struct SIMDStringCanExpandInPlace<Alloc, std::void_t<decltype(std::declval<Alloc&>().try_expand_in_place(std::declval<char*>(), size_t(), size_t()))>>
+    : std::true_type {};
+
+template<class Alloc, class = void>
+struct SIMDStringCanReallocate : std::false_type {};
+template<class Alloc>
+struct SIMDStringCanReallocate<Alloc, std::void_t<decltype(std::declval<Alloc&>().reallocate(std::declval<char*>(), size_t(), size_t()))>>
+    : std::true_type {};
+
+// Allocators with a C++23 style allocate_at_least(n), which returns a pointer and the number of 
+// elements obtained (n or more, e.g. the size of a pool's block), let the string use all of it.
+template<class Alloc, class = void>
+struct SIMDStringCanAllocateAtLeast : std::false_type {};
+template<class Alloc>
+struct SIMDStringCanAllocateAtLeast<Alloc, std::void_t<decltype(std::declval<Alloc&>().allocate_at_least(size_t()).count)>>
+    : std::true_type {};
+
+// Tag of the SIMDString constructor that takes over a buffer allocated by the caller, so that 
+// the buffers of many strings can be allocated at once (see SIMDStringBatch.h).
+struct SIMDStringAdoptBuffer { explicit SIMDStringAdoptBuffer() = default; };
+
+// Like C++20 std::type_identity. Allocator parameters use it, so that class template argument 
+// deduction (e.g., SIMDString s(str)) never takes an argument for the Allocator.
+template<class T>
+struct SIMDStringIdentity { typedef T type; };
+
 /**
    \brief Very fast string class that follows the std::string/std::basic_string interface.
 
@@ -117,6 +175,7 @@ public:
     typedef pointer                                 iterator;
     typedef std::reverse_iterator<const_pointer>    const_reverse_iterator;
     typedef std::reverse_iterator<pointer>          reverse_iterator;
+    typedef typename SIMDStringIdentity<Allocator>::type allocator_type;
 
 protected:
     // Throw compile time error if INTERNAL_SIZE is not a multiple of SSO_ALIGNMENT
@@ -145,9 +204,49 @@ protected:
     mutable struct _AllocHider : public Allocator {
         _AllocHider() { }
         _AllocHider(size_t data) : data(data) { }
+        // Allocators that cannot be copied, such as memory resources used directly, 
+        // are default constructed, so that every string has its own
+        template<class A = Allocator, typename std::enable_if<std::is_copy_constructible<A>::value, int>::type = 0>
+        _AllocHider(const Allocator& a, size_t data = 0) : Allocator(a), data(data) { }
+        template<class A = Allocator, typename std::enable_if<! std::is_copy_constructible<A>::value, int>::type = 0>
+        _AllocHider(const Allocator&, size_t data = 0) : data(data) { }
         size_t      data;
     } m_hider;
 
+    constexpr const Allocator& allocator() const {
+        return m_hider;
+    }
+
+    /** True if memory allocated by either string's allocator can be freed by the other's */
+    constexpr bool sameAllocator(const SIMDString& str) const {
+        if constexpr (std::is_empty<Allocator>::value) {
+            return true;
+        } else {
+            return allocator() == str.allocator();
+        }
+    }
+
+    /** Exchanges the contents, but not the allocators, of two strings */
+    constexpr void swapData(SIMDString& str) {
+        std::swap<size_type>(m_allocated, str.m_allocated);
+
+        // this has to be swapped first
+        if (m_data != m_buffer && str.m_data != str.m_buffer) {
+            std::swap<value_type*>(m_data, str.m_data);
+        }
+        else if (m_data != m_buffer) {
+            str.m_data = m_data;
+            m_data = m_buffer;
+        }
+        else if (str.m_data != str.m_buffer) {
+            m_data = str.m_data;
+            str.m_data = str.m_buffer;
+        } // if both store strings in buffer, don't swap m_data, otherwise swapping buffers will swap it back
+
+        swapBuffer(m_buffer, str.m_buffer);
+        std::swap<size_type>(m_length, str.m_length);
+    }
+
     inline static void memcpy(void* dst, const void* src, size_t count) {
         ::memcpy(dst, src, count);
     }
@@ -184,10 +283,17 @@ protected:
 #       endif
     }
 
-    constexpr inline void* alloc(size_t b) {
+    /** Allocates at least \a b bytes. Heap allocations set \a b to the bytes obtained, which may be 
+     *  more with allocate_at_least (see SIMDStringCanAllocateAtLeast). */
+    constexpr inline void* alloc(size_t& b) {
         if (b <= INTERNAL_SIZE) {
             return m_buffer;
         }
+        else if constexpr (SIMDStringCanAllocateAtLeast<Allocator>::value) {
+            auto result = m_allocator.allocate_at_least(b);
+            b = result.count;
+            return result.ptr;
+        }
         else {
             return m_allocator.allocate(b);
         }
@@ -203,6 +309,33 @@ protected:
         return !m_allocated && m_data;
     }
 
+    /** Grows heap allocated data to \a newAllocated bytes, keeping its contents, if the allocator
+     *  can do so in place or by reallocating (see SIMDStringCanExpandInPlace). Returns false for
+     *  internal and const segment data and if the allocator cannot. */
+    constexpr bool growHeapData(size_t newAllocated) {
+        if constexpr (SIMDStringCanExpandInPlace<Allocator>::value || SIMDStringCanReallocate<Allocator>::value) {
+            if (!m_allocated || (m_data == m_buffer) || (newAllocated <= INTERNAL_SIZE)) {
+                return false;
+            }
+            if constexpr (SIMDStringCanExpandInPlace<Allocator>::value) {
+                if (m_allocator.try_expand_in_place(m_data, m_allocated, newAllocated)) {
+                    m_allocated = newAllocated;
+                    return true;
+                }
+            }
+            if constexpr (SIMDStringCanReallocate<Allocator>::value) {
+                value_type* data = m_allocator.reallocate(m_data, m_allocated, newAllocated);
+                if (data) {
+                    m_data = data;
+                    m_allocated = newAllocated;
+                    return true;
+                }
+            }
+        }
+        (void)newAllocated;
+        return false;
+    }
+
     /** Choose the number of bytes to allocate to hold a string of length L 
      *  Note: Calling functions are expected to +1 for the null terminator */
     constexpr inline static size_t chooseAllocationSize(size_t L) {
@@ -224,9 +357,13 @@ protected:
      *  Note: Calling functions are expected to +1 for the null terminator */
     constexpr void ensureAllocation(size_t newSize) {
         if ((m_allocated < newSize) && !((m_data == m_buffer) && (newSize < INTERNAL_SIZE))) {
+            const size_t newAllocated = chooseAllocationSize(newSize);
+            if (growHeapData(newAllocated)) {
+                return;
+            }
             value_type* old = m_data;
             size_t oldSize = m_allocated;
-            m_allocated = chooseAllocationSize(newSize);
+            m_allocated = newAllocated;
             m_data = (value_type*)alloc(m_allocated);
             memcpy(m_data, old, m_length);
             if (!::inConstSegment(old)) { free(old, oldSize); }
@@ -270,8 +407,13 @@ public:
         m_buffer[0] = '\0';
     }
 
+    /** Creates a zero-length string that allocates from \a a */
+    explicit constexpr SIMDString(const allocator_type& a) : m_data(m_buffer), m_length(0), m_hider(a, INTERNAL_SIZE) {
+        m_buffer[0] = '\0';
+    }
+
     /** \param count Copy this many characters.  */
-    constexpr SIMDString(size_type count, value_type c) : m_length(count) {
+    constexpr SIMDString(size_type count, value_type c, const allocator_type& a = allocator_type()) : m_length(count), m_hider(a) {
         // Allocate more than needed for fast append
         m_allocated = chooseAllocationSize(m_length + 1);
         m_data = static_cast<value_type*>(alloc(m_allocated));
@@ -284,7 +426,18 @@ public:
         m_buffer[1] = '\0';
     }
 
-    constexpr SIMDString(const SIMDString& str, size_type pos = 0) {
+    constexpr SIMDString(const SIMDString& str, size_type pos = 0) : m_hider(str.allocator()) {
+        init(str, pos);
+    }
+
+    constexpr SIMDString(const SIMDString& str, const allocator_type& a) : m_hider(a) {
+        init(str, 0);
+    }
+
+private:
+
+    /** Copy construction of a suffix of \a str */
+    constexpr void init(const SIMDString& str, size_type pos) {
         m_length = str.m_length - pos;
         if (str.inConst()) {
             // Share this const_seg value
@@ -308,7 +461,9 @@ public:
         }
     }
 
-    constexpr SIMDString(const SIMDString& str, size_type pos, size_type count) {
+public:
+
+    constexpr SIMDString(const SIMDString& str, size_type pos, size_type count) : m_hider(str.allocator()) {
         // cannot point to const string 
         m_length = (count == npos || pos + count >= str.size()) ? str.size() - pos : count;
         m_allocated = m_length + 1;
@@ -323,7 +478,7 @@ public:
         m_data[m_length] = '\0';
     }
 
-    constexpr SIMDString(const value_type* s) : m_length(::strlen(s)) {
+    constexpr SIMDString(const value_type* s, const allocator_type& a = allocator_type()) : m_length(::strlen(s)), m_hider(a) {
         if (::inConstSegment(s)) {
             m_data = const_cast<value_type*>(s);
             m_allocated = 0;
@@ -338,7 +493,7 @@ public:
 
     /** \param count Copy this many characters. The result is always copied because it is unsafe to
         check past the end of s for a null terminator.*/
-    constexpr SIMDString(const value_type* s, size_type count) : m_length(count) {
+    constexpr SIMDString(const value_type* s, size_type count, const allocator_type& a = allocator_type()) : m_length(count), m_hider(a) {
         // Allocate more than needed for fast append
         m_allocated = chooseAllocationSize(m_length + 1);
         m_data = (value_type*)alloc(m_allocated);
@@ -346,8 +501,15 @@ public:
         m_data[m_length] = '\0';
     }
 
-    constexpr SIMDString(SIMDString&& str) {
-        swap(str);
+    /** Takes the contents and the allocator of \a str, leaving it empty. The contents are
+        copied if the allocator cannot be copied. */
+    constexpr SIMDString(SIMDString&& str) : m_data(m_buffer), m_length(0), m_hider(str.allocator(), INTERNAL_SIZE) {
+        m_buffer[0] = '\0';
+        if (sameAllocator(str)) {
+            swapData(str);
+        } else {
+            init(str, 0);
+        }
     }
 
     // These aren't passed by reference because this was the signature on basic_string
@@ -403,6 +565,13 @@ public:
         m_data[m_length] = '\0';
     }
 
+    /** Takes over \a data, which holds \a length characters followed by '\0' and was allocated 
+        by allocate(\a allocated) of an allocator equal to \a a. */
+    constexpr SIMDString(SIMDStringAdoptBuffer, value_type* data, size_type length, size_type allocated, 
+                         const allocator_type& a = allocator_type()) 
+        : m_data(data), m_length(length), m_hider(a, allocated) {
+    }
+
     ~SIMDString() {
         if (m_data && m_allocated) {
             // Note that this calls the method, not ::free 
@@ -414,8 +583,17 @@ public:
         if (&str == this) {
             return *this;
         }
+
+        if constexpr (SIMDStringPropagateOnCopy<Allocator>::value) {
+            if (! sameAllocator(str)) {
+                // The old allocator must free the old data
+                maybeDeallocate();
+            }
+            static_cast<Allocator&>(m_hider) = str.allocator();
+        }
+
         // Constant storage
-        else if (str.inConst()) {
+        if (str.inConst()) {
             maybeDeallocate();
             // Share this const_seg value
             m_data = str.m_data;
@@ -443,7 +621,14 @@ public:
     }
 
     constexpr SIMDString& operator=(SIMDString&& str) {
-        swap(str);
+        if constexpr (SIMDStringPropagateOnMove<Allocator>::value) {
+            // str gets this allocator along with the data it allocated
+            std::swap<Allocator>(m_allocator, str.m_allocator);
+        } else if (! sameAllocator(str)) {
+            // str's memory cannot be taken over
+            return (*this) = str;
+        }
+        swapData(str);
         return *this;
     }
 
@@ -598,7 +783,7 @@ public:
     }
 
 
-    constexpr Allocator get_allocator() {
+    constexpr Allocator get_allocator() const {
         return m_allocator;
     }
 
@@ -730,17 +915,21 @@ public:
     constexpr void reserve(size_type newLength) {
         if (newLength + 1 > m_allocated) {
             // Reserve more space
-            if (newLength + 1 > INTERNAL_SIZE) {
+            if (growHeapData(newLength + 1)) {
+                // Grown in place or reallocated by the allocator
+            }
+            else if (newLength + 1 > INTERNAL_SIZE) {
                 // Need heap allocation
                 value_type* old = m_data;
                 // Allocate the exact size required
-                m_data = (value_type*)alloc(newLength + 1);
+                size_type newAllocated = newLength + 1;
+                m_data = (value_type*)alloc(newAllocated);
                 size_type oldSize = m_allocated;
-                m_allocated = newLength + 1;
+                m_allocated = newAllocated;
                 memcpy(m_data, old, m_length + 1);
 
-                // Maybe free the old buffer, if it was not m_buffer
-                free(old, oldSize);
+                // Maybe free the old buffer, if it was not m_buffer or in a const segment
+                if (!::inConstSegment(old)) { free(old, oldSize); }
             }
             else if (m_data != m_buffer) {
                 // Must be in a const segment, because small and not in the buffer. Just copy to the internal buffer.
@@ -885,7 +1074,8 @@ public:
 
         if (sizeDiff > 0) { // count < count2 -> insert
             size_type newSize = m_length + sizeDiff + 1;
-            if (((m_allocated < newSize) && !((m_data == m_buffer) && (newSize <= INTERNAL_SIZE))) || inConst()) {
+            if ((((m_allocated < newSize) && !((m_data == m_buffer) && (newSize <= INTERNAL_SIZE))) || inConst()) &&
+                !growHeapData(chooseAllocationSize(newSize))) {
                 // Allocate a new string and copy over first n values
                 value_type* old = m_data;
                 size_type oldSize = m_allocated;
@@ -956,7 +1146,8 @@ public:
         // count < count2
         if (sizeDiff > 0) { 
             size_type newSize = m_length + sizeDiff + 1;
-            if (((m_allocated < newSize + 1) && !((m_data == m_buffer) && (newSize < INTERNAL_SIZE))) || inConst()) {
+            if ((((m_allocated < newSize + 1) && !((m_data == m_buffer) && (newSize < INTERNAL_SIZE))) || inConst()) &&
+                !growHeapData(chooseAllocationSize(newSize))) {
                 // Allocate a new string and copy over first n values
                 value_type* old = m_data;
                 size_type oldSize = m_allocated;
@@ -1075,7 +1266,7 @@ public:
     }
 
     constexpr SIMDString operator+(const SIMDString& str) const {
-        SIMDString result;
+        SIMDString result(allocator());
         result.m_length = m_length + str.m_length;
         result.m_allocated = chooseAllocationSize(result.m_length + 1);
         result.m_data = (value_type*)result.alloc(result.m_allocated);
@@ -1093,7 +1284,7 @@ public:
 
     constexpr SIMDString operator+(const value_type* s) const {
         const size_type L(::strlen(s));
-        SIMDString result;
+        SIMDString result(allocator());
         result.m_length = m_length + L;
         result.m_allocated = chooseAllocationSize(result.m_length + 1);
         result.m_data = (value_type*)result.alloc(result.m_allocated);
@@ -1112,7 +1303,7 @@ public:
     }
 
     constexpr SIMDString operator+(const value_type c) const {
-        SIMDString result;
+        SIMDString result(allocator());
         result.m_length = m_length + 1;
         result.m_allocated = chooseAllocationSize(result.m_length + 1);
         result.m_data = (value_type*)result.alloc(result.m_allocated);
@@ -1215,25 +1406,15 @@ public:
         return this->append(sv.begin() + pos, count);
     }
 
+    /** As for std::basic_string, the allocators are only exchanged if the Allocator 
+        propagates on container swap; otherwise they must compare equal. */
     constexpr void swap(SIMDString& str) {
-        std::swap<size_type>(m_allocated, str.m_allocated);
-        std::swap<Allocator>(m_allocator, str.m_allocator);
-
-        // this has to be swapped first
-        if (m_data != m_buffer && str.m_data != str.m_buffer) {
-            std::swap<value_type*>(m_data, str.m_data);
-        }
-        else if (m_data != m_buffer) {
-            str.m_data = m_data;
-            m_data = m_buffer;
+        if constexpr (SIMDStringPropagateOnSwap<Allocator>::value) {
+            std::swap<Allocator>(m_allocator, str.m_allocator);
+        } else {
+            assert(sameAllocator(str)); // "Swapping strings with unequal allocators"
         }
-        else if (str.m_data != str.m_buffer) {
-            m_data = str.m_data;
-            str.m_data = str.m_buffer;
-        } // if both store strings in buffer, don't swap m_data, otherwise swapping buffers will swap it back
-
-        swapBuffer(m_buffer, str.m_buffer);
-        std::swap<size_type>(m_length, str.m_length);
+        swapData(str);
     }
 
     constexpr bool starts_with(value_type c) const {
@@ -1263,14 +1444,14 @@ public:
 
     constexpr SIMDString substr(size_type pos, size_type count = npos) const {
         const size_type slen = std::max((size_type)0, std::min(m_length - pos, count));
-        if (slen == 0) { return SIMDString(); }
+        if (slen == 0) { return SIMDString(allocator()); }
 
         // If copying from a const segment and ending at the end of the string, do not allocate
         if (inConst() && (m_length == pos + slen)) {
-            return SIMDString(m_data + pos);
+            return SIMDString(m_data + pos, allocator());
         }
         else {
-            return SIMDString(m_data + pos, slen);
+            return SIMDString(m_data + pos, slen, allocator());
         }
     }
 
@@ -1626,11 +1807,11 @@ __attribute__((__aligned__(SSO_ALIGNMENT)))
 
 
 TEMPLATE inline SIMDString<INTERNAL_SIZE, Allocator> operator+(const typename SIMDString<INTERNAL_SIZE, Allocator>::value_type* s1, const SIMDString<INTERNAL_SIZE, Allocator>& s2) {
-    return SIMDString<INTERNAL_SIZE, Allocator>(s1) + s2;
+    return SIMDString<INTERNAL_SIZE, Allocator>(s1, s2.get_allocator()) + s2;
 }
 
 TEMPLATE inline SIMDString<INTERNAL_SIZE, Allocator> operator+(const typename SIMDString<INTERNAL_SIZE, Allocator>::value_type s1, const SIMDString<INTERNAL_SIZE, Allocator>& s2) {
-    return SIMDString<INTERNAL_SIZE, Allocator>(s1) + s2;
+    return SIMDString<INTERNAL_SIZE, Allocator>(1, s1, s2.get_allocator()) + s2;
 }
 
 TEMPLATE inline SIMDString<INTERNAL_SIZE, Allocator> operator+(const SIMDString<INTERNAL_SIZE, Allocator>&& s1,
@@ -1901,3 +2082,15 @@ TEMPLATE SIMDString<INTERNAL_SIZE, Allocator> to_string(long double value)
 }
 
 #undef TEMPLATE
+
+namespace std {
+
+/** Hashes like std::string_view, so that SIMDStrings can be keys of std::unordered_map and std::unordered_set */
+template<size_t INTERNAL_SIZE, class Allocator>
+struct hash<SIMDString<INTERNAL_SIZE, Allocator>> {
+    size_t operator()(const SIMDString<INTERNAL_SIZE, Allocator>& s) const noexcept {
+        return hash<string_view>()(string_view(s.data(), s.size()));
+    }
+};
+
+} // namespace std
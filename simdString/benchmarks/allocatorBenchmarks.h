@@ -0,0 +1,818 @@
+#ifndef SIMDSTRING_ALLOCATOR_BENCHMARK_H
+#define SIMDSTRING_ALLOCATOR_BENCHMARK_H
+
+#include <benchmark/benchmark.h>
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <list>
+#include <unordered_map>
+#include <utility>
+#include <string_view>
+#include <atomic>
+#include <thread>
+#include <memory_resource>
+#include <filesystem>
+#include <cstdio>
+
+#include "PoolAllocator.h"
+#include "ArenaAllocator.h"
+#include "g3d_arena_resource.h"
+#include "g3d_buffer_pool_resource.h"
+#include "g3d_pool_heap_resource.h"
+#include "SIMDStringBatch.h"
+
+////////////////////////////////////////////////////////////////////////////////////////
+// G3D::SystemAlloc benchmarks (the pool allocator behind G3D::g3d_pool_allocator)
+////////////////////////////////////////////////////////////////////////////////////////
+
+/** Deterministic request sizes in (lo, hi] */
+static std::vector<size_t> RequestSizes(size_t count, size_t lo, size_t hi, uint32_t seed = 12345)
+{
+    std::vector<size_t> sizes(count);
+    for (size_t i = 0; i < count; ++i) {
+        // xorshift32
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        sizes[i] = lo + 1 + (seed % (hi - lo));
+    }
+    return sizes;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////
+// Malloc latency of small and medium requests while state.range(0) short blocks
+// sit in the pools' free lists, most of which are too small for the requests
+static void BM_PoolMallocFilledFreeList(benchmark::State& state)
+{
+    const std::vector<size_t> fillSizes = RequestSizes(state.range(0), 256, 1024);
+    std::vector<void*> blocks(fillSizes.size());
+    for (size_t i = 0; i < fillSizes.size(); ++i) {
+        blocks[i] = G3D::SystemAlloc::malloc(fillSizes[i]);
+    }
+    for (void* p : blocks) {
+        G3D::SystemAlloc::free(p);
+    }
+
+    // More requests per iteration than the per-thread caches hold, so that 
+    // the shared free lists are exercised
+    const std::vector<size_t> sizes = RequestSizes(1024, 256, 8192, 777);
+    std::vector<void*> live(sizes.size());
+    for (auto _ : state) {
+        for (size_t i = 0; i < sizes.size(); ++i) {
+            live[i] = G3D::SystemAlloc::malloc(sizes[i]);
+        }
+        benchmark::DoNotOptimize(live.data());
+        for (void* p : live) {
+            G3D::SystemAlloc::free(p);
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * sizes.size());
+}
+
+////////////////////////////////////////////////////////////////////////////////////////
+// Churn: a burst of state.range(0) 1..2 KB blocks, e.g. a file being parsed, overfills the 
+// small pool with blocks that are then not requested again, while 257..1024 byte blocks keep 
+// being allocated and freed. Reports the purges of the small pool and the share of mallocs
+// that fell through the pools to ::malloc.
+static void BM_PoolChurn(benchmark::State& state)
+{
+    const std::vector<size_t> burstSizes = RequestSizes(state.range(0), 1024, 2048);
+    const std::vector<size_t> sizes      = RequestSizes(4096, 256, 1024, 777);
+    std::vector<void*> burst(burstSizes.size());
+    std::vector<void*> live(sizes.size());
+
+    G3D::SystemAlloc::mallocStatus();
+    G3D::SystemAlloc::Stats before;
+    G3D::SystemAlloc::mallocStats(before);
+
+    for (auto _ : state) {
+        for (size_t i = 0; i < burstSizes.size(); ++i) {
+            burst[i] = G3D::SystemAlloc::mallocSized(burstSizes[i]);
+        }
+        benchmark::DoNotOptimize(burst.data());
+        for (size_t i = 0; i < burstSizes.size(); ++i) {
+            G3D::SystemAlloc::freeSized(burst[i], burstSizes[i]);
+        }
+
+        for (int round = 0; round < 8; ++round) {
+            for (size_t i = 0; i < sizes.size(); ++i) {
+                live[i] = G3D::SystemAlloc::mallocSized(sizes[i]);
+            }
+            benchmark::DoNotOptimize(live.data());
+            for (size_t i = 0; i < sizes.size(); ++i) {
+                G3D::SystemAlloc::freeSized(live[i], sizes[i]);
+            }
+        }
+    }
+
+    // Fold this thread's counters into the shared ones
+    G3D::SystemAlloc::mallocStatus();
+    G3D::SystemAlloc::Stats after;
+    G3D::SystemAlloc::mallocStats(after);
+
+    const double mallocs = (double)(after.totalMallocs - before.totalMallocs);
+    const double pooled  = (double)((after.mallocsFromTinyPool + after.mallocsFromSmallPool + after.mallocsFromMedPool) -
+                                    (before.mallocsFromTinyPool + before.mallocsFromSmallPool + before.mallocsFromMedPool));
+    state.counters["purges"]      = benchmark::Counter((double)(after.smallPoolPurges - before.smallPoolPurges), benchmark::Counter::kAvgIterations);
+    state.counters["fallthrough"] = (mallocs > 0) ? (1.0 - pooled / mallocs) : 0.0;
+    state.SetItemsProcessed(state.iterations() * (burstSizes.size() + 8 * sizes.size()));
+}
+
+////////////////////////////////////////////////////////////////////////////////////////
+// Replays a trace of state.range(0) string buffers, 85% of 256 B..2 KB and 15% of 2..8 KB,
+// which are all allocated and then freed in random order, e.g. per frame or per request.
+// The tuned variant first records the trace with SystemAlloc::startProfile, writes the 
+// profile as a config file and loads it with SystemAlloc::reserveFromFile, as a later run
+// would do through G3D_POOL_CONFIG. Above 40000 small or 5000 medium blocks, the default 
+// pool limits make part of the trace fall through to ::malloc.
+template<bool tuned>
+static void BM_ProfiledTrace(benchmark::State& state)
+{
+    const size_t count = (size_t)state.range(0);
+    const std::vector<size_t> smallSizes = RequestSizes(count, 256, 2048);
+    const std::vector<size_t> medSizes   = RequestSizes(count, 2048, 8192, 777);
+    std::vector<size_t> sizes(count);
+    std::vector<size_t> order(count);
+    uint32_t seed = 4711;
+    for (size_t i = 0; i < count; ++i) {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        sizes[i] = (seed % 100 < 85) ? smallSizes[i] : medSizes[i];
+        order[i] = i;
+    }
+    for (size_t i = count - 1; i > 0; --i) {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        std::swap(order[i], order[seed % (i + 1)]);
+    }
+
+    std::vector<void*> blocks(count);
+    auto replay = [&]() {
+        for (size_t i = 0; i < count; ++i) {
+            blocks[i] = G3D::SystemAlloc::mallocSized(sizes[i]);
+        }
+        benchmark::DoNotOptimize(blocks.data());
+        for (size_t i : order) {
+            G3D::SystemAlloc::freeSized(blocks[i], sizes[i]);
+        }
+    };
+
+    G3D::SystemAlloc::trim();
+    G3D::SystemAlloc::Stats defaults;
+    G3D::SystemAlloc::mallocStats(defaults);
+    if (tuned) {
+        const std::string filename = (std::filesystem::temp_directory_path() / "BM_ProfiledTrace.cfg").string();
+        G3D::SystemAlloc::startProfile();
+        replay();
+        G3D::SystemAlloc::stopProfile();
+        G3D::SystemAlloc::writeProfile(filename.c_str());
+        G3D::SystemAlloc::trim();
+        G3D::SystemAlloc::reserveFromFile(filename.c_str());
+        std::remove(filename.c_str());
+    }
+
+    // Fold this thread's counters into the shared ones
+    G3D::SystemAlloc::mallocStatus();
+    G3D::SystemAlloc::Stats before;
+    G3D::SystemAlloc::mallocStats(before);
+
+    for (auto _ : state) {
+        replay();
+    }
+
+    G3D::SystemAlloc::mallocStatus();
+    G3D::SystemAlloc::Stats after;
+    G3D::SystemAlloc::mallocStats(after);
+
+    const double mallocs = (double)(after.totalMallocs - before.totalMallocs);
+    const double pooled  = (double)((after.mallocsFromTinyPool + after.mallocsFromSmallPool + after.mallocsFromMedPool) -
+                                    (before.mallocsFromTinyPool + before.mallocsFromSmallPool + before.mallocsFromMedPool));
+    state.counters["fallthrough"] = (mallocs > 0) ? (1.0 - pooled / mallocs) : 0.0;
+    state.SetItemsProcessed(state.iterations() * count);
+
+    // Leave the default pools to the following benchmarks
+    G3D::SystemAlloc::setPoolLimits((size_t)defaults.maxSmallBuffers, (size_t)defaults.maxMedBuffers);
+    G3D::SystemAlloc::trim();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////
+// Frees state.range(0) small and medium blocks in random order, so that free() finds 
+// neither the block nor its header in the cache. The sized variant needs no header.
+// The blocks fit into the pools, so that ::malloc and ::free are not measured.
+template<bool sized>
+static void BM_PoolFreeColdBlocks(benchmark::State& state)
+{
+    const std::vector<size_t> sizes = RequestSizes(state.range(0), 256, 8192);
+    std::vector<size_t> order(sizes.size());
+    for (size_t i = 0; i < order.size(); ++i) {
+        order[i] = i;
+    }
+    uint32_t seed = 99;
+    for (size_t i = order.size() - 1; i > 0; --i) {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        std::swap(order[i], order[seed % (i + 1)]);
+    }
+
+    std::vector<void*> blocks(sizes.size());
+    for (auto _ : state) {
+        for (size_t i = 0; i < sizes.size(); ++i) {
+            blocks[i] = sized ? G3D::SystemAlloc::mallocSized(sizes[i]) : G3D::SystemAlloc::malloc(sizes[i]);
+        }
+        benchmark::DoNotOptimize(blocks.data());
+        for (size_t i : order) {
+            if (sized) {
+                G3D::SystemAlloc::freeSized(blocks[i], sizes[i]);
+            } else {
+                G3D::SystemAlloc::free(blocks[i]);
+            }
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * sizes.size());
+}
+
+////////////////////////////////////////////////////////////////////////////////////////
+// Allocates and frees state.range(0) cache line aligned buffers (e.g. for SIMD code) of
+// small and medium sizes through a pmr::memory_resource
+template<bool pool>
+static void BM_AlignedBuffers(benchmark::State& state)
+{
+    const std::vector<size_t> sizes = RequestSizes(state.range(0), 0, 4096);
+    g3d_buffer_pool_resource poolResource;
+    std::pmr::memory_resource* resource = pool ? &poolResource : std::pmr::new_delete_resource();
+
+    std::vector<void*> blocks(sizes.size());
+    for (auto _ : state) {
+        for (size_t i = 0; i < sizes.size(); ++i) {
+            blocks[i] = resource->allocate(sizes[i], 64);
+        }
+        benchmark::DoNotOptimize(blocks.data());
+        for (size_t i = 0; i < sizes.size(); ++i) {
+            resource->deallocate(blocks[i], sizes[i], 64);
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * sizes.size());
+}
+
+////////////////////////////////////////////////////////////////////////////////////////
+// Two-stage pipeline: a producer thread allocates state.range(0) strings of up to 256 
+// bytes and hands them over a ring buffer to a consumer thread, which frees them. 
+// Compare builds with and without NO_REMOTE_FREE (PoolAllocator.cpp), which makes
+// every freed buffer go back to the producer through the shared pool's lock.
+template<bool pool>
+static void BM_ProducerConsumerStrings(benchmark::State& state)
+{
+    const std::vector<size_t> sizes = RequestSizes(state.range(0), 64, 256);
+
+    enum {ringSize = 1024};
+    std::vector<void*> ring(ringSize);
+    std::atomic<size_t> produced(0);
+    std::atomic<size_t> consumed(0);
+
+    for (auto _ : state) {
+        produced = 0;
+        consumed = 0;
+
+        std::thread consumer([&] {
+            for (size_t i = 0; i < sizes.size(); ++i) {
+                while (produced.load(std::memory_order_acquire) == i) {
+                    std::this_thread::yield();
+                }
+                void* ptr = ring[i % ringSize];
+                if (pool) {
+                    G3D::SystemAlloc::freeSized(ptr, sizes[i]);
+                } else {
+                    std::free(ptr);
+                }
+                consumed.store(i + 1, std::memory_order_release);
+            }
+        });
+
+        for (size_t i = 0; i < sizes.size(); ++i) {
+            while (i - consumed.load(std::memory_order_acquire) == ringSize) {
+                std::this_thread::yield();
+            }
+            void* ptr = pool ? G3D::SystemAlloc::mallocSized(sizes[i]) : std::malloc(sizes[i]);
+            static_cast<char*>(ptr)[0] = 'x';
+            ring[i % ringSize] = ptr;
+            produced.store(i + 1, std::memory_order_release);
+        }
+        consumer.join();
+    }
+    state.SetItemsProcessed(state.iterations() * sizes.size());
+}
+
+////////////////////////////////////////////////////////////////////////////////////////
+// Touches state.range(0) live tiny blocks in random order; with a large working set this 
+// is bound by dTLB misses, so compare builds with and without HUGE_PAGES (PoolAllocator.cpp)
+static void BM_TinyHeapRandomAccess(benchmark::State& state)
+{
+    const std::vector<size_t> sizes = RequestSizes(state.range(0), 0, 256);
+    std::vector<uint8_t*> blocks(sizes.size());
+    for (size_t i = 0; i < sizes.size(); ++i) {
+        blocks[i] = static_cast<uint8_t*>(G3D::SystemAlloc::malloc(sizes[i]));
+        blocks[i][0] = 0;
+    }
+
+    // Shuffle with the same xorshift as RequestSizes, so that neighbours in the
+    // access order live on different pages
+    uint32_t seed = 4242;
+    for (size_t i = blocks.size() - 1; i > 0; --i) {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        std::swap(blocks[i], blocks[seed % (i + 1)]);
+    }
+
+    for (auto _ : state) {
+        for (uint8_t* p : blocks) {
+            ++p[0];
+        }
+        benchmark::ClobberMemory();
+    }
+    state.SetItemsProcessed(state.iterations() * blocks.size());
+
+    for (uint8_t* p : blocks) {
+        G3D::SystemAlloc::free(p);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////
+// Threads sharing one G3D::PoolHeap, which has no per-thread caches, so that every malloc 
+// and free takes the heap's lock; with more threads than cores, lock holders get preempted
+static void BM_PoolHeapContention(benchmark::State& state)
+{
+    static G3D::PoolHeap heap;
+    const std::vector<size_t> sizes = RequestSizes(64, 16, 1024, 4242 + state.thread_index());
+    std::vector<void*> blocks(sizes.size());
+
+    for (auto _ : state) {
+        for (size_t i = 0; i < sizes.size(); ++i) {
+            blocks[i] = heap.malloc(sizes[i]);
+        }
+        for (void* p : blocks) {
+            heap.free(p);
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * sizes.size());
+}
+
+////////////////////////////////////////////////////////////////////////////////////////
+// Frame-scoped strings: each iteration builds state.range(0) strings that spill out of 
+// SIMDString's internal buffer (or std::string's SSO) and then drops all of them
+
+static const std::string& FrameText() {
+    static const std::string text(1024, 'x');
+    return text;
+}
+
+// Every string is freed to G3D::SystemAlloc on destruction
+static void BM_FrameStringsPool(benchmark::State& state)
+{
+    typedef SIMDString<64, G3D::g3d_pool_allocator<char>> Str;
+    const std::vector<size_t> sizes = RequestSizes(state.range(0), 64, 512);
+    std::vector<Str> strings;
+    strings.reserve(sizes.size());
+
+    for (auto _ : state) {
+        for (size_t size : sizes) {
+            strings.emplace_back(FrameText().c_str(), size);
+        }
+        benchmark::DoNotOptimize(strings.data());
+        strings.clear();
+    }
+    state.SetItemsProcessed(state.iterations() * sizes.size());
+}
+
+// Every string is freed to a G3D::PoolHeap of this thread, which takes no lock if UNSYNCHRONIZED
+template<G3D::PoolHeap::Threading threading>
+static void BM_FrameStringsHeap(benchmark::State& state)
+{
+    typedef SIMDString<64, G3D::g3d_heap_allocator<char>> Str;
+    const std::vector<size_t> sizes = RequestSizes(state.range(0), 64, 512);
+    G3D::PoolHeap heap(threading);
+    G3D::g3d_heap_allocator<char> alloc(heap);
+    std::vector<Str> strings;
+    strings.reserve(sizes.size());
+
+    for (auto _ : state) {
+        for (size_t size : sizes) {
+            strings.emplace_back(FrameText().c_str(), size, alloc);
+        }
+        benchmark::DoNotOptimize(strings.data());
+        strings.clear();
+    }
+    state.SetItemsProcessed(state.iterations() * sizes.size());
+}
+
+// Destruction is a no-op, the arena is reset once per frame
+static void BM_FrameStringsArena(benchmark::State& state)
+{
+    typedef SIMDString<64, G3D::arena_allocator<char>> Str;
+    const std::vector<size_t> sizes = RequestSizes(state.range(0), 64, 512);
+    G3D::Arena arena;
+    G3D::arena_allocator<char> alloc(arena);
+    std::vector<Str> strings;
+    strings.reserve(sizes.size());
+
+    for (auto _ : state) {
+        for (size_t size : sizes) {
+            strings.emplace_back(FrameText().c_str(), size, alloc);
+        }
+        benchmark::DoNotOptimize(strings.data());
+        strings.clear();
+        arena.reset();
+    }
+    state.SetItemsProcessed(state.iterations() * sizes.size());
+}
+
+// std::pmr::string on top of MemoryResource, released once per frame
+template<class MemoryResource>
+static void BM_FrameStringsPmr(benchmark::State& state)
+{
+    const std::vector<size_t> sizes = RequestSizes(state.range(0), 64, 512);
+    MemoryResource resource;
+    std::vector<std::pmr::string> strings;
+    strings.reserve(sizes.size());
+
+    for (auto _ : state) {
+        for (size_t size : sizes) {
+            strings.emplace_back(FrameText().c_str(), size, &resource);
+        }
+        benchmark::DoNotOptimize(strings.data());
+        strings.clear();
+        if constexpr (std::is_same<MemoryResource, g3d_arena_resource>::value) {
+            resource.reset();
+        } else {
+            resource.release();
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * sizes.size());
+}
+
+// std::pmr::string on top of a pool resource of this thread, every string freed on its own
+template<class MemoryResource, class... Args>
+static void BM_FrameStringsPmrPool(benchmark::State& state, Args... args)
+{
+    const std::vector<size_t> sizes = RequestSizes(state.range(0), 64, 512);
+    MemoryResource resource(args...);
+    std::vector<std::pmr::string> strings;
+    strings.reserve(sizes.size());
+
+    for (auto _ : state) {
+        for (size_t size : sizes) {
+            strings.emplace_back(FrameText().c_str(), size, &resource);
+        }
+        benchmark::DoNotOptimize(strings.data());
+        strings.clear();
+    }
+    state.SetItemsProcessed(state.iterations() * sizes.size());
+}
+
+////////////////////////////////////////////////////////////////////////////////////////
+// Plain STL code that names no allocator: strings, vectors in a map and std::functions
+// capturing strings, all built and destroyed per iteration. Goes to the pool only if 
+// operator new is replaced (see TEST_POOL_OPERATOR_NEW in main.cpp).
+static void BM_StlMix(benchmark::State& state)
+{
+    const std::vector<size_t> sizes = RequestSizes(state.range(0), 0, 512);
+
+    for (auto _ : state) {
+        std::vector<std::string> names;
+        std::map<size_t, std::vector<int>> index;
+        std::vector<std::function<size_t()>> tasks;
+        for (size_t i = 0; i < sizes.size(); ++i) {
+            names.emplace_back(FrameText().data(), sizes[i]);
+            index[i].assign(sizes[i] / 16 + 1, (int)i);
+            tasks.emplace_back([name = names.back()] { return name.size(); });
+        }
+        benchmark::DoNotOptimize(tasks.data());
+    }
+    state.SetItemsProcessed(state.iterations() * sizes.size());
+}
+
+////////////////////////////////////////////////////////////////////////////////////////
+// First use of state.range(0) 2..8 KB buffers after startup (i.e. after trimming the 
+// pools), with or without SystemAlloc::reserve of twice as many medium blocks beforehand
+template<bool reserve>
+static void BM_ColdStart(benchmark::State& state)
+{
+    const std::vector<size_t> sizes = RequestSizes(state.range(0), 2048, 8192);
+    std::vector<void*> blocks(sizes.size());
+
+    for (auto _ : state) {
+        state.PauseTiming();
+        G3D::SystemAlloc::trim();
+        if (reserve) {
+            G3D::SystemAlloc::reserve(0, 0, 2 * sizes.size());
+        }
+        state.ResumeTiming();
+
+        for (size_t i = 0; i < sizes.size(); ++i) {
+            blocks[i] = G3D::SystemAlloc::mallocSized(sizes[i]);
+            memset(blocks[i], 'x', sizes[i]);
+        }
+        benchmark::DoNotOptimize(blocks.data());
+        for (size_t i = 0; i < sizes.size(); ++i) {
+            G3D::SystemAlloc::freeSized(blocks[i], sizes[i]);
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * sizes.size());
+}
+
+////////////////////////////////////////////////////////////////////////////////////////
+// Grows a buffer by doubling from 64 KB to range(0) KB, e.g. a log or a serialized document
+template<bool pool>
+static void BM_ReallocGrowth(benchmark::State& state)
+{
+    const size_t maxBytes = (size_t)state.range(0) * 1024;
+
+    for (auto _ : state) {
+        size_t bytes = 64 * 1024;
+        char* buffer = (char*)(pool ? G3D::SystemAlloc::malloc(bytes) : ::malloc(bytes));
+        memset(buffer, 'x', bytes);
+        while (bytes < maxBytes) {
+            buffer = (char*)(pool ? G3D::SystemAlloc::realloc(buffer, 2 * bytes) : ::realloc(buffer, 2 * bytes));
+            memset(buffer + bytes, 'x', bytes);
+            bytes *= 2;
+        }
+        benchmark::DoNotOptimize(buffer);
+        if (pool) {
+            G3D::SystemAlloc::free(buffer);
+        } else {
+            ::free(buffer);
+        }
+    }
+    state.SetBytesProcessed(state.iterations() * maxBytes);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////
+// Shader sources: keeps state.range(0) strings of 16 to 512 KB alive and replaces one 
+// at random per iteration, so that freed blocks are split and merged again
+template<class Alloc>
+static void BM_LargeStrings(benchmark::State& state)
+{
+    typedef SIMDString<64, Alloc> Str;
+    const std::vector<size_t> sizes = RequestSizes(4096, 16 * 1024, 512 * 1024);
+    const std::string source(512 * 1024, 'x');
+
+    std::vector<Str> live;
+    for (size_t i = 0; i < (size_t)state.range(0); ++i) {
+        live.emplace_back(source.data(), sizes[i % sizes.size()]);
+    }
+
+    size_t next = 0;
+    for (auto _ : state) {
+        const size_t i = sizes[next % sizes.size()] % live.size();
+        live[i] = Str();
+        live[i] = Str(source.data(), sizes[(next + 1) % sizes.size()]);
+        benchmark::DoNotOptimize(live[i].data());
+        ++next;
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+////////////////////////////////////////////////////////////////////////////////////////
+// Allocates and frees state.range(0) blocks of small and medium sizes, one at a time
+// or with a single SystemAlloc::mallocBatch and freeBatch call
+template<bool batch>
+static void BM_PoolBatch(benchmark::State& state)
+{
+    const std::vector<size_t> sizes = RequestSizes(state.range(0), 0, 2048);
+    std::vector<void*> blocks(sizes.size());
+
+    for (auto _ : state) {
+        if (batch) {
+            G3D::SystemAlloc::mallocBatch(sizes.data(), sizes.size(), blocks.data());
+        } else {
+            for (size_t i = 0; i < sizes.size(); ++i) {
+                blocks[i] = G3D::SystemAlloc::malloc(sizes[i]);
+            }
+        }
+        benchmark::DoNotOptimize(blocks.data());
+        if (batch) {
+            G3D::SystemAlloc::freeBatch(blocks.data(), blocks.size());
+        } else {
+            for (void* ptr : blocks) {
+                G3D::SystemAlloc::free(ptr);
+            }
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * sizes.size());
+}
+
+////////////////////////////////////////////////////////////////////////////////////////
+// Builds a string of state.range(0) characters with push_back, as a tokenizer or formatter does;
+// the number of reallocations depends on how much of each block the string may use
+template<class Alloc>
+static void BM_PushBackGrowth(benchmark::State& state)
+{
+    const size_t length = state.range(0);
+
+    for (auto _ : state) {
+        SIMDString<64, Alloc> s;
+        for (size_t i = 0; i < length; ++i) {
+            s.push_back((char)('a' + i % 26));
+        }
+        benchmark::DoNotOptimize(s.data());
+    }
+    state.SetItemsProcessed(state.iterations() * length);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////
+// A symbol table: inserts state.range(0) string keys of 8 to 100 characters into an unordered_map 
+// and erases them again, all nodes, buckets and long keys coming from Alloc rebound
+template<class Alloc>
+static void BM_UnorderedMapStrings(benchmark::State& state)
+{
+    typedef SIMDString<64, Alloc> Str;
+    typedef typename std::allocator_traits<Alloc>::template rebind_alloc<std::pair<const Str, int>> NodeAlloc;
+    const std::vector<size_t> sizes = RequestSizes(state.range(0), 8, 100);
+    std::vector<std::string> keys;
+    for (size_t i = 0; i < sizes.size(); ++i) {
+        keys.push_back(std::to_string(i) + FrameText().substr(0, sizes[i]));
+    }
+
+    for (auto _ : state) {
+        std::unordered_map<Str, int, std::hash<Str>, std::equal_to<Str>, NodeAlloc> table;
+        for (size_t i = 0; i < keys.size(); ++i) {
+            table.emplace(Str(keys[i].c_str()), (int)i);
+        }
+        for (const std::string& key : keys) {
+            table.erase(Str(key.c_str()));
+        }
+        benchmark::DoNotOptimize(table.size());
+    }
+    state.SetItemsProcessed(state.iterations() * keys.size());
+}
+
+////////////////////////////////////////////////////////////////////////////////////////
+// Inserts state.range(0) entries into a std::map and a std::list and erases every other one, 
+// so that the node freelists are reused in a scattered order
+template<class Alloc>
+static void BM_MapAndListNodes(benchmark::State& state)
+{
+    typedef typename std::allocator_traits<Alloc>::template rebind_alloc<std::pair<const int, double>> MapAlloc;
+    typedef typename std::allocator_traits<Alloc>::template rebind_alloc<double> ListAlloc;
+    const int count = (int)state.range(0);
+
+    for (auto _ : state) {
+        std::map<int, double, std::less<int>, MapAlloc> map;
+        std::list<double, ListAlloc> list;
+        for (int i = 0; i < count; ++i) {
+            map.emplace((i * 7919) % count, i);
+            list.push_back(i);
+        }
+        for (int i = 0; i < count; i += 2) {
+            map.erase(i);
+            list.pop_front();
+        }
+        for (int i = 0; i < count; i += 2) {
+            map.emplace(i, i);
+            list.push_back(i);
+        }
+        benchmark::DoNotOptimize(map.size() + list.size());
+    }
+    state.SetItemsProcessed(state.iterations() * count * 2);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////
+// Loading a table: builds state.range(0) strings from string_views and clears the table, 
+// constructing the strings one at a time or with G3D::makeSIMDStrings
+template<bool batch>
+static void BM_StringTable(benchmark::State& state)
+{
+    typedef SIMDString<64, G3D::g3d_pool_allocator<char>> Str;
+    const std::vector<size_t> sizes = RequestSizes(state.range(0), 64, 512);
+    std::vector<std::string_view> views;
+    for (size_t size : sizes) {
+        views.emplace_back(FrameText().data(), size);
+    }
+
+    for (auto _ : state) {
+        std::vector<Str> table;
+        if (batch) {
+            table = G3D::makeSIMDStrings(views);
+        } else {
+            table.reserve(views.size());
+            for (const std::string_view& view : views) {
+                table.emplace_back(view.data(), view.size());
+            }
+        }
+        benchmark::DoNotOptimize(table.data());
+    }
+    state.SetItemsProcessed(state.iterations() * sizes.size());
+}
+
+////////////////////////////////////////////////////////////////////////////////////////
+// This is where the allocator benchmarks are programmatically registered .
+void RegisterAllocatorBenchmarks() {
+    benchmark::RegisterBenchmark("BM_PoolMallocFilledFreeList", BM_PoolMallocFilledFreeList)
+        ->Arg(0)->Arg(1000)->Arg(10000)->Arg(40000);
+
+    benchmark::RegisterBenchmark("BM_PoolChurn", BM_PoolChurn)
+        ->Arg(20000)->Arg(60000);
+
+    benchmark::RegisterBenchmark("BM_ProfiledTrace<default config>", BM_ProfiledTrace<false>)
+        ->Arg(20000)->Arg(60000);
+    benchmark::RegisterBenchmark("BM_ProfiledTrace<tuned config>", BM_ProfiledTrace<true>)
+        ->Arg(20000)->Arg(60000);
+
+    benchmark::RegisterBenchmark("BM_PoolFreeColdBlocks<malloc>", BM_PoolFreeColdBlocks<false>)
+        ->Arg(1000)->Arg(4000);
+    benchmark::RegisterBenchmark("BM_PoolFreeColdBlocks<mallocSized>", BM_PoolFreeColdBlocks<true>)
+        ->Arg(1000)->Arg(4000);
+
+    benchmark::RegisterBenchmark("BM_AlignedBuffers<g3d_buffer_pool_resource>", BM_AlignedBuffers<true>)
+        ->Arg(100)->Arg(1000);
+    benchmark::RegisterBenchmark("BM_AlignedBuffers<new_delete_resource>", BM_AlignedBuffers<false>)
+        ->Arg(100)->Arg(1000);
+
+    benchmark::RegisterBenchmark("BM_ProducerConsumerStrings<SystemAlloc>", BM_ProducerConsumerStrings<true>)
+        ->Arg(100000)->UseRealTime();
+    benchmark::RegisterBenchmark("BM_ProducerConsumerStrings<malloc>", BM_ProducerConsumerStrings<false>)
+        ->Arg(100000)->UseRealTime();
+
+    benchmark::RegisterBenchmark("BM_PoolHeapContention", BM_PoolHeapContention)
+        ->Threads(1)->Threads(4)->Threads(16)->UseRealTime();
+
+    benchmark::RegisterBenchmark("BM_TinyHeapRandomAccess", BM_TinyHeapRandomAccess)
+        ->Arg(1 << 12)->Arg(1 << 16)->Arg(1 << 18);
+
+#ifdef TEST_POOL_OPERATOR_NEW
+    benchmark::RegisterBenchmark("BM_StlMix<pool operator new>", BM_StlMix)
+        ->Arg(1000)->Arg(10000);
+#else
+    benchmark::RegisterBenchmark("BM_StlMix<default operator new>", BM_StlMix)
+        ->Arg(1000)->Arg(10000);
+#endif
+
+    benchmark::RegisterBenchmark("BM_ColdStart<no reserve>", BM_ColdStart<false>)
+        ->Arg(100)->Arg(1000);
+    benchmark::RegisterBenchmark("BM_ColdStart<reserve>", BM_ColdStart<true>)
+        ->Arg(100)->Arg(1000);
+
+    benchmark::RegisterBenchmark("BM_ReallocGrowth<SystemAlloc>", BM_ReallocGrowth<true>)
+        ->Arg(1024)->Arg(16 * 1024);
+    benchmark::RegisterBenchmark("BM_ReallocGrowth<malloc>", BM_ReallocGrowth<false>)
+        ->Arg(1024)->Arg(16 * 1024);
+
+    benchmark::RegisterBenchmark("BM_LargeStrings<std::allocator>", BM_LargeStrings<std::allocator<char>>)
+        ->Arg(16)->Arg(256);
+    benchmark::RegisterBenchmark("BM_LargeStrings<g3d_pool_allocator>", BM_LargeStrings<G3D::g3d_pool_allocator<char>>)
+        ->Arg(16)->Arg(256);
+
+    benchmark::RegisterBenchmark("BM_PoolBatch<malloc, free>", BM_PoolBatch<false>)
+        ->Arg(1000)->Arg(100000);
+    benchmark::RegisterBenchmark("BM_PoolBatch<mallocBatch, freeBatch>", BM_PoolBatch<true>)
+        ->Arg(1000)->Arg(100000);
+
+    benchmark::RegisterBenchmark("BM_PushBackGrowth<std::allocator>", BM_PushBackGrowth<std::allocator<char>>)
+        ->Arg(100)->Arg(1000)->Arg(10000);
+    benchmark::RegisterBenchmark("BM_PushBackGrowth<g3d_pool_allocator>", BM_PushBackGrowth<G3D::g3d_pool_allocator<char>>)
+        ->Arg(100)->Arg(1000)->Arg(10000);
+
+    benchmark::RegisterBenchmark("BM_UnorderedMapStrings<std::allocator>", BM_UnorderedMapStrings<std::allocator<char>>)
+        ->Arg(1000)->Arg(100000);
+    benchmark::RegisterBenchmark("BM_UnorderedMapStrings<g3d_pool_allocator>", BM_UnorderedMapStrings<G3D::g3d_pool_allocator<char>>)
+        ->Arg(1000)->Arg(100000);
+    benchmark::RegisterBenchmark("BM_MapAndListNodes<std::allocator>", BM_MapAndListNodes<std::allocator<char>>)
+        ->Arg(1000)->Arg(100000);
+    benchmark::RegisterBenchmark("BM_MapAndListNodes<g3d_pool_allocator>", BM_MapAndListNodes<G3D::g3d_pool_allocator<char>>)
+        ->Arg(1000)->Arg(100000);
+
+    benchmark::RegisterBenchmark("BM_StringTable<per string>", BM_StringTable<false>)
+        ->Arg(1000)->Arg(100000);
+    benchmark::RegisterBenchmark("BM_StringTable<makeSIMDStrings>", BM_StringTable<true>)
+        ->Arg(1000)->Arg(100000);
+
+    benchmark::RegisterBenchmark("BM_FrameStrings<SIMDString, g3d_pool_allocator>", BM_FrameStringsPool)
+        ->Arg(100)->Arg(1000)->Arg(10000);
+    benchmark::RegisterBenchmark("BM_FrameStrings<SIMDString, g3d_heap_allocator, SYNCHRONIZED>", BM_FrameStringsHeap<G3D::PoolHeap::SYNCHRONIZED>)
+        ->Arg(100)->Arg(1000)->Arg(10000);
+    benchmark::RegisterBenchmark("BM_FrameStrings<SIMDString, g3d_heap_allocator, UNSYNCHRONIZED>", BM_FrameStringsHeap<G3D::PoolHeap::UNSYNCHRONIZED>)
+        ->Arg(100)->Arg(1000)->Arg(10000);
+    benchmark::RegisterBenchmark("BM_FrameStrings<SIMDString, arena_allocator>", BM_FrameStringsArena)
+        ->Arg(100)->Arg(1000)->Arg(10000);
+    benchmark::RegisterBenchmark("BM_FrameStrings<pmr::string, monotonic_buffer_resource>", BM_FrameStringsPmr<std::pmr::monotonic_buffer_resource>)
+        ->Arg(100)->Arg(1000)->Arg(10000);
+    benchmark::RegisterBenchmark("BM_FrameStrings<pmr::string, g3d_arena_resource>", BM_FrameStringsPmr<g3d_arena_resource>)
+        ->Arg(100)->Arg(1000)->Arg(10000);
+    benchmark::RegisterBenchmark("BM_FrameStrings<pmr::string, g3d_buffer_pool_resource>", BM_FrameStringsPmrPool<g3d_buffer_pool_resource>)
+        ->Arg(100)->Arg(1000)->Arg(10000);
+    benchmark::RegisterBenchmark("BM_FrameStrings<pmr::string, g3d_pool_heap_resource, UNSYNCHRONIZED>", 
+                                 BM_FrameStringsPmrPool<g3d_pool_heap_resource, G3D::PoolHeap::Threading>, G3D::PoolHeap::UNSYNCHRONIZED)
+        ->Arg(100)->Arg(1000)->Arg(10000);
+    benchmark::RegisterBenchmark("BM_FrameStrings<pmr::string, unsynchronized_pool_resource>", BM_FrameStringsPmrPool<std::pmr::unsynchronized_pool_resource>)
+        ->Arg(100)->Arg(1000)->Arg(10000);
+}
+
+#endif
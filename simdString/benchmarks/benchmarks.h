@@ -501,6 +501,7 @@ static void BM_Swap(benchmark::State& state)
 
 ////////////////////////////////////////////////////////////////////////////////////////
 // This is where the benchmarks are programmatically registered .
+template<class Str>
 void RegisterBenchmarks(const char* classname) {
     // buffer for formatting the benchmark name string into RegisterBenchmark
     char buffer[512];
@@ -1,6 +1,8 @@
 //#define TEST_EASTL
 //#define TEST_FOLLY
 #define TEST_G3D_ALLOC
+//#define TEST_POOL_ALLOC
+//#define TEST_POOL_OPERATOR_NEW // with TEST_POOL_ALLOC: replace the global operator new
 
 
 #include "SIMDString.h"
@@ -18,6 +20,13 @@
 #   include <G3D/G3D.h>
 #endif
 
+#ifdef TEST_POOL_ALLOC
+#   include "allocatorBenchmarks.h"
+#   ifdef TEST_POOL_OPERATOR_NEW
+#       include "PoolOperatorNew.h"
+#   endif
+#endif
+
 
 int main(int argc, const char* argv[]) {
     // __VA_ARGS_ is necessary because type templating messes up Macro argument parsing
@@ -31,6 +40,11 @@ int main(int argc, const char* argv[]) {
     REGISTER_CLASS_BENCHMARKS(SIMDString<64, G3D::g3d_allocator<char>>); 
 #   endif
 
+#   ifdef TEST_POOL_ALLOC
+    REGISTER_CLASS_BENCHMARKS(SIMDString<64, G3D::g3d_pool_allocator<char>>); 
+    RegisterAllocatorBenchmarks();
+#   endif
+
 #   ifdef TEST_EASTL
     REGISTER_CLASS_BENCHMARKS(eastl::string); 
 #   endif
@@ -884,15 +884,305 @@ TEST(SIMDStringTest, CompileError){
 }
 
 TEST(SIMDStringTest, Reserve){
+  // allocators with allocate_at_least may return more
+  const bool atLeast = SIMDStringCanAllocateAtLeast<SIMDString<>::allocator_type>::value;
+
   SIMDString simdstring1;
   simdstring1.reserve(1 << 21);
-  EXPECT_EQ((1 << 21) + 1, simdstring1.capacity());
+  if (atLeast) {
+    EXPECT_LE((1 << 21) + 1, simdstring1.capacity());
+  } else {
+    EXPECT_EQ((1 << 21) + 1, simdstring1.capacity());
+  }
 
   simdstring1 = SIMDString(100, 'a');
   simdstring1.reserve();
-  EXPECT_EQ((100 + 1) * 2 + 1, simdstring1.capacity());
+  if (atLeast) {
+    EXPECT_LE((100 + 1) * 2 + 1, simdstring1.capacity());
+  } else {
+    EXPECT_EQ((100 + 1) * 2 + 1, simdstring1.capacity());
+  }
 
   simdstring1 = SIMDString(10, 'a');
   simdstring1.reserve();
   EXPECT_EQ(64, simdstring1.capacity());
 }
+
+#ifdef TEST_SIMD_STRG_ALLOCATOR
+// Link with src/PoolAllocator.cpp and src/ArenaAllocator.cpp
+#include <ArenaAllocator.h>
+#include <cstdio>
+#include <vector>
+
+TEST(SIMDStringTest, CapacityIsUsableSize){
+  // The whole block of allocate_at_least is the capacity
+  for (size_t length : {100, 300, 1000, 3000, 20000}) {
+    SIMDString<64, G3D::g3d_pool_allocator<char>> simdstring1(length, 'a');
+    const size_t requested = 2 * (length + 1) + 1;
+    EXPECT_LE(requested, simdstring1.capacity());
+    EXPECT_EQ(G3D::SystemAlloc::usableSize(simdstring1.data(), requested), simdstring1.capacity());
+  }
+}
+
+// Copy, move and swap with stateful allocators, which propagate on all three
+template<class Allocator>
+static void testStatefulAllocator(const Allocator& a, const Allocator& b)
+{
+  typedef SIMDString<64, Allocator> Str;
+  const std::string longString(sampleString);
+  const std::string otherString(100, 'b');
+
+  // Copy from heap, buffer and const storage into empty and filled strings
+  for (const char* source : {(const char*)sampleString, "short", "a literal in the const segment that is longer than 64 chars..."}) {
+    for (const Allocator* target : {&a, &b}) {
+      Str x(source, a);
+      Str empty(*target);
+      empty = x;
+      EXPECT_STREQ(empty.c_str(), source);
+      EXPECT_EQ(empty.size(), x.size());
+      EXPECT_TRUE(empty.get_allocator() == a);
+
+      Str filled(otherString.c_str(), *target);
+      filled = x;
+      EXPECT_STREQ(filled.c_str(), source);
+      EXPECT_EQ(filled.size(), x.size());
+      EXPECT_TRUE(filled.get_allocator() == a);
+      EXPECT_STREQ(x.c_str(), source);
+    }
+  }
+
+  // Move
+  for (const Allocator* target : {&a, &b}) {
+    Str x(sampleString, a);
+    const char* data = x.c_str();
+    Str y(otherString.c_str(), *target);
+    y = std::move(x);
+    EXPECT_STREQ(y.c_str(), longString.c_str());
+    EXPECT_EQ(y.c_str(), data);
+    EXPECT_TRUE(y.get_allocator() == a);
+
+    Str z(std::move(y));
+    EXPECT_STREQ(z.c_str(), longString.c_str());
+    EXPECT_TRUE(z.get_allocator() == a);
+  }
+
+  // Swap
+  for (const Allocator* target : {&a, &b}) {
+    Str x(sampleString, a);
+    Str y(otherString.c_str(), *target);
+    x.swap(y);
+    EXPECT_STREQ(x.c_str(), otherString.c_str());
+    EXPECT_STREQ(y.c_str(), longString.c_str());
+    EXPECT_TRUE(x.get_allocator() == *target);
+    EXPECT_TRUE(y.get_allocator() == a);
+    x += "x";
+    y += "y";
+    EXPECT_EQ(x.size(), otherString.size() + 1);
+    EXPECT_EQ(y.size(), longString.size() + 1);
+  }
+}
+
+TEST(SIMDStringTest, HeapAllocator){
+  G3D::PoolHeap heapA;
+  G3D::PoolHeap heapB;
+  testStatefulAllocator(G3D::g3d_heap_allocator<char>(heapA), G3D::g3d_heap_allocator<char>(heapB));
+}
+
+TEST(SIMDStringTest, HeapSized){
+  G3D::PoolHeap heap;
+  const size_t sizes[] = {8, 100, 3000, 20000, 300000};
+  const size_t alignments[] = {8, 16, 64, 4096};
+  std::vector<void*> kept;
+  for (size_t bytes : sizes) {
+    for (size_t alignment : alignments) {
+      char* p = (char*)heap.mallocSized(bytes, alignment);
+      ASSERT_NE(nullptr, p);
+      EXPECT_EQ(0u, (uintptr_t)p % alignment);
+      memset(p, 'a', bytes);
+      heap.freeSized(p, bytes, alignment);
+
+      // Left for release()
+      p = (char*)heap.mallocSized(bytes, alignment);
+      ASSERT_NE(nullptr, p);
+      EXPECT_EQ(0u, (uintptr_t)p % alignment);
+      memset(p, 'b', bytes);
+      kept.push_back(p);
+    }
+  }
+  heap.trim(0);
+  heap.release();
+
+  void* p = heap.mallocSized(100, 64);
+  ASSERT_NE(nullptr, p);
+  heap.freeSized(p, 100, 64);
+}
+
+TEST(SIMDStringTest, ArenaAllocator){
+  G3D::Arena arenaA;
+  G3D::Arena arenaB;
+  testStatefulAllocator(G3D::arena_allocator<char>(arenaA), G3D::arena_allocator<char>(arenaB));
+}
+
+TEST(SIMDStringTest, ArenaReset){
+  G3D::Arena arena;
+  for (int i = 0; i < 100; ++i) {
+    ASSERT_NE(nullptr, arena.allocate(1000));
+  }
+  const size_t regular = arena.bytesReserved();
+
+  // A request too large for a regular chunk must not be pinned by reset()
+  ASSERT_NE(nullptr, arena.allocate(8 * 1024 * 1024));
+  arena.reset();
+  EXPECT_EQ(0u, arena.bytesAllocated());
+  EXPECT_LT(arena.bytesReserved(), regular);
+  EXPECT_LE(arena.bytesReserved(), size_t(G3D::Arena::maxChunkSize) + 64);
+
+  // The kept chunk serves the next round
+  const size_t kept = arena.bytesReserved();
+  ASSERT_NE(nullptr, arena.allocate(1000));
+  EXPECT_EQ(kept, arena.bytesReserved());
+}
+
+TEST(SystemAllocTest, ReallocSized){
+  // Tiny buffers, small and medium bins, buddy blocks and extents
+  const size_t sizes[] = {100, 500, 5000, 20000, 300000, 3000000};
+  for (size_t from : sizes) {
+    for (size_t to : sizes) {
+      char* p = (char*)G3D::SystemAlloc::mallocSized(from);
+      ASSERT_NE(nullptr, p);
+      memset(p, 'a', from);
+      p = (char*)G3D::SystemAlloc::reallocSized(p, from, to);
+      ASSERT_NE(nullptr, p);
+      EXPECT_EQ('a', p[0]);
+      EXPECT_EQ('a', p[((from < to) ? from : to) - 1]);
+      EXPECT_LE(to, G3D::SystemAlloc::usableSize(p, to));
+      memset(p, 'b', to);
+      G3D::SystemAlloc::freeSized(p, to);
+
+      // The freed block must be reused as a block of its new size only
+      char* q = (char*)G3D::SystemAlloc::mallocSized(to);
+      ASSERT_NE(nullptr, q);
+      memset(q, 'c', to);
+      G3D::SystemAlloc::freeSized(q, to);
+    }
+  }
+  G3D::SystemAlloc::trim(0);
+}
+
+TEST(SystemAllocTest, ReserveFromFile){
+  typedef G3D::SystemAlloc::Stats Stats;
+  const char* filename = "SystemAllocTest_reserve.cfg";
+
+  FILE* file = fopen(filename, "w");
+  ASSERT_NE(nullptr, file);
+  fputs("bogus = 1\n", file);
+  fclose(file);
+  EXPECT_FALSE(G3D::SystemAlloc::reserveFromFile(filename));
+
+  file = fopen(filename, "w");
+  ASSERT_NE(nullptr, file);
+  fputs("# limits and blocks\n"
+        "maxSmallBuffers = 50000\n"
+        "maxMedBuffers   = 6000\n"
+        "prefault = 0\n"
+        "\n"
+        "blocks.1024 = 10\n"
+        "mallocBlocks.4096 = 20\n", file);
+  fclose(file);
+
+  G3D::SystemAlloc::trim(0);
+  Stats before;
+  G3D::SystemAlloc::mallocStats(before);
+  EXPECT_TRUE(G3D::SystemAlloc::reserveFromFile(filename));
+  remove(filename);
+
+  Stats reserved;
+  G3D::SystemAlloc::mallocStats(reserved);
+  EXPECT_EQ(50000u, reserved.maxSmallBuffers);
+  EXPECT_EQ(6000u, reserved.maxMedBuffers);
+  EXPECT_EQ(before.buffersFree[Stats::SMALL_POOL] + 10, reserved.buffersFree[Stats::SMALL_POOL]);
+  EXPECT_EQ(before.buffersFree[Stats::MED_POOL] + 20, reserved.buffersFree[Stats::MED_POOL]);
+
+  // The blocks of mallocBlocks serve malloc
+  void* p = G3D::SystemAlloc::malloc(4096);
+  Stats used;
+  G3D::SystemAlloc::mallocStats(used);
+  EXPECT_LT(used.buffersFree[Stats::MED_POOL], reserved.buffersFree[Stats::MED_POOL]);
+  G3D::SystemAlloc::free(p);
+
+  // reserve() of either kind, and of the tiny heap after trim decommitted it
+  EXPECT_LT(0u, G3D::SystemAlloc::reserve(0, 40, 0, false, G3D::SystemAlloc::MALLOC_BLOCKS));
+  G3D::SystemAlloc::mallocStats(used);
+  EXPECT_LE(reserved.buffersFree[Stats::SMALL_POOL] + 40, used.buffersFree[Stats::SMALL_POOL]);
+
+  std::vector<void*> tiny;
+  for (int i = 0; i < 10000; ++i) {
+    tiny.push_back(G3D::SystemAlloc::mallocSized(64));
+  }
+  for (void* t : tiny) {
+    G3D::SystemAlloc::freeSized(t, 64);
+  }
+  G3D::SystemAlloc::trim(0);
+  EXPECT_LT(0u, G3D::SystemAlloc::reserve(10000, 0, 0, true));
+
+  G3D::SystemAlloc::setPoolLimits(40000, 5000);
+  G3D::SystemAlloc::trim(0);
+}
+
+TEST(SystemAllocTest, WriteProfile){
+  typedef G3D::SystemAlloc::Stats Stats;
+  const char* filename = "SystemAllocTest_profile.cfg";
+
+  // Live blocks of malloc and of mallocSized in different bins
+  G3D::SystemAlloc::startProfile();
+  std::vector<void*> header;
+  std::vector<void*> sized;
+  for (int i = 0; i < 30; ++i) {
+    header.push_back(G3D::SystemAlloc::malloc(4000));
+  }
+  for (int i = 0; i < 20; ++i) {
+    sized.push_back(G3D::SystemAlloc::mallocSized(1000));
+  }
+  for (void* p : header) {
+    G3D::SystemAlloc::free(p);
+  }
+  for (void* p : sized) {
+    G3D::SystemAlloc::freeSized(p, 1000);
+  }
+  G3D::SystemAlloc::stopProfile();
+  ASSERT_TRUE(G3D::SystemAlloc::writeProfile(filename));
+
+  std::string config;
+  FILE* file = fopen(filename, "r");
+  ASSERT_NE(nullptr, file);
+  char line[256];
+  while (fgets(line, sizeof(line), file) != nullptr) {
+    config += line;
+  }
+  fclose(file);
+  EXPECT_NE(std::string::npos, config.find("\nmallocBlocks.4096 = 30\n"));
+  EXPECT_NE(std::string::npos, config.find("\nblocks.1024 = 20\n"));
+  EXPECT_EQ(std::string::npos, config.find("\nblocks.4096"));
+  EXPECT_EQ(std::string::npos, config.find("\nmallocBlocks.1024"));
+
+  // Read back, the blocks are reserved for the kind that allocated them
+  G3D::SystemAlloc::trim(0);
+  Stats before;
+  G3D::SystemAlloc::mallocStats(before);
+  EXPECT_TRUE(G3D::SystemAlloc::reserveFromFile(filename));
+  remove(filename);
+  Stats reserved;
+  G3D::SystemAlloc::mallocStats(reserved);
+  EXPECT_EQ(before.buffersFree[Stats::MED_POOL] + 30, reserved.buffersFree[Stats::MED_POOL]);
+  EXPECT_EQ(before.buffersFree[Stats::SMALL_POOL] + 20, reserved.buffersFree[Stats::SMALL_POOL]);
+
+  void* p = G3D::SystemAlloc::malloc(4000);
+  Stats used;
+  G3D::SystemAlloc::mallocStats(used);
+  EXPECT_LT(used.buffersFree[Stats::MED_POOL], reserved.buffersFree[Stats::MED_POOL]);
+  G3D::SystemAlloc::free(p);
+
+  G3D::SystemAlloc::setPoolLimits(40000, 5000);
+  G3D::SystemAlloc::trim(0);
+}
+#endif
@@ -73,50 +73,179 @@
 //
 
 #include <atomic>
+#include <chrono>
+#include <cstdint>
 #include <functional>
 #include <thread>
 
-#ifndef G3D_WINDOWS
-#   include <unistd.h> // For usleep
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#   include <immintrin.h> // For _mm_pause
+#endif
+
+#ifdef __linux__
+#   include <linux/futex.h>
+#   include <sys/syscall.h>
+#   include <unistd.h>
+#elif defined(G3D_WINDOWS)
+    // For WaitOnAddress
+#   pragma comment(lib, "Synchronization.lib")
 #endif
 
 namespace G3D {
 
     /**
-       \brief A mutual exclusion lock that busy-waits when locking.
+       \brief A mutual exclusion lock that busy-waits briefly, then sleeps.
+
+       lock() first spins with exponential backoff, pausing the core between 
+       attempts, which is enough for the short critical sections of the buffer 
+       pools. If the lock is still held after that, the thread parks on a futex 
+       (WaitOnAddress on Windows, yielding elsewhere) until unlock() wakes it, 
+       so that threads waiting on a preempted owner do not burn their time slices 
+       when there are more threads than cores.
+
+       The lock word has three states: unlocked, locked, and locked with threads that 
+       may be parked. A thread marks the lock contended before it parks, and unlock() 
+       only makes the wake-up system call when the lock was marked so. Uncontended, 
+       lock() and unlock() cost one atomic compare-exchange and one exchange.
 
-       On a machine with one (significant) thread per processor core,
-       a Spinlock may be substantially faster than a mutex.
+       Counts acquisitions, contended acquisitions and the time spent waiting, see stats().
      */
     class Spinlock {
+    public:
+        /** Pauses of the last round of spinning before lock() parks the thread; 
+            the rounds pause 1, 2, 4, ... times */
+        enum {maxSpinPauses = 64};
+
+        /** Counters of a Spinlock, see stats() */
+        class Stats {
+        public:
+            uint64_t    acquisitions;
+
+            /** Acquisitions that found the lock held */
+            uint64_t    contended;
+
+            /** Contended acquisitions that had to park the thread */
+            uint64_t    parked;
+
+            /** Time spent waiting in contended acquisitions */
+            uint64_t    waitNanoseconds;
+        };
+
     private:
-        std::atomic_flag m_flag;
+        /** CONTENDED: locked, and threads may be parked on m_state */
+        enum {UNLOCKED, LOCKED, CONTENDED};
+        std::atomic<uint32_t> m_state;
+
+        // Only written by the thread holding the lock
+        std::atomic<uint64_t> m_acquisitions;
+        std::atomic<uint64_t> m_contended;
+        std::atomic<uint64_t> m_parked;
+        std::atomic<uint64_t> m_waitNanoseconds;
+
+        static inline void count(std::atomic<uint64_t>& counter, uint64_t delta) {
+            counter.store(counter.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+        }
+
+        static inline void cpuPause() {
+#       if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+            _mm_pause();
+#       elif defined(__aarch64__) && defined(__GNUC__)
+            __asm__ __volatile__("yield");
+#       endif
+        }
+
+        inline bool tryLock() {
+            uint32_t expected = UNLOCKED;
+            return (m_state.load(std::memory_order_relaxed) == UNLOCKED) &&
+                   m_state.compare_exchange_strong(expected, LOCKED, std::memory_order_acquire, std::memory_order_relaxed);
+        }
+
+        /** Sleeps while the lock is marked CONTENDED, until unlock() wakes the thread */
+        void park() {
+#       ifdef __linux__
+            syscall(SYS_futex, (uint32_t*)&m_state, FUTEX_WAIT_PRIVATE, (uint32_t)CONTENDED, nullptr, nullptr, 0);
+#       elif defined(G3D_WINDOWS)
+            uint32_t contended = CONTENDED;
+            WaitOnAddress(&m_state, &contended, sizeof(contended), INFINITE);
+#       else
+            std::this_thread::yield();
+#       endif
+        }
+
+        /** Wakes one parked thread */
+        void unpark() {
+#       ifdef __linux__
+            syscall(SYS_futex, (uint32_t*)&m_state, FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+#       elif defined(G3D_WINDOWS)
+            WakeByAddressSingle(&m_state);
+#       endif
+        }
+
+        void lockContended() {
+            const auto start = std::chrono::steady_clock::now();
+
+            // With a single core, the owner cannot release the lock while this thread spins
+            static const bool singleCore = (std::thread::hardware_concurrency() == 1);
+
+            bool acquired = false;
+            for (int pauses = 1; (pauses <= maxSpinPauses) && ! acquired; pauses *= 2) {
+                if (singleCore) {
+                    std::this_thread::yield();
+                } else {
+                    for (int i = 0; i < pauses; ++i) {
+                        cpuPause();
+                    }
+                }
+                acquired = tryLock();
+            }
+
+            if (! acquired) {
+                // Once marked CONTENDED, the lock stays so until unlocked, even when this 
+                // thread takes it, as other threads may still be parked
+                while (m_state.exchange(CONTENDED, std::memory_order_acquire) != UNLOCKED) {
+                    park();
+                }
+                count(m_parked, 1);
+            }
+
+            count(m_contended, 1);
+            count(m_waitNanoseconds, (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                         std::chrono::steady_clock::now() - start).count());
+        }
 
     public:
-        Spinlock() {
-            m_flag.clear();
+        Spinlock() : m_state(UNLOCKED), m_acquisitions(0), m_contended(0), m_parked(0), m_waitNanoseconds(0) {
         }
 
-        /** Busy waits until the lock is unlocked, then locks it
+        /** Waits until the lock is unlocked, then locks it
             exclusively.
 
             A single thread cannot re-enter
             Spinlock::lock() if already locked.
          */
         void lock() {
-            while (m_flag.test_and_set(std::memory_order_acquire)) {
-#           ifdef G3D_WINDOWS
-                Sleep(0);
-#           else
-                usleep(0);
-#           endif
+            uint32_t expected = UNLOCKED;
+            if (! m_state.compare_exchange_strong(expected, LOCKED, std::memory_order_acquire, std::memory_order_relaxed)) {
+                lockContended();
             }
+            count(m_acquisitions, 1);
         }
 
         void unlock() {
-            m_flag.clear(std::memory_order_release);
+            if (m_state.exchange(UNLOCKED, std::memory_order_release) == CONTENDED) {
+                unpark();
+            }
         }
 
+        /** Snapshot of the counters, read without taking the lock */
+        Stats stats() const {
+            Stats s;
+            s.acquisitions    = m_acquisitions.load(std::memory_order_relaxed);
+            s.contended       = m_contended.load(std::memory_order_relaxed);
+            s.parked          = m_parked.load(std::memory_order_relaxed);
+            s.waitNanoseconds = m_waitNanoseconds.load(std::memory_order_relaxed);
+            return s;
+        }
     };
 
 } // namespace
@@ -0,0 +1,107 @@
+/**
+  \file ArenaAllocator.cpp
+
+  mrkkrj: a bump-pointer arena on top of the G3D::SystemAlloc buffer pools
+*/
+
+
+#include "AllocatorPlatform.h"
+#include "ArenaAllocator.h"
+#include "DebugHelpers.h"
+
+
+namespace G3D {
+
+/** Chunk headers are padded so that the chunk's memory starts 16 byte aligned */
+#define CHUNK_HEADER_SIZE 16
+
+Arena::Arena(size_t initialChunkSize)
+    : m_chunks(nullptr),
+      m_current(nullptr),
+      m_end(nullptr),
+      m_nextChunkSize(initialChunkSize),
+      m_bytesAllocated(0) {
+}
+
+
+Arena::~Arena() {
+    while (m_chunks != nullptr) {
+        Chunk* chunk = m_chunks;
+        m_chunks = chunk->next;
+        SystemAlloc::free(chunk);
+    }
+}
+
+
+void* Arena::allocateSlow(size_t bytes, size_t alignment) {
+    alwaysAssertM((alignment & (alignment - 1)) == 0, "alignment must be a power of 2");
+
+    // Requests that do not fit into a regular chunk get a chunk of their own
+    size_t chunkSize = m_nextChunkSize;
+    if (bytes + alignment > chunkSize) {
+        chunkSize = bytes + alignment;
+    }
+
+    Chunk* chunk = (Chunk*)SystemAlloc::malloc(CHUNK_HEADER_SIZE + chunkSize);
+    if (chunk == nullptr) {
+        return nullptr;
+    }
+    chunk->next = m_chunks;
+    chunk->size = chunkSize;
+    m_chunks    = chunk;
+
+    if (m_nextChunkSize < maxChunkSize) {
+        m_nextChunkSize *= 2;
+    }
+
+    m_current = (uint8*)chunk + CHUNK_HEADER_SIZE;
+    m_end     = m_current + chunkSize;
+
+    void* ptr = allocate(bytes, alignment);
+    debugAssert(ptr != nullptr);
+    return ptr;
+}
+
+
+void Arena::reset() {
+    // Keep the largest regular chunk. Chunks of requests that did not fit into a regular 
+    // chunk are larger than any regular one so far, i.e. than m_nextChunkSize; they go back 
+    // to SystemAlloc, so that one huge string does not pin its chunk.
+    Chunk* keep = nullptr;
+    for (Chunk* chunk = m_chunks; chunk != nullptr; chunk = chunk->next) {
+        if ((chunk->size <= m_nextChunkSize) && ((keep == nullptr) || (chunk->size > keep->size))) {
+            keep = chunk;
+        }
+    }
+
+    Chunk* chunk = m_chunks;
+    while (chunk != nullptr) {
+        Chunk* next = chunk->next;
+        if (chunk != keep) {
+            SystemAlloc::free(chunk);
+        }
+        chunk = next;
+    }
+
+    m_chunks         = keep;
+    m_bytesAllocated = 0;
+    if (keep == nullptr) {
+        m_current = nullptr;
+        m_end     = nullptr;
+        return;
+    }
+    keep->next = nullptr;
+    m_current  = (uint8*)keep + CHUNK_HEADER_SIZE;
+    m_end      = m_current + keep->size;
+}
+
+
+size_t Arena::bytesReserved() const {
+    size_t total = 0;
+    for (const Chunk* chunk = m_chunks; chunk != nullptr; chunk = chunk->next) {
+        total += CHUNK_HEADER_SIZE + chunk->size;
+    }
+    return total;
+}
+
+} // namespace G3D
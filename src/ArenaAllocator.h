@@ -0,0 +1,176 @@
+/**
+  \file ArenaAllocator.h
+
+  \brief Implementation of G3D::Arena and G3D::arena_allocator classes
+
+  mrkkrj: a bump-pointer arena on top of the G3D::SystemAlloc buffer pools, for strings
+          and containers that live for one request or one frame
+*/
+
+#ifndef G3D_ArenaAllocator_h
+#define G3D_ArenaAllocator_h
+
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+#include "PoolAllocator.h"
+
+
+namespace G3D {
+
+/**
+ \brief Monotonic (bump-pointer) allocator.
+
+ Memory is carved out of large chunks obtained from G3D::SystemAlloc::malloc. Individual
+ allocations are never freed; reset() releases all of them at once in time proportional
+ to the number of chunks, not the number of allocations. This suits strings and containers
+ whose lifetime is one request or one frame.
+
+ Not threadsafe: use one Arena per thread.
+
+ \sa G3D::arena_allocator, g3d_arena_resource
+*/
+class Arena {
+public:
+    /** Alignment of allocate() if none is given */
+    enum {defaultAlignment = 16};
+
+    /** Size of the first chunk if none is given. Later chunks double in size up to maxChunkSize. */
+    enum {defaultChunkSize = 64 * 1024, maxChunkSize = 1024 * 1024};
+
+private:
+
+    /** Header of each chunk; the chunk's memory follows it */
+    class Chunk {
+    public:
+        Chunk*      next;
+        size_t      size;
+    };
+
+    /** Most recent chunk first */
+    Chunk*          m_chunks;
+
+    uint8*          m_current;
+    uint8*          m_end;
+
+    size_t          m_nextChunkSize;
+
+    /** Bytes handed out since the last reset */
+    size_t          m_bytesAllocated;
+
+    /** Allocates from a new chunk. */
+    void* allocateSlow(size_t bytes, size_t alignment);
+
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+public:
+
+    /** \param initialChunkSize The first chunk is allocated on the first call to allocate(). */
+    explicit Arena(size_t initialChunkSize = defaultChunkSize);
+
+    /** Releases all chunks */
+    ~Arena();
+
+    /** Returns \a bytes of uninitialized storage aligned to \a alignment, which must be a power of two.
+        Returns nullptr if SystemAlloc::malloc fails. */
+    inline void* allocate(size_t bytes, size_t alignment = defaultAlignment) {
+        uint8* ptr = (uint8*)(((uintptr_t)m_current + (alignment - 1)) & ~(uintptr_t)(alignment - 1));
+        if ((m_current == nullptr) || (bytes > (size_t)(m_end - ptr)) || (ptr > m_end)) {
+            return allocateSlow(bytes, alignment);
+        }
+        m_current = ptr + bytes;
+        m_bytesAllocated += bytes;
+        return ptr;
+    }
+
+    /** Grows the block \a ptr of \a bytes to \a newBytes without moving it. Only the most recent 
+        allocation can grow, as far as its chunk has room. Returns false if it cannot. */
+    inline bool tryExpand(void* ptr, size_t bytes, size_t newBytes) {
+        if (((uint8*)ptr + bytes != m_current) || (newBytes < bytes) || (newBytes - bytes > (size_t)(m_end - m_current))) {
+            return false;
+        }
+        m_current += newBytes - bytes;
+        m_bytesAllocated += newBytes - bytes;
+        return true;
+    }
+
+    /** Makes all memory allocated from the arena available again. Every pointer obtained from
+        allocate() becomes invalid. Keeps the largest regular chunk and returns the others, 
+        including those of requests too large for a regular chunk, to SystemAlloc. */
+    void reset();
+
+    /** Bytes handed out by allocate() since the last reset(), not counting alignment */
+    size_t bytesAllocated() const {
+        return m_bytesAllocated;
+    }
+
+    /** Bytes held in chunks, including the chunk headers */
+    size_t bytesReserved() const;
+};
+
+
+/**
+ \brief Implementation of a C++ Allocator that allocates from a G3D::Arena.
+
+ deallocate() is a no-op; the memory is reclaimed by Arena::reset(). Instances are
+ stateful: two allocators are equal if they refer to the same arena, and the arena
+ propagates along with the contents of a container on copy and move assignment and on swap.
+
+ \sa G3D::Arena
+*/
+template<class T>
+class arena_allocator {
+private:
+    Arena* m_arena;
+
+public:
+    typedef T               value_type;
+    typedef std::true_type  propagate_on_container_copy_assignment;
+    typedef std::true_type  propagate_on_container_move_assignment;
+    typedef std::true_type  propagate_on_container_swap;
+    typedef std::false_type is_always_equal;
+
+    explicit constexpr arena_allocator(Arena& arena) noexcept : m_arena(&arena) {}
+
+    template<class U>
+    constexpr arena_allocator(const arena_allocator<U>& other) noexcept : m_arena(other.arena()) {}
+
+    /** Allocates n * sizeof(T) bytes of uninitialized storage from the arena */
+    [[nodiscard]] T* allocate(std::size_t n) {
+        return static_cast<T*>(m_arena->allocate(sizeof(T) * n,
+                                                 (alignof(T) > (size_t)Arena::defaultAlignment) ? alignof(T) : (size_t)Arena::defaultAlignment));
+    }
+
+    /** Does nothing; see Arena::reset() */
+    void deallocate(T* p, std::size_t n) {
+        (void)p;
+        (void)n;
+    }
+
+    /** Returns true if the storage p of allocate(n), being the arena's most recent allocation, 
+        grew to hold newN objects, see Arena::tryExpand() */
+    bool try_expand_in_place(T* p, std::size_t n, std::size_t newN) {
+        return m_arena->tryExpand(p, sizeof(T) * n, sizeof(T) * newN);
+    }
+
+    constexpr Arena* arena() const noexcept {
+        return m_arena;
+    }
+};
+
+// Found by argument-dependent lookup, so that std containers see them
+template< class T1, class T2 >
+constexpr bool operator==( const arena_allocator<T1>& lhs, const arena_allocator<T2>& rhs ) noexcept {
+    return lhs.arena() == rhs.arena();
+}
+
+template< class T1, class T2 >
+constexpr bool operator!=( const arena_allocator<T1>& lhs, const arena_allocator<T2>& rhs ) noexcept {
+    return lhs.arena() != rhs.arena();
+}
+
+} // namespace G3D
+
+#endif
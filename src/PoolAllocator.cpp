@@ -48,6 +48,38 @@ namespace G3D {
         return ((x != 0) && !(x & (x - 1)));
     }
 
+    /** Index of the most significant set bit. \a x must not be zero. */
+    inline int highestBit(size_t x) {
+#   ifdef _MSC_VER
+        unsigned long i;
+        _BitScanReverse64(&i, (unsigned __int64)x);
+        return (int)i;
+#   else
+        return (int)(sizeof(unsigned long long) * 8 - 1) - __builtin_clzll((unsigned long long)x);
+#   endif
+    }
+
+    /** Index of the least significant set bit. \a x must not be zero. */
+    inline int lowestBit(uint32 x) {
+#   ifdef _MSC_VER
+        unsigned long i;
+        _BitScanForward(&i, (unsigned long)x);
+        return (int)i;
+#   else
+        return __builtin_ctz(x);
+#   endif
+    }
+
+    inline int lowestBit(uint64 x) {
+#   ifdef _MSC_VER
+        unsigned long i;
+        _BitScanForward64(&i, (unsigned __int64)x);
+        return (int)i;
+#   else
+        return __builtin_ctzll((unsigned long long)x);
+#   endif
+    }
+
     // also there
 #   define max std::max    // OPEN TODO::: in  AllocatorPlatform.h ???
 
@@ -62,7 +94,39 @@ namespace G3D {
 // allocation and use the operating SystemAlloc's malloc.
 //#define NO_BUFFERPOOL
 
+// Uncomment the following line to turn off the per-thread caches in
+// front of the shared buffer pool, so that every SystemAlloc::malloc
+// and SystemAlloc::free takes the pool's lock.
+//#define NO_THREAD_CACHE
+
+// Uncomment the following line to turn off the remote-free queues, so that
+// a tiny buffer freed by another thread than the owner of its chunk goes 
+// through the freeing thread's cache and the shared buffer pool.
+//#define NO_REMOTE_FREE
+
+// Uncomment the following line to obfuscate the links stored in free 
+// tiny buffers, so that heap corruption is detected on the next 
+// allocation instead of returning an arbitrary pointer.
+//#define OBFUSCATE_FREELIST
+
+// Uncomment the following line to back the tiny heap with transparent huge
+// pages, which reduces the dTLB misses of programs that access many tiny 
+// buffers at random. Where the OS provides no transparent huge pages, the 
+// tiny heap uses regular pages; see SystemAlloc::Stats::tinyHeapPages.
+//#define HUGE_PAGES
+
+// Uncomment the following line to turn off the buddy heap, so that blocks 
+// of more than 8 KB come from ::malloc and the extents.
+//#define NO_BUDDY_HEAP
+
+#include <atomic>
 #include <cstdlib>
+#include <ctime>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <new>
+#include <thread>
 
 #ifdef G3D_WINDOWS
 
@@ -80,7 +144,11 @@ namespace G3D {
 #   include <unistd.h>
 #   include <sys/ioctl.h>
 #   include <sys/time.h>
+#   include <sys/mman.h>
 #   include <pthread.h>
+#   ifdef __GLIBC__
+#       include <malloc.h>
+#   endif
 
 // fix on Linux
 #   include <string.h>
@@ -95,6 +163,7 @@ namespace G3D {
     #include <sys/sysctl.h>
     #include <sys/select.h>
     #include <sys/time.h>
+    #include <sys/mman.h>
     #include <termios.h>
     #include <unistd.h>
     #include <pthread.h>
@@ -123,6 +192,120 @@ SystemAlloc::SystemAlloc()
 }
 
 
+////////////////////////////////////////////////////////////////
+// Virtual memory
+
+/** Reserves \a bytes of address space without backing it with physical memory. 
+    Returns nullptr on failure. */
+static void* reserveAddressSpace(size_t bytes) {
+#ifdef G3D_WINDOWS
+    return VirtualAlloc(nullptr, bytes, MEM_RESERVE, PAGE_NOACCESS);
+#else
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#   ifdef MAP_NORESERVE
+    flags |= MAP_NORESERVE;
+#   endif
+    void* ptr = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, flags, -1, 0);
+    return (ptr == MAP_FAILED) ? nullptr : ptr;
+#endif
+}
+
+/** Makes [ptr, ptr + bytes) of a reserved region usable. On POSIX systems the 
+    pages are already usable and are backed on first touch. */
+static bool commitAddressSpace(void* ptr, size_t bytes) {
+#ifdef G3D_WINDOWS
+    return VirtualAlloc(ptr, bytes, MEM_COMMIT, PAGE_READWRITE) != nullptr;
+#else
+    (void)ptr;
+    (void)bytes;
+    return true;
+#endif
+}
+
+/** Returns the physical memory behind [ptr, ptr + bytes) of a committed region to the OS. 
+    The range stays reserved; it must be committed again before it is used. */
+static void decommitAddressSpace(void* ptr, size_t bytes) {
+#ifdef G3D_WINDOWS
+    VirtualFree(ptr, bytes, MEM_DECOMMIT);
+#else
+    // The pages read as zero and are backed again on first touch
+    madvise(ptr, bytes, MADV_DONTNEED);
+#endif
+}
+
+static void releaseAddressSpace(void* ptr, size_t bytes) {
+#ifdef G3D_WINDOWS
+    (void)bytes;
+    VirtualFree(ptr, 0, MEM_RELEASE);
+#else
+    munmap(ptr, bytes);
+#endif
+}
+
+/** Touches one byte in each page of [ptr, ptr + bytes), so that the OS backs the range 
+    with physical memory now instead of on first use. Overwrites the touched bytes. */
+static void prefaultPages(void* ptr, size_t bytes) {
+    const size_t pageSize = 4096;
+    volatile uint8* p = (volatile uint8*)ptr;
+    for (size_t offset = 0; offset < bytes; offset += pageSize) {
+        p[offset] = 0;
+    }
+    if (bytes > 0) {
+        // The range need not start at a page boundary
+        p[bytes - 1] = 0;
+    }
+}
+
+#ifdef HUGE_PAGES
+/** Size and alignment of a transparent huge page on x86-64 and ARM64 Linux */
+#define HUGE_PAGE_SIZE ((size_t)2 * 1024 * 1024)
+
+/** False if the kernel has no transparent huge pages or they are turned off */
+static bool transparentHugePagesEnabled() {
+#ifdef G3D_LINUX
+    FILE* file = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r");
+    if (file == nullptr) {
+        return false;
+    }
+    char mode[128] = {0};
+    const bool read = (fgets(mode, sizeof(mode), file) != nullptr);
+    fclose(file);
+    return read && (strstr(mode, "[never]") == nullptr);
+#else
+    return false;
+#endif
+}
+
+/** Like reserveAddressSpace, but the region is aligned to HUGE_PAGE_SIZE and the OS is 
+    advised to back it with transparent huge pages. \a bytes must be a multiple of 
+    HUGE_PAGE_SIZE. \a huge is set to false if the region has regular pages instead. */
+static void* reserveHugeAddressSpace(size_t bytes, bool& huge) {
+    huge = false;
+#if defined(G3D_LINUX) && defined(MADV_HUGEPAGE)
+    // Reserve one huge page more than needed and trim the unaligned ends
+    uint8* ptr = (uint8*)reserveAddressSpace(bytes + HUGE_PAGE_SIZE);
+    if (ptr == nullptr) {
+        return nullptr;
+    }
+    uint8* aligned = (uint8*)(((uintptr_t)ptr + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+    if (aligned > ptr) {
+        munmap(ptr, aligned - ptr);
+    }
+    if (aligned < ptr + HUGE_PAGE_SIZE) {
+        munmap(aligned + bytes, ptr + HUGE_PAGE_SIZE - aligned);
+    }
+
+    huge = transparentHugePagesEnabled() && (madvise(aligned, bytes, MADV_HUGEPAGE) == 0);
+    return aligned;
+#else
+    // Windows large pages cannot be committed lazily and require the 
+    // "Lock pages in memory" privilege
+    return reserveAddressSpace(bytes);
+#endif
+}
+#endif
+
+
 ////////////////////////////////////////////////////////////////
 #define ALIGNMENT_SIZE 16 // must be at least sizeof(size_t)
 
@@ -132,6 +315,43 @@ SystemAlloc::SystemAlloc()
 #define REALSIZE_FROM_USERPTR(u) (*(size_t*)USERPTR_TO_REALPTR(ptr) + ALIGNMENT_SIZE)
 #define USERSIZE_FROM_USERPTR(u) (*(size_t*)USERPTR_TO_REALPTR(ptr))
 
+/** A count (or pointer) that is only changed under the BufferPool lock, but may be read without it 
+    (see SystemAlloc::mallocStats). Changes are relaxed loads and stores instead of 
+    atomic read-modify-writes, so they cost no more than for a plain integer. */
+template<class T>
+class LockedCounter {
+private:
+    std::atomic<T> m_value;
+
+public:
+    inline LockedCounter() : m_value(0) {}
+
+    inline operator T() const {
+        return m_value.load(std::memory_order_relaxed);
+    }
+
+    inline LockedCounter& operator=(T value) {
+        m_value.store(value, std::memory_order_relaxed);
+        return *this;
+    }
+
+    inline LockedCounter& operator+=(T delta) {
+        return (*this = T(*this) + delta);
+    }
+
+    inline LockedCounter& operator-=(T delta) {
+        return (*this = T(*this) - delta);
+    }
+
+    inline LockedCounter& operator++() {
+        return (*this += 1);
+    }
+
+    inline LockedCounter& operator--() {
+        return (*this -= 1);
+    }
+};
+
 class BufferPool {
 public:
 
@@ -150,486 +370,3829 @@ public:
        250000 * { 128 |  256} = {32 | 64} MB (preallocated)
         40000 * {1024 | 2048} = {40 | 80} MB (allocated on demand)
          5000 * {4096 | 8192} = {20 | 40} MB (allocated on demand)
+
+       The limits of the small and medium pools are only defaults, see maxSmallBuffers 
+       and setPoolLimits.
      */
-    enum {maxTinyBuffers = 250000, maxSmallBuffers = 40000, maxMedBuffers = 5000};
+    enum {maxTinyBuffers = 250000, defaultMaxSmallBuffers = 40000, defaultMaxMedBuffers = 5000};
 
-private:
+    /** When a block is freed into a full small or medium pool, this fraction of the pool's 
+        blocks is evicted to the heap, see evictBlocks */
+    enum {evictionFraction = 32};
 
-    /** Pointer given to the program.  Unless in the tiny heap, the user size of the block is stored right in front of the pointer as a uint32.*/
-    typedef void* UserPtr;
+    /** The tiny pool is split into size classes of 16, 32, 64, 128 and 256 bytes 
+        (= tinyBufferSize), each with its own freelist, so that short strings and 
+        small nodes do not occupy a whole 256 byte buffer. They are followed by node 
+        classes for the other multiples of 16 (48, 80, 96, ..., 240 bytes), which only 
+        serve mallocNode, so that the nodes of std::map, std::list etc. fit exactly. */
+    enum {minTinyBufferSize = 16, numPow2TinyClasses = 5, numTinyClasses = 16};
 
-    /** Actual block allocated on the heap */
-    typedef void* RealPtr;
+    /** The tiny heap's address space is reserved up front, but it is carved into 
+        buffers (and, on Windows, committed) one chunk of this many bytes at a time.
+        Each chunk holds buffers of a single tiny class. Only the touched pages of 
+        a chunk are backed by physical memory. */
+    enum {tinyChunkSize = 64 * 1024, maxTinyChunks = maxTinyBuffers / (tinyChunkSize / tinyBufferSize)};
 
-    class MemBlock {
-    public:
-        UserPtr     ptr;
-        size_t      bytes;
+    /** Owners of tiny chunks (see tinyChunkOwner): none, or 1 to maxTinyOwners */
+    enum {noTinyOwner = 0, maxTinyOwners = 255};
 
-        inline MemBlock() : ptr(nullptr), bytes(0) {}
-        inline MemBlock(UserPtr p, size_t b) : ptr(p), bytes(b) {}
-    };
+    /** Bytes of address space reserved for the tiny heap */
+    static const size_t tinyHeapSize = (size_t)maxTinyChunks * tinyChunkSize;
+
+    /** 
+       Blocks of more than medBufferSize and up to maxBuddyBlockSize bytes come from the buddy 
+       heap. Its blocks are powers of two from minBuddyBlockSize (order 0) to buddyChunkSize 
+       (order numBuddyOrders - 1), aligned to their size, so a block wastes less than half of 
+       its size. A request splits the smallest free block that holds it into halves down to 
+       its order, and a freed block is merged with its buddy, the other half of the block it 
+       was split from, as long as that is free too. Like the tiny heap, its address space is 
+       reserved up front and committed one chunk at a time; when it is exhausted, large blocks
+       come from ::malloc and the extents.
+     */
+    enum {minBuddyBlockSize = 16 * 1024, buddyChunkSize = 1024 * 1024, numBuddyOrders = 7, 
+          maxBuddyBlockSize = buddyChunkSize, maxBuddyChunks = 256, 
+          buddyUnitsPerChunk = buddyChunkSize / minBuddyBlockSize, maxBuddyUnits = maxBuddyChunks * buddyUnitsPerChunk};
 
-    MemBlock smallPool[maxSmallBuffers];
-    int smallPoolSize;
+    /** Buddy blocks are aligned to at least a page */
+    enum {maxBuddyAlignment = 4096};
 
-    MemBlock medPool[maxMedBuffers];
-    int medPoolSize;
+    /** Bytes of address space reserved for the buddy heap */
+    static const size_t buddyHeapSize = (size_t)maxBuddyChunks * buddyChunkSize;
 
-    /** The tiny pool is a single block of storage into which all tiny
-        objects are allocated.  This provides better locality for
-        small objects and avoids the search time, since all tiny
-        blocks are exactly the same size. */
-    void* tinyPool[maxTinyBuffers];
-    int tinyPoolSize;
+    /** 
+       The small and medium pools are segregated into bins of equally sized blocks,
+       four bins per power of two between tinyBufferSize and medBufferSize:
 
-    /** Pointer to the data in the tiny pool */
-    void* tinyHeap;
+         small: 320, 384, 448, 512, 640, 768, 896, 1024, 1280, 1536, 1792, 2048
+         med:   2560, 3072, 3584, 4096, 5120, 6144, 7168, 8192
 
-    Spinlock            m_lock;
+       Requests are rounded up to the next bin size, so a block wastes at most 25% 
+       of its size. A request may be served by a bin up to maxBinSlack sizes larger 
+       when its own bin is empty.
+     */
+    enum {binsPerDoubling = 4, numSmallBins = 12, numBins = 20, maxBinSlack = 2};
 
-    inline void lock() {
-        m_lock.lock();
-    }
+    /** Each kind of block has its own numBins bins, bin kind * numBins + b holding 
+        blocks of binBytes(b): blocks with a size header, blocks without header from 
+        mallocSized, and blocks without header aligned to maxBinAlignment. As the size of 
+        a block without header is not stored, it is never handed out for a smaller bin's 
+        requests. */
+    enum {HEADER_BINS, SIZED_BINS, ALIGNED_BINS, numBinKinds, numAllBins = numBinKinds * numBins};
 
-    inline void unlock() {
-        m_lock.unlock();
-    }
+    /** Alignment of all blocks, and of the blocks in the ALIGNED_BINS (e.g. for AVX-512 or 
+        to keep a block on cache lines of its own). Tiny buffers are aligned to their size. */
+    enum {minAlignment = ALIGNMENT_SIZE, maxBinAlignment = 64};
 
-    /** 
-     Malloc out of the tiny heap. Returns nullptr if allocation failed.
-     */
-    inline UserPtr tinyMalloc(size_t bytes) {
-        // Note that we ignore the actual byte size
-        // and create a constant size block.
-        (void)bytes;
-        assert(tinyBufferSize >= bytes);
+    /** Size classes cached per thread: the tiny classes, followed by one per bin */
+    enum {numSizeClasses = numTinyClasses + numAllBins};
 
-        UserPtr ptr = nullptr;
+    typedef SystemAlloc::Stats Stats;
+    static_assert((int)Stats::numTinyClasses == (int)numTinyClasses, "SystemAlloc::Stats::numTinyClasses");
+    static_assert((int)Stats::numPow2TinyClasses == (int)numPow2TinyClasses, "SystemAlloc::Stats::numPow2TinyClasses");
+    static_assert((int)Stats::numBins == (int)numBins, "SystemAlloc::Stats::numBins");
+    static_assert((int)Stats::numBuddyOrders == (int)numBuddyOrders, "SystemAlloc::Stats::numBuddyOrders");
 
-        if (tinyPoolSize > 0) {
-            --tinyPoolSize;
+    /** Pointer given to the program.  Unless in the tiny heap, the user size of the block is stored right in front of the pointer as a uint32.*/
+    typedef void* UserPtr;
 
-            // Return the old last pointer from the freelist
-            ptr = tinyPool[tinyPoolSize];
+    /** Actual block allocated on the heap */
+    typedef void* RealPtr;
 
-#           ifdef G3D_DEBUG
-                if (tinyPoolSize > 0) {
-                    assert(tinyPool[tinyPoolSize - 1] != ptr); 
-                     //   "SystemAlloc::malloc heap corruption detected: "
-                     //   "the last two pointers on the freelist are identical (during tinyMalloc).");
-                }
-#           endif
+    /** Allocation counts gathered without the lock (e.g. by a ThreadCache) and 
+        folded into the shared counters the next time the lock is taken. */
+    class Counters {
+    public:
+        int64 totalMallocs;
+        int64 mallocsFromTinyPool;
+        int64 mallocsFromSmallPool;
+        int64 mallocsFromMedPool;
 
-            // nullptr out the entry to help detect corruption
-            tinyPool[tinyPoolSize] = nullptr;
-        }
+        /** Change in the number of free blocks held by the owner */
+        int64 tinyBuffersCached[numTinyClasses];
+        int64 smallBuffersCached;
+        int64 medBuffersCached;
 
-        return ptr;
-    }
+        /** Change in the bytes handed to the application, see Stats::bytesInUse */
+        int64 bytesInUse[Stats::numPools];
 
-    /** Returns true if this is a pointer into the tiny heap. */
-    bool inTinyHeap(UserPtr ptr) {
-        return 
-            (ptr >= tinyHeap) && 
-            (ptr < (uint8*)tinyHeap + maxTinyBuffers * tinyBufferSize);
+        int64 mallocSizeHistogram[Stats::numSizeBuckets];
+
+        /** Tiny buffers handed to their owner's remote-free queue, see Stats::remoteFrees */
+        int64 remoteFrees;
+
+        inline Counters() : totalMallocs(0), mallocsFromTinyPool(0), mallocsFromSmallPool(0), mallocsFromMedPool(0),
+                            tinyBuffersCached(), smallBuffersCached(0), medBuffersCached(0),
+                            bytesInUse(), mallocSizeHistogram(), remoteFrees(0) {}
+    };
+
+    /** Pool (see Stats::bytesInUse) of a block of \a bytes */
+    static inline int poolOfSize(size_t bytes) {
+        return (bytes <= tinyBufferSize)  ? Stats::TINY_POOL :
+               (bytes <= smallBufferSize) ? Stats::SMALL_POOL : 
+               (bytes <= medBufferSize)   ? Stats::MED_POOL : Stats::LARGE_BLOCKS;
     }
 
-    void tinyFree(UserPtr ptr) {
-        assert(ptr);
-        assert(tinyPoolSize < maxTinyBuffers);
- //           "Tried to free a tiny pool buffer when the tiny pool freelist is full.");
+    /** Tiny class for requests of up to \a bytes (bytes <= tinyBufferSize) */
+    static inline int tinyClassIndex(size_t bytes) {
+        return (bytes <= minTinyBufferSize) ? 0 : (highestBit(bytes - 1) - 3);
+    }
 
-#       ifdef G3D_DEBUG
-            if (tinyPoolSize > 0) {
-                UserPtr prevOnHeap = tinyPool[tinyPoolSize - 1];
-                assert(prevOnHeap != ptr); 
-//                    "SystemAlloc::malloc heap corruption detected: "
-//                    "the last two pointers on the freelist are identical (during tinyFree).");
-            }
-#       endif
+    /** Node class for mallocNode requests of up to \a bytes (bytes <= tinyBufferSize), 
+        i.e. for \a bytes rounded up to a multiple of 16 */
+    static inline int nodeClassIndex(size_t bytes) {
+        static const uint8 classOfUnits[tinyBufferSize / minTinyBufferSize + 1] = 
+            {0, 0, 1, 5, 2, 6, 7, 8, 3, 9, 10, 11, 12, 13, 14, 15, 4};
+        return classOfUnits[(bytes + minTinyBufferSize - 1) / minTinyBufferSize];
+    }
 
-        assert(tinyPool[tinyPoolSize] == nullptr);
+    /** Size of the buffers in tiny class \a c */
+    static inline size_t tinyClassBytes(int c) {
+        static const uint16 classBytes[numTinyClasses] = 
+            {16, 32, 64, 128, 256, 48, 80, 96, 112, 144, 160, 176, 192, 208, 224, 240};
+        return classBytes[c];
+    }
 
-        // Put the pointer back into the free list
-        tinyPool[tinyPoolSize] = ptr;
-        ++tinyPoolSize;
+    static inline bool isTinyClass(int sizeClass) {
+        return sizeClass < numTinyClasses;
+    }
 
+    /** Size class (as cached per thread) of \a bin */
+    static inline int binSizeClass(int bin) {
+        return numTinyClasses + bin;
     }
 
-    void flushPool(MemBlock* pool, int& poolSize) {
-        for (int i = 0; i < poolSize; ++i) {
-            bytesAllocated -= USERSIZE_TO_REALSIZE(pool[i].bytes);
-            ::free(USERPTR_TO_REALPTR(pool[i].ptr));
-            pool[i].ptr = nullptr;
-            pool[i].bytes = 0;
+    /** Bin holding blocks for requests of up to \a bytes (tinyBufferSize < bytes <= medBufferSize).
+        Smaller requests map to the first bin. */
+    static inline int binIndex(size_t bytes) {
+        if (bytes <= binBytes(0)) {
+            return 0;
         }
-        poolSize = 0;
+        // The leading bit selects the power of two, the next two bits the bin within it
+        const size_t x = bytes - 1;
+        const int p = highestBit(x);
+        return (p - 8) * binsPerDoubling + (int)((x >> (p - 2)) & (binsPerDoubling - 1));
     }
 
+    /** Kind of the blocks in \a bin, see numAllBins */
+    static inline int binKind(int bin) {
+        return bin / numBins;
+    }
 
-    /** Allocate out of a specific pool.  Return nullptr if no suitable 
-        memory was found. */
-    UserPtr poolMalloc(MemBlock* pool, int& poolSize, const int maxPoolSize, size_t bytes) {
-
-        // OPT: find the smallest block that satisfies the request.
+    /** Bin with header of the same size as \a bin */
+    static inline int baseBin(int bin) {
+        return bin % numBins;
+    }
 
-        // See if there's something we can use in the buffer pool.
-        // Search backwards since usually we'll re-use the last one.
-        for (int i = (int)poolSize - 1; i >= 0; --i) {
-            if (pool[i].bytes >= bytes) {
-                // We found a suitable entry in the pool.
+    /** Kind of bin for blocks allocated by mallocSized with \a alignment */
+    static inline int sizedBinKind(size_t alignment) {
+        return (alignment <= minAlignment) ? SIZED_BINS : ALIGNED_BINS;
+    }
 
-                // No need to offset the pointer; it is already offset
-                UserPtr ptr = pool[i].ptr;
+    /** Rounds a request to mallocSized up to the size of a block whose alignment is at 
+        least \a alignment, since tiny buffers are only aligned to their size */
+    static inline size_t alignedRequestBytes(size_t bytes, size_t alignment) {
+        return (bytes < alignment) ? alignment : bytes;
+    }
 
-                // Remove this element from the pool, replacing it with
-                // the one from the end (same as Array::fastRemove)
-                --poolSize;
-                pool[i] = pool[poolSize];
+    /** User size of the blocks in \a bin */
+    static inline size_t binBytes(int bin) {
+        bin = baseBin(bin);
+        const int p = 8 + bin / binsPerDoubling;
+        return ((size_t)1 << p) + ((size_t)(bin % binsPerDoubling + 1) << (p - 2));
+    }
 
-                return ptr;
-            }
-        }
+    /** Bytes obtained from ::malloc for each block of \a bin, as counted in bytesAllocated */
+    static inline size_t binRealBytes(int bin) {
+        return (binKind(bin) == HEADER_BINS) ? USERSIZE_TO_REALSIZE(binBytes(bin)) : binBytes(bin);
+    }
 
-        if (poolSize == maxPoolSize) {
-            // Free even-indexed pools, and compact array in the same loop
-            for (int i = 0; i < poolSize; i += 2) {
-                bytesAllocated -= USERSIZE_TO_REALSIZE(pool[i].bytes);
-                ::free(USERPTR_TO_REALPTR(pool[i].ptr));
-                pool[i].ptr = nullptr;
-                pool[i].bytes = 0;
-                // Compact: (i/2) is the next open slot
-                pool[i/2].ptr   = pool[i+1].ptr;
-                pool[i/2].bytes = pool[i+1].bytes;
-                pool[i+1].ptr = nullptr;
-                pool[i+1].bytes = 0;
-            }
-            poolSize = poolSize/2;
-            if (maxPoolSize == maxMedBuffers) {
-                ++medPoolPurgeCount;
-            } else if (maxPoolSize == maxSmallBuffers) {
-                ++smallPoolPurgeCount;
-            }
+    static inline bool isSmallBin(int bin) {
+        return baseBin(bin) < numSmallBins;
+    }
 
-        }
+    /** Order of the buddy block for requests of up to \a bytes (bytes <= maxBuddyBlockSize) */
+    static inline int buddyOrderOf(size_t bytes) {
+        return (bytes <= minBuddyBlockSize) ? 0 : (highestBit(bytes - 1) + 1 - highestBit(minBuddyBlockSize));
+    }
 
-        return nullptr;
+    /** Size of the buddy blocks of \a order */
+    static inline size_t buddyBlockBytes(int order) {
+        return (size_t)minBuddyBlockSize << order;
     }
 
-public:
+private:
 
-    /** Count of memory allocations that have occurred. */
-    int totalMallocs;
-    int mallocsFromTinyPool;
-    int mallocsFromSmallPool;
-    int mallocsFromMedPool;
+    /** Link stored in the first bytes of a free tiny buffer or small or medium block */
+    class FreeBlock {
+    public:
+        FreeBlock*  next;
 
-    int smallPoolPurgeCount;
-    int medPoolPurgeCount;
+        /** The block put into the same bin right after this one, i.e. towards binHead. Not 
+            valid for the head of a bin; only next is set for tiny buffers. */
+        FreeBlock*  prev;
 
-    /** Amount of memory currently allocated (according to the application). 
-        This does not count the memory still remaining in the buffer pool,
-        but does count extra memory required for rounding off to the size
-        of a buffer.
-        Primarily useful for detecting leaks.*/
-    std::atomic_size_t bytesAllocated;
+        /** trimEpoch when a small or medium block was put into its bin */
+        uint32      freeEpoch;
 
-    BufferPool() {
-        totalMallocs         = 0;
+        /** binClock when a small or medium block was put into its bin, see evictBlocks */
+        uint32      freeTick;
+    };
 
-        mallocsFromTinyPool  = 0;
-        mallocsFromSmallPool = 0;
-        mallocsFromMedPool   = 0;
+    /** Incremented by each scavenge(). Used to find the blocks and tiny chunks that have 
+        been free for some time; since bins are stacks, their blocks are ordered by age. */
+    uint32 trimEpoch;
 
-        bytesAllocated       = 0;
+    /** Bytes returned to the OS by trim() */
+    LockedCounter<uint64> bytesTrimmed;
 
-        tinyPoolSize         = 0;
-        tinyHeap             = nullptr;
+    /** Links placed in front of the size header of every block obtained from ::malloc 
+        when trackHeapBlocks is set, so that all of them can be released at once 
+        (see PoolHeap::release). Keeps the user pointer 16 byte aligned. Blocks without 
+        header have the same layout, their size header being unused. */
+    class HeapBlock {
+    public:
+        HeapBlock*  prev;
+        HeapBlock*  next;
+    };
 
-        smallPoolSize        = 0;
+    const bool trackHeapBlocks;
 
-        medPoolSize          = 0;
+    /** All blocks obtained from ::malloc, whether in use or in a bin, when trackHeapBlocks is set */
+    HeapBlock* heapBlocks;
 
-        smallPoolPurgeCount = 0;
-        medPoolPurgeCount   = 0;
+    static inline HeapBlock* heapBlockOf(UserPtr ptr) {
+        return (HeapBlock*)USERPTR_TO_REALPTR(ptr) - 1;
+    }
 
+    /** Address obtained from ::malloc for a block tracked in heapBlocks, which differs from 
+        its HeapBlock for over-aligned blocks. Kept right in front of the user pointer, behind 
+        the size. */
+    static inline void*& heapBlockBase(UserPtr ptr) {
+        return ((void**)ptr)[-1];
+    }
 
-        // Initialize the tiny heap as a bunch of pointers into one
-        // pre-allocated buffer.
-        tinyHeap = ::malloc(maxTinyBuffers * tinyBufferSize);
-        for (int i = 0; i < maxTinyBuffers; ++i) {
-            tinyPool[i] = (uint8*)tinyHeap + (tinyBufferSize * i);
+    /** ::malloc a block with room for \a bytes and the headers. Returns the 
+        address of the size header. Does not require the lock. */
+    inline RealPtr heapBlockMalloc(size_t bytes) {
+        if (trackHeapBlocks) {
+            uint8* block = (uint8*)::malloc(sizeof(HeapBlock) + USERSIZE_TO_REALSIZE(bytes));
+            if (block == nullptr) {
+                return nullptr;
+            }
+            heapBlockBase(REALPTR_TO_USERPTR(block + sizeof(HeapBlock))) = block;
+            return block + sizeof(HeapBlock);
+        } else {
+            return ::malloc(USERSIZE_TO_REALSIZE(bytes));
         }
-        tinyPoolSize = maxTinyBuffers;
     }
 
-
-    ~BufferPool() {
-        ::free(tinyHeap);
-        flushPool(smallPool, smallPoolSize);
-        flushPool(medPool, medPoolSize);
+    /** ::malloc a block without header of \a bytes, aligned to \a alignment, with room for 
+        a HeapBlock in front of it. Returns the user pointer. Does not require the lock. */
+    inline UserPtr trackedBlockMalloc(size_t bytes, size_t alignment) {
+        const size_t front = sizeof(HeapBlock) + ALIGNMENT_SIZE;
+        alignment = max(alignment, (size_t)minAlignment);
+        uint8* block = (uint8*)::malloc(front + bytes + alignment - minAlignment);
+        if (block == nullptr) {
+            return nullptr;
+        }
+        UserPtr ptr = (UserPtr)(((uintptr_t)block + front + alignment - 1) & ~(uintptr_t)(alignment - 1));
+        heapBlockBase(ptr) = block;
+        return ptr;
     }
 
-    
-    UserPtr realloc(UserPtr ptr, size_t bytes) {
-        if (ptr == nullptr) {
-            return malloc(bytes);
+    /** Requires the lock. */
+    inline void linkHeapBlock(UserPtr ptr) {
+        HeapBlock* block = heapBlockOf(ptr);
+        block->prev = nullptr;
+        block->next = heapBlocks;
+        if (heapBlocks != nullptr) {
+            heapBlocks->prev = block;
         }
+        heapBlocks = block;
+    }
 
-        if (inTinyHeap(ptr)) {
-            if (bytes <= tinyBufferSize) {
-                // The old pointer actually had enough space.
-                return ptr;
+    /** Requires the lock. */
+    inline void unlinkHeapBlock(UserPtr ptr) {
+        if (trackHeapBlocks) {
+            HeapBlock* block = heapBlockOf(ptr);
+            if (block->prev != nullptr) {
+                block->prev->next = block->next;
             } else {
-                // Free the old pointer and malloc
-                
-                UserPtr newPtr = malloc(bytes);
-                SystemAlloc::memcpy(newPtr, ptr, tinyBufferSize);
-                lock();
-                tinyFree(ptr);
-                unlock();
-                return newPtr;
-
+                heapBlocks = block->next;
             }
-        } else {
-            // In one of our heaps.
-
-            // See how big the block really was
-            size_t userSize = USERSIZE_FROM_USERPTR(ptr);
-            if (bytes <= userSize) {
-                // The old block was big enough.
-                return ptr;
+            if (block->next != nullptr) {
+                block->next->prev = block->prev;
             }
+        }
+    }
 
-            // Need to reallocate and move
-            UserPtr newPtr = malloc(bytes);
-            SystemAlloc::memcpy(newPtr, ptr, userSize);
-            free(ptr);
-            return newPtr;
+    /** Returns a block with header obtained by heapMalloc to ::free or to the extents. The 
+        block must have been unlinked. Does not require the lock. */
+    inline void heapBlockFree(UserPtr ptr) {
+        const size_t bytes = USERSIZE_FROM_USERPTR(ptr);
+        if (isExtentBlock(bytes, HEADER_BINS)) {
+            unmapExtent((uint8*)USERPTR_TO_REALPTR(ptr), extentLength(bytes, HEADER_BINS));
+            return;
         }
+        ::free(trackHeapBlocks ? (void*)heapBlockOf(ptr) : (void*)USERPTR_TO_REALPTR(ptr));
     }
 
+    /** Returns a block of \a bin to ::free. The block must have been unlinked. 
+        Does not require the lock. */
+    inline void binBlockFree(int bin, UserPtr ptr) {
+        heapFree(binKind(bin), ptr, binBytes(bin));
+    }
 
-    UserPtr malloc(size_t bytes) {
-        lock();
-        ++totalMallocs;
+    /** Large blocks of at least this many bytes get page-granular extents of their own
+        from the OS instead of coming from ::malloc, so that realloc can grow them without 
+        copying (with mremap, where available) and freed extents can be reused while their
+        pages are still backed. Smaller ones are served by the C library without a system
+        call. Blocks of ALIGNED_BINS and of pools that track their heap blocks always come 
+        from ::malloc. */
+    enum {minExtentBytes = 64 * 1024, extentPageSize = 4096};
+
+    /** Freed extents of up to maxCachedExtentBytes are cached for reuse, the oldest being 
+        unmapped when the cache is full. A block that takes a larger cached extent releases 
+        the rest of it. */
+    enum {extentCacheSize = 8};
+    static const size_t maxCachedExtentBytes = (size_t)32 * 1024 * 1024;
+
+    class Extent {
+    public:
+        uint8*      start;
+        size_t      length;
 
-        if (bytes <= tinyBufferSize) {
+        /** trimEpoch when the extent was cached */
+        uint32      freeEpoch;
+    };
 
-            UserPtr ptr = tinyMalloc(bytes);
+    /** Oldest first */
+    Extent extentCache[extentCacheSize];
+    int    extentCacheCount;
 
-            if (ptr) {
-                debugAssertM((intptr_t)ptr % 16 == 0, "BufferPool::tinyMalloc returned non-16 byte aligned memory");
-                ++mallocsFromTinyPool;
-                unlock();
-                return ptr;
-            }
+    /** Bytes of all extents, including the cached ones */
+    LockedCounter<int64> extentBytesMapped;
+    LockedCounter<int64> extentBytesCached;
+    LockedCounter<uint64> extentCacheHits;
+    LockedCounter<uint64> extentRemaps;
 
-        } 
-        
-        // Failure to allocate a tiny buffer is allowed to flow
-        // through to a small buffer
-        if (bytes <= smallBufferSize) {
-            
-            UserPtr ptr = poolMalloc(smallPool, smallPoolSize, maxSmallBuffers, bytes);
+    /** True if a heap block of \a bytes (as rounded by heapBlockBytes) and \a kind has an extent of its own */
+    inline bool isExtentBlock(size_t bytes, int kind) const {
+        return (bytes >= minExtentBytes) && (kind != ALIGNED_BINS) && ! trackHeapBlocks;
+    }
 
-            if (ptr) {
-                debugAssertM((intptr_t)ptr % 16 == 0, "BufferPool::poolMalloc(small) returned non-16 byte aligned memory");
-                ++mallocsFromSmallPool;
-                unlock();
-                return ptr;
-            }
+    /** Bytes mapped for the extent of a block of \a bytes and \a kind */
+    static inline size_t extentLength(size_t bytes, int kind) {
+        const size_t realBytes = (kind == HEADER_BINS) ? USERSIZE_TO_REALSIZE(bytes) : bytes;
+        return (realBytes + extentPageSize - 1) & ~(size_t)(extentPageSize - 1);
+    }
 
-        } else if (bytes <= medBufferSize) {
-            // Note that a small allocation failure does *not* fall
-            // through into a medium allocation because that would
-            // waste the medium buffer's resources.
+    /** User size of a block of \a kind that fills an extent of \a length bytes */
+    static inline size_t extentUserBytes(size_t length, int kind) {
+        return (kind == HEADER_BINS) ? (length - ALIGNMENT_SIZE) : length;
+    }
 
-            UserPtr ptr = poolMalloc(medPool, medPoolSize, maxMedBuffers, bytes);
+    /** Removes entry \a i from the extent cache. Requires the lock. */
+    Extent uncacheExtent(int i) {
+        const Extent extent = extentCache[i];
+        for (int j = i + 1; j < extentCacheCount; ++j) {
+            extentCache[j - 1] = extentCache[j];
+        }
+        --extentCacheCount;
+        extentBytesCached -= extent.length;
+        return extent;
+    }
 
-            if (ptr) {
-                debugAssertM((intptr_t)ptr % 16 == 0, "BufferPool::poolMalloc(med) returned non-16 byte aligned memory");
-                ++mallocsFromMedPool;
-                unlock();
-                debugAssertM(ptr != nullptr, "BufferPool::malloc returned nullptr");
-                return ptr;
+    /** Cached extent of at least \a length and at most \a maxLength bytes with the least to spare, 
+        or -1. Requires the lock. */
+    int cachedExtentFor(size_t length, size_t maxLength) const {
+        int best = -1;
+        for (int i = 0; i < extentCacheCount; ++i) {
+            if ((extentCache[i].length >= length) && (extentCache[i].length <= maxLength) &&
+                ((best < 0) || (extentCache[i].length < extentCache[best].length))) {
+                best = i;
             }
         }
+        return best;
+    }
 
-        bytesAllocated.fetch_add(USERSIZE_TO_REALSIZE(bytes));
-        unlock();
+    /** Longest cached extent a block that needs \a length bytes takes */
+    static inline size_t maxExtentLengthFor(size_t length) {
+#       ifdef G3D_WINDOWS
+            // Windows cannot release the rest of a larger mapping
+            return length;
+#       else
+            (void)length;
+            return ~(size_t)0;
+#       endif
+    }
 
-        // Heap allocate
+    /** True if a block of \a bytes and \a kind would come from the extent cache. Does not require the lock. */
+    bool hasCachedExtentFor(size_t bytes, int kind) {
+        const size_t length = extentLength(bytes, kind);
+        lock();
+        const bool cached = (cachedExtentFor(length, maxExtentLengthFor(length)) >= 0);
+        unlock();
+        return cached;
+    }
 
-        // Allocate 4 extra bytes for our size header (unfortunate,
-        // since malloc already added its own header).
-        RealPtr ptr = ::malloc(USERSIZE_TO_REALSIZE(bytes));
-        if (ptr == nullptr) {
-#           ifdef G3D_WINDOWS
-                // Check for memory corruption
-                alwaysAssertM(_CrtCheckMemory() == TRUE, "Heap corruption detected.");
-#           endif
+    /** Returns an extent of \a length bytes, preferably from the cache. Does not require the lock. */
+    uint8* mapExtent(size_t length) {
+        Extent extent = {nullptr, 0, 0};
 
-            // Flush memory pools to try and recover space
-            flushPool(smallPool, smallPoolSize);
-            flushPool(medPool, medPoolSize);
-            ptr = ::malloc(USERSIZE_TO_REALSIZE(bytes));
+        lock();
+        const int i = cachedExtentFor(length, maxExtentLengthFor(length));
+        if (i >= 0) {
+            extent = uncacheExtent(i);
+            ++extentCacheHits;
         }
+        // Count the bytes mapped (or released from a larger cached extent) up front
+        extentBytesMapped += (int64)length - (int64)extent.length;
+        unlock();
 
-        if (ptr == nullptr) {
-            if ((SystemAlloc::outOfMemoryCallback() != nullptr) &&
-                (SystemAlloc::outOfMemoryCallback()(USERSIZE_TO_REALSIZE(bytes), true) == true)) {
-                // Re-attempt the malloc
-                ptr = ::malloc(USERSIZE_TO_REALSIZE(bytes));
-                
+        if (extent.start != nullptr) {
+            if (extent.length > length) {
+                releaseAddressSpace(extent.start + length, extent.length - length);
             }
+            return extent.start;
         }
 
-        if (ptr == nullptr) {
-            if (SystemAlloc::outOfMemoryCallback() != nullptr) {
-                // Notify the application
-                SystemAlloc::outOfMemoryCallback()(USERSIZE_TO_REALSIZE(bytes), false);
-            }
-#           ifdef G3D_DEBUG
-            debugPrintf("::malloc(%d) returned nullptr\n", (int)USERSIZE_TO_REALSIZE(bytes));
-#           endif
+        uint8* start = (uint8*)reserveAddressSpace(length);
+        if ((start != nullptr) && ! commitAddressSpace(start, length)) {
+            releaseAddressSpace(start, length);
+            start = nullptr;
+        }
+        if (start == nullptr) {
+            lock();
+            extentBytesMapped -= length;
+            unlock();
+        }
+        return start;
+    }
+
+    /** Caches or unmaps the extent at \a start. Does not require the lock. */
+    void unmapExtent(uint8* start, size_t length) {
+        Extent evicted = {nullptr, 0, 0};
+        const bool cache = (length <= maxCachedExtentBytes);
+
+        lock();
+        if (cache) {
+            if (extentCacheCount == extentCacheSize) {
+                evicted = uncacheExtent(0);
+                extentBytesMapped -= evicted.length;
+            }
+            const Extent extent = {start, length, trimEpoch};
+            extentCache[extentCacheCount] = extent;
+            ++extentCacheCount;
+            extentBytesCached += length;
+        } else {
+            extentBytesMapped -= length;
+        }
+        unlock();
+
+        if (evicted.start != nullptr) {
+            releaseAddressSpace(evicted.start, evicted.length);
+        }
+        if (! cache) {
+            releaseAddressSpace(start, length);
+        }
+    }
+
+    /** Size of the heap block that serves a request of \a bytes of \a kind with minAlignment, 
+        see poolAllocate */
+    inline size_t heapBlockBytes(size_t bytes, int kind) const {
+        if (bytes <= medBufferSize) {
+            return binBytes(binIndex(bytes));
+        } else if (isExtentBlock(bytes, kind)) {
+            return extentUserBytes(extentLength(bytes, kind), kind);
+        }
+        return bytes;
+    }
+
+    /** Allocates a block of the given kind (see numAllBins) from the heap or, for large blocks, 
+        an extent, whose user size is returned in \a bytes. Returns the address of the size header 
+        for HEADER_BINS. Does not require the lock. */
+    inline RealPtr heapMalloc(int kind, size_t& bytes, size_t alignment) {
+        if (isExtentBlock(bytes, kind)) {
+            const size_t length = extentLength(bytes, kind);
+            uint8* start  = mapExtent(length);
+            if (start != nullptr) {
+                bytes = extentUserBytes(length, kind);
+            }
+            return start;
+        } else if (kind == HEADER_BINS) {
+            return heapBlockMalloc(bytes);
+        } else if (trackHeapBlocks) {
+            return trackedBlockMalloc(bytes, alignment);
+        } else if (kind == SIZED_BINS) {
+            return ::malloc(bytes);
+        }
+#       ifdef G3D_WINDOWS
+            return _aligned_malloc(bytes, alignment);
+#       else
+            void* ptr = nullptr;
+            return (posix_memalign(&ptr, alignment, bytes) == 0) ? ptr : nullptr;
+#       endif
+    }
+
+    /** Frees a block of \a bytes obtained from heapMalloc. It must have been unlinked. Does 
+        not require the lock. */
+    inline void heapFree(int kind, UserPtr ptr, size_t bytes) {
+        if (kind == HEADER_BINS) {
+            heapBlockFree(ptr);
+        } else if (trackHeapBlocks) {
+            ::free(heapBlockBase(ptr));
+        } else if (isExtentBlock(bytes, kind)) {
+            unmapExtent((uint8*)ptr, extentLength(bytes, kind));
+        } else if (kind == SIZED_BINS) {
+            ::free(ptr);
+        } else {
+#           ifdef G3D_WINDOWS
+                _aligned_free(ptr);
+#           else
+                ::free(ptr);
+#           endif
+        }
+    }
+
+    /** Freelist of each bin: a stack, most recently freed block first, linked both ways so 
+        that the block that has been free for the longest (binTail) can be evicted */
+    FreeBlock* binHead[numAllBins];
+    FreeBlock* binTail[numAllBins];
+
+    /** Incremented by each block put into a bin */
+    uint32 binClock;
+    LockedCounter<int64> binSize[numAllBins];
+
+    /** Bit b is set iff bin b is non-empty */
+    uint64 binMask;
+
+    /** Total blocks in the small and medium bins */
+    LockedCounter<int64> smallPoolSize;
+    LockedCounter<int64> medPoolSize;
+
+    /** The tiny pool is a single block of storage into which all tiny
+        objects are allocated.  This provides better locality for
+        small objects and avoids the search time, since all tiny
+        blocks of a class are exactly the same size. 
+
+        State of one tiny size class: */
+    class TinyClass {
+    public:
+        /** The link to the next free buffer is stored inside each free buffer 
+            (see tinyLink), so the freelist needs no storage of its own. */
+        FreeBlock*  freeList;
+
+        /** Number of buffers on freeList */
+        LockedCounter<int64> freeCount;
+
+        /** Uncarved rest of the class's newest chunk */
+        uint8*      carve;
+        uint8*      carveEnd;
+
+        /** Chunks of the tiny heap holding buffers of this class */
+        LockedCounter<int64> chunks;
+
+        /** Buffers carved out of the chunks */
+        LockedCounter<int64> carved;
+
+        /** Buffers parked in the per-thread caches */
+        LockedCounter<int64> buffersInThreadCaches;
+    };
+
+    TinyClass tinyClass[numTinyClasses];
+
+    /** Number of free buffers on all tiny freelists */
+    LockedCounter<int64> tinyPoolSize;
+
+    /** Pointer to the data in the tiny pool, or nullptr until the first tiny buffer is carved, 
+        see reserveTinyHeapAddressSpace */
+    LockedCounter<uint8*> tinyHeap;
+
+    /** Address space reserved at tinyHeap, at least tinyHeapSize */
+    size_t tinyHeapMapped;
+
+    /** Set when the tiny heap could not be reserved; tiny requests are then served by the small pool */
+    bool tinyHeapUnavailable;
+
+    /** A Stats::PageMode */
+    LockedCounter<int> tinyHeapPages;
+
+    /** Number of chunks at the start of the tiny heap that have been handed to a tiny class */
+    LockedCounter<int64> tinyChunksCarved;
+
+    /** Tiny class of each carved chunk */
+    uint8 tinyChunkClass[maxTinyChunks];
+
+    /** Thread cache that carved each chunk (see ThreadCache::owner), or noTinyOwner. Buffers 
+        of the chunk freed by other threads are handed back to that thread's cache. */
+    uint8 tinyChunkOwner[maxTinyChunks];
+
+    /** Buffers of each carved chunk on its class's freelist. releasingTinyChunk marks 
+        chunks that releaseTinyChunks is about to decommit. */
+    uint16 tinyChunkFree[maxTinyChunks];
+    enum {releasingTinyChunk = 0xFFFF};
+
+    /** trimEpoch when the last buffer of a chunk was freed */
+    uint32 tinyChunkIdleSince[maxTinyChunks];
+
+    /** Chunks returned to the OS by releaseTinyChunks. They are handed to a class again
+        before any new chunk is carved. */
+    uint16 tinyDecommitted[maxTinyChunks];
+    LockedCounter<int64> tinyDecommittedCount;
+
+    /** Index of the chunk of a pointer into the tiny heap */
+    inline size_t tinyChunkOf(const void* ptr) const {
+        return ((const uint8*)ptr - (const uint8*)tinyHeap) / tinyChunkSize;
+    }
+
+    static inline int buffersPerTinyChunk(int c) {
+        return (int)(tinyChunkSize / tinyClassBytes(c));
+    }
+
+    /** Reserves the address space of the tiny heap when the first chunk is carved, so that a pool 
+        which serves no tiny requests, e.g. a PoolHeap for large blocks, does not hold its 64 MB. 
+        Returns false if the tiny heap could not be reserved. Requires the lock. */
+    bool reserveTinyHeapAddressSpace() {
+        if ((tinyHeap != nullptr) || tinyHeapUnavailable) {
+            return ! tinyHeapUnavailable;
+        }
+
+#       ifdef HUGE_PAGES
+            bool huge = false;
+            tinyHeapMapped = (tinyHeapSize + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+            tinyHeap       = (uint8*)reserveHugeAddressSpace(tinyHeapMapped, huge);
+            tinyHeapPages  = huge ? Stats::HUGE_PAGE_MODE : Stats::HUGE_PAGE_MODE_UNAVAILABLE;
+#       else
+            tinyHeapMapped = tinyHeapSize;
+            tinyHeap       = (uint8*)reserveAddressSpace(tinyHeapMapped);
+#       endif
+
+        tinyHeapUnavailable = (tinyHeap == nullptr);
+        return ! tinyHeapUnavailable;
+    }
+
+    /** Carves the next buffer of tiny class \a c, handing a new chunk of the tiny heap 
+        to the class and to \a owner when needed. Returns nullptr when the tiny heap is 
+        exhausted. Requires the lock. */
+    UserPtr carveTinyBuffer(int c, int owner) {
+        TinyClass& tc = tinyClass[c];
+
+        // Chunks of node classes end in a remainder too small for another buffer
+        if ((size_t)(tc.carveEnd - tc.carve) < tinyClassBytes(c)) {
+            // Reuse decommitted chunks before carving new ones
+            const bool reuse = (tinyDecommittedCount > 0);
+            if (! reserveTinyHeapAddressSpace() || (! reuse && (tinyChunksCarved == maxTinyChunks))) {
+                return nullptr;
+            }
+
+            const size_t index = reuse ? tinyDecommitted[tinyDecommittedCount - 1] : (size_t)int64(tinyChunksCarved);
+            uint8* chunk = (uint8*)tinyHeap + index * tinyChunkSize;
+            if (! commitAddressSpace(chunk, tinyChunkSize)) {
+                return nullptr;
+            }
+            if (reuse) {
+                --tinyDecommittedCount;
+            } else {
+                ++tinyChunksCarved;
+            }
+            tinyChunkClass[index] = (uint8)c;
+            tinyChunkOwner[index] = (uint8)owner;
+            tinyChunkFree[index]  = 0;
+            ++tc.chunks;
+            tc.carve    = chunk;
+            tc.carveEnd = chunk + tinyChunkSize;
+        }
+
+        UserPtr ptr = tc.carve;
+        tc.carve += tinyClassBytes(c);
+        ++tc.carved;
+        return ptr;
+    }
+
+#   ifdef OBFUSCATE_FREELIST
+    /** Per-pool secret mixed into the freelist links */
+    uintptr_t tinyLinkKey;
+#   endif
+
+    /** Encodes the link to \a next stored in the free tiny buffer \a block.
+        With OBFUSCATE_FREELIST the link is mangled with the buffer's address 
+        and a per-pool key, so that a stray write or a double free is detected 
+        by tinyUnlink instead of handing out an arbitrary address. */
+    inline FreeBlock* tinyLink(const FreeBlock* block, FreeBlock* next) const {
+#       ifdef OBFUSCATE_FREELIST
+            return (FreeBlock*)((uintptr_t)next ^ ((uintptr_t)block >> 12) ^ tinyLinkKey);
+#       else
+            (void)block;
+            return next;
+#       endif
+    }
+
+    /** Decodes and validates the link stored in the free tiny buffer \a block */
+    inline FreeBlock* tinyUnlink(const FreeBlock* block) const {
+        FreeBlock* next = tinyLink(block, block->next);
+
+#       ifdef OBFUSCATE_FREELIST
+            // The next buffer must start a buffer of the same class
+            alwaysAssertM((next == nullptr) || 
+                          (inTinyHeap(next) && (tinyClassOf(next) == tinyClassOf(block)) &&
+                           (((uint8*)next - (uint8*)tinyHeap) % tinyChunkSize % tinyClassBytes(tinyClassOf(block)) == 0)),
+                          "SystemAlloc::malloc heap corruption detected: invalid tiny freelist link");
+#       else
+            debugAssertM((next == nullptr) || inTinyHeap(next),
+                         "SystemAlloc::malloc heap corruption detected: invalid tiny freelist link");
+#       endif
+
+        return next;
+    }
+
+    Spinlock            m_lock;
+
+    /** Unsynchronized pools (see PoolHeap::UNSYNCHRONIZED) skip m_lock */
+    const bool          isSynchronized;
+
+#   ifdef G3D_DEBUG
+    /** Thread that first locked an unsynchronized pool; no other thread may use it */
+    std::atomic<std::thread::id> ownerThread;
+#   endif
+
+    inline void lock() {
+        if (isSynchronized) {
+            m_lock.lock();
+            return;
+        }
+#       ifdef G3D_DEBUG
+            std::thread::id owner;
+            ownerThread.compare_exchange_strong(owner, std::this_thread::get_id());
+            debugAssertM((owner == std::thread::id()) || (owner == std::this_thread::get_id()),
+                         "PoolHeap::UNSYNCHRONIZED: the heap is used by another thread than its owner");
+#       endif
+    }
+
+    inline void unlock() {
+        if (isSynchronized) {
+            m_lock.unlock();
+        }
+    }
+
+    /** 
+     Malloc out of the tiny heap. Returns nullptr if allocation failed.
+     \a owner: the owner of a newly carved chunk, see tinyChunkOwner.
+     */
+    inline UserPtr tinyMalloc(size_t bytes, int owner = noTinyOwner) {
+        assert(tinyBufferSize >= bytes);
+        return tinyMallocClass(tinyClassIndex(bytes), owner);
+    }
+
+    /** Like tinyMalloc, for a buffer of tiny class \a c */
+    inline UserPtr tinyMallocClass(int c, int owner = noTinyOwner) {
+        TinyClass& tc = tinyClass[c];
+
+        if (tc.freeList == nullptr) {
+            return carveTinyBuffer(c, owner);
+        }
+
+        // Pop the most recently freed buffer
+        FreeBlock* block = tc.freeList;
+        tc.freeList = tinyUnlink(block);
+        --tc.freeCount;
+        --tinyPoolSize;
+        --tinyChunkFree[tinyChunkOf(block)];
+
+        return block;
+    }
+
+    void tinyFree(UserPtr ptr) {
+        assert(ptr);
+        const size_t chunk = tinyChunkOf(ptr);
+        const int c = tinyChunkClass[chunk];
+        TinyClass& tc = tinyClass[c];
+
+        debugAssertM(ptr != tc.freeList, 
+                     "SystemAlloc::malloc heap corruption detected: "
+                     "the same tiny buffer was freed twice in a row (during tinyFree).");
+
+        // Put the buffer back onto its class's free list
+        FreeBlock* block = (FreeBlock*)ptr;
+        block->next = tinyLink(block, tc.freeList);
+        tc.freeList = block;
+        ++tc.freeCount;
+        ++tinyPoolSize;
+
+        if (++tinyChunkFree[chunk] == buffersPerTinyChunk(c)) {
+            tinyChunkIdleSince[chunk] = trimEpoch;
+        }
+    }
+
+    /** Decommits chunks of the tiny heap all of whose buffers have been on the freelists 
+        for at least \a minIdleEpochs, up to \a maxBytes. Returns the bytes decommitted.
+        Requires the lock. */
+    size_t releaseTinyChunks(size_t maxBytes, uint32 minIdleEpochs) {
+        size_t released = 0;
+
+        for (int c = 0; (c < numTinyClasses) && (released < maxBytes); ++c) {
+            TinyClass& tc = tinyClass[c];
+            const int full = buffersPerTinyChunk(c);
+
+            int64 chunks = 0;
+            for (int64 i = 0; (i < tinyChunksCarved) && (released < maxBytes); ++i) {
+                if ((tinyChunkClass[i] == c) && (tinyChunkFree[i] == full) && 
+                    (trimEpoch - tinyChunkIdleSince[i] >= minIdleEpochs)) {
+                    tinyChunkFree[i] = releasingTinyChunk;
+                    released += tinyChunkSize;
+                    ++chunks;
+                }
+            }
+            if (chunks == 0) {
+                continue;
+            }
+
+            // Drop the buffers of the released chunks from the freelist, preserving the order of the others
+            FreeBlock* head = nullptr;
+            FreeBlock* tail = nullptr;
+            for (FreeBlock* block = tc.freeList; block != nullptr; ) {
+                FreeBlock* next = tinyUnlink(block);
+                if (tinyChunkFree[tinyChunkOf(block)] != releasingTinyChunk) {
+                    if (tail != nullptr) {
+                        tail->next = tinyLink(tail, block);
+                    } else {
+                        head = block;
+                    }
+                    tail = block;
+                }
+                block = next;
+            }
+            if (tail != nullptr) {
+                tail->next = tinyLink(tail, nullptr);
+            }
+            tc.freeList = head;
+
+            for (int64 i = 0; i < tinyChunksCarved; ++i) {
+                if (tinyChunkFree[i] == releasingTinyChunk) {
+                    decommitAddressSpace((uint8*)tinyHeap + (size_t)i * tinyChunkSize, tinyChunkSize);
+                    tinyChunkFree[i] = 0;
+                    tinyDecommitted[tinyDecommittedCount] = (uint16)i;
+                    ++tinyDecommittedCount;
+                }
+            }
+
+            const int64 buffers = chunks * full;
+            tc.chunks       -= chunks;
+            tc.carved       -= buffers;
+            tc.freeCount    -= buffers;
+            tinyPoolSize    -= buffers;
+        }
+
+        return released;
+    }
+
+    /** Requires the lock. Resets \a counters. */
+    inline void addCounters(Counters& counters) {
+        totalMallocs               += counters.totalMallocs;
+        mallocsFromTinyPool        += counters.mallocsFromTinyPool;
+        mallocsFromSmallPool       += counters.mallocsFromSmallPool;
+        mallocsFromMedPool         += counters.mallocsFromMedPool;
+        for (int p = 0; p < Stats::numPools; ++p) {
+            bytesInUse[p]          += counters.bytesInUse[p];
+        }
+        for (int b = 0; b < Stats::numSizeBuckets; ++b) {
+            mallocSizeHistogram[b] += counters.mallocSizeHistogram[b];
+        }
+        for (int c = 0; c < numTinyClasses; ++c) {
+            tinyClass[c].buffersInThreadCaches += counters.tinyBuffersCached[c];
+            tinyBuffersInThreadCaches          += counters.tinyBuffersCached[c];
+        }
+        smallBuffersInThreadCaches += counters.smallBuffersCached;
+        medBuffersInThreadCaches   += counters.medBuffersCached;
+        remoteFrees                += counters.remoteFrees;
+        counters = Counters();
+    }
+
+    inline LockedCounter<int64>& poolSizeOfBin(int bin) {
+        return isSmallBin(bin) ? smallPoolSize : medPoolSize;
+    }
+
+    /** Requires the lock. */
+    inline UserPtr binPop(int bin) {
+        FreeBlock* block = binHead[bin];
+        debugAssert(block != nullptr);
+
+        // The new head's prev is left stale, so that its (cold) memory is not touched
+        binHead[bin] = block->next;
+        if (binHead[bin] == nullptr) {
+            binTail[bin] = nullptr;
+            binMask &= ~((uint64)1 << bin);
+        }
+        --binSize[bin];
+        --poolSizeOfBin(bin);
+        return block;
+    }
+
+    /** Removes the block that has been in \a bin for the longest. Requires the lock. */
+    inline UserPtr binPopOldest(int bin) {
+        FreeBlock* block = binTail[bin];
+        debugAssert(block != nullptr);
+
+        if (block == binHead[bin]) {
+            binHead[bin] = nullptr;
+            binTail[bin] = nullptr;
+            binMask &= ~((uint64)1 << bin);
+        } else {
+            binTail[bin] = block->prev;
+            binTail[bin]->next = nullptr;
+        }
+        --binSize[bin];
+        --poolSizeOfBin(bin);
+        return block;
+    }
+
+    /** Requires the lock. */
+    inline void binPush(int bin, UserPtr ptr) {
+        FreeBlock* block = (FreeBlock*)ptr;
+        block->freeEpoch = trimEpoch;
+        block->freeTick  = ++binClock;
+        block->next = binHead[bin];
+        if (binHead[bin] != nullptr) {
+            binHead[bin]->prev = block;
+        } else {
+            binTail[bin] = block;
+        }
+        binHead[bin] = block;
+        ++binSize[bin];
+        ++poolSizeOfBin(bin);
+        binMask |= ((uint64)1 << bin);
+    }
+
+    /** Releases every block in bins [firstBin, endBin) to the heap. Requires the lock. */
+    void flushBins(int firstBin, int endBin) {
+        for (int bin = firstBin; bin < endBin; ++bin) {
+            while (binHead[bin] != nullptr) {
+                UserPtr ptr = binPop(bin);
+                bytesAllocated -= binRealBytes(bin);
+                unlinkHeapBlock(ptr);
+                binBlockFree(bin, ptr);
+            }
+        }
+    }
+
+    /** Makes room in the full small (or else medium) pool by releasing 1 / evictionFraction 
+        of its blocks to the heap. Each evicted block is the oldest one of the bin whose oldest 
+        block scores highest, the score being its size times the number of blocks freed since 
+        it was put into its bin: blocks that are large and have not been reused for long go first, 
+        as do the blocks at the bottom of a bin that holds more blocks than are requested. Recently 
+        freed blocks of the sizes in demand stay. Requires the lock. */
+    void evictBlocks(bool small) {
+        const int64 count = (small ? maxSmallBuffers : maxMedBuffers) / evictionFraction;
+
+        int64 evicted = 0;
+        for (; evicted < count; ++evicted) {
+            int    victim = -1;
+            uint64 best   = 0;
+            for (int first = 0; first < numAllBins; first += numBins) {
+                const int endBin = first + (small ? numSmallBins : numBins);
+                for (int bin = first + (small ? 0 : numSmallBins); bin < endBin; ++bin) {
+                    if (binTail[bin] != nullptr) {
+                        const uint64 score = (uint64)(uint32)(binClock - binTail[bin]->freeTick + 1) * binBytes(bin);
+                        if (score > best) {
+                            best   = score;
+                            victim = bin;
+                        }
+                    }
+                }
+            }
+            if (victim < 0) {
+                break;
+            }
+
+            UserPtr ptr = binPopOldest(victim);
+            bytesAllocated -= binRealBytes(victim);
+            unlinkHeapBlock(ptr);
+            binBlockFree(victim, ptr);
+        }
+
+        if (small) {
+            ++smallPoolPurgeCount;
+            smallPoolEvictions += evicted;
+        } else {
+            ++medPoolPurgeCount;
+            medPoolEvictions += evicted;
+        }
+    }
+
+    /** Removes the blocks of \a bin below the first \a minKeep ones that have been in the bin
+        for at least \a minIdleEpochs, and unlinks them from heapBlocks. Returns them as a list 
+        for freeBlockList and their number in \a count. Requires the lock. */
+    FreeBlock* binDetachOld(int bin, int64 minKeep, uint32 minIdleEpochs, int64& count) {
+        // Blocks further down the stack have been free for longer
+        FreeBlock** link = &binHead[bin];
+        FreeBlock*  last = nullptr;
+        int64 kept = 0;
+        while ((*link != nullptr) && ((kept < minKeep) || (trimEpoch - (*link)->freeEpoch < minIdleEpochs))) {
+            last = *link;
+            link = &(*link)->next;
+            ++kept;
+        }
+
+        FreeBlock* detached = *link;
+        *link = nullptr;
+        binTail[bin] = last;
+
+        count = binSize[bin] - kept;
+        binSize[bin] = kept;
+        poolSizeOfBin(bin) -= count;
+        if (binHead[bin] == nullptr) {
+            binMask &= ~((uint64)1 << bin);
+        }
+        bytesAllocated -= binRealBytes(bin) * count;
+
+        for (FreeBlock* block = detached; block != nullptr; block = block->next) {
+            unlinkHeapBlock(block);
+        }
+        return detached;
+    }
+
+    /** Returns a list of blocks of \a bin built by binDetachOld to the heap. Does not require the lock. */
+    void freeBlockList(int bin, FreeBlock* block) {
+        while (block != nullptr) {
+            FreeBlock* next = block->next;
+            binBlockFree(bin, block);
+            block = next;
+        }
+    }
+
+    /** Allocate a block for \a bin out of the small or medium bins.  Return nullptr 
+        if no suitable memory was found. Requires the lock. */
+    UserPtr poolMalloc(int bin) {
+        // Note that a small allocation never takes a medium block 
+        // because that would waste the medium buffer's resources.
+        const int firstBin = binKind(bin) * numBins;
+        const int endBin   = firstBin + (isSmallBin(bin) ? numSmallBins : numBins);
+        const int slack    = (binKind(bin) == HEADER_BINS) ? maxBinSlack : 0;
+
+        // Smallest non-empty bin that is big enough but not too wasteful
+        const uint64 candidates = binMask & 
+            ((((uint64)1 << (slack + 1)) - 1) << bin) & 
+            (((uint64)1 << endBin) - 1);
+
+        if (candidates != 0) {
+            return binPop(lowestBit(candidates));
+        }
+
+        return nullptr;
+    }
+
+    /** Returns a small or medium block to \a bin. If the pool is full, older blocks are evicted 
+        to make room for it (see evictBlocks), unless \a evict is false, in which case this returns 
+        false. Requires the lock. */
+    inline bool poolFree(int bin, UserPtr ptr, bool evict = true) {
+        const bool small = isSmallBin(bin);
+        if (small ? (smallPoolSize >= maxSmallBuffers) : (medPoolSize >= maxMedBuffers)) {
+            if (! evict) {
+                return false;
+            }
+            evictBlocks(small);
+        }
+        binPush(bin, ptr);
+        return true;
+    }
+
+    /** Links stored in the first bytes of a free block of the buddy heap */
+    class BuddyBlock {
+    public:
+        BuddyBlock* prev;
+        BuddyBlock* next;
+
+        /** trimEpoch when the block was freed or merged */
+        uint32      freeEpoch;
+    };
+
+    /** Start of the buddy heap, or nullptr until the first buddy block is allocated, see 
+        reserveBuddyHeapAddressSpace */
+    LockedCounter<uint8*> buddyHeap;
+
+    /** Set when the buddy heap could not be reserved; its blocks then come from the bins and extents */
+    bool buddyHeapUnavailable;
+
+    /** State of each minBuddyBlockSize unit of the buddy heap: zero unless a block starts there, 
+        else the order of that block + 1, with buddyFreeFlag set while it is free. Buddy blocks 
+        have no size header; this is where their size is read from. */
+    uint8 buddyUnitState[maxBuddyUnits];
+    enum {buddyFreeFlag = 0x80};
+
+    /** Bytes requested for the block in use that starts at each unit, see Stats::buddyBytesRequested */
+    uint32 buddyUnitRequested[maxBuddyUnits];
+
+    /** Free blocks of each order, doubly linked so that a block can be taken out when its buddy is freed */
+    BuddyBlock* buddyFreeList[numBuddyOrders];
+    LockedCounter<int64> buddyFreeCount[numBuddyOrders];
+
+    /** Number of chunks at the start of the buddy heap that have been committed */
+    LockedCounter<int64> buddyChunksCarved;
+
+    /** Chunks returned to the OS by releaseBuddyChunks. They are committed again before any new chunk. */
+    uint16 buddyDecommitted[maxBuddyChunks];
+    LockedCounter<int64> buddyDecommittedCount;
+
+    /** See Stats::buddyBytesInUse etc. */
+    LockedCounter<int64>  buddyBytesInUse;
+    LockedCounter<int64>  buddyBytesRequested;
+    LockedCounter<uint64> buddySplits;
+    LockedCounter<uint64> buddyMerges;
+
+    /** Index of the unit of a pointer into the buddy heap */
+    inline size_t buddyUnitOf(const void* ptr) const {
+        return ((const uint8*)ptr - (const uint8*)buddyHeap) / minBuddyBlockSize;
+    }
+
+    inline BuddyBlock* buddyBlockAt(size_t unit) const {
+        return (BuddyBlock*)((uint8*)buddyHeap + unit * minBuddyBlockSize);
+    }
+
+    /** Order of the block in use at \a unit */
+    inline int buddyOrderAt(size_t unit) const {
+        debugAssertM((buddyUnitState[unit] != 0) && ! (buddyUnitState[unit] & buddyFreeFlag), 
+                     "SystemAlloc::free heap corruption detected: no buddy block in use at this address");
+        return buddyUnitState[unit] - 1;
+    }
+
+    /** Puts the block at \a unit onto the free list of \a order. Requires the lock. */
+    void buddyPush(size_t unit, int order) {
+        BuddyBlock* block = buddyBlockAt(unit);
+        block->prev      = nullptr;
+        block->next      = buddyFreeList[order];
+        block->freeEpoch = trimEpoch;
+        if (block->next != nullptr) {
+            block->next->prev = block;
+        }
+        buddyFreeList[order] = block;
+        ++buddyFreeCount[order];
+        buddyUnitState[unit] = (uint8)(buddyFreeFlag | (order + 1));
+    }
+
+    /** Takes the free block at \a unit off the free list of \a order. Requires the lock. */
+    void buddyUnlink(size_t unit, int order) {
+        BuddyBlock* block = buddyBlockAt(unit);
+        if (block->prev != nullptr) {
+            block->prev->next = block->next;
+        } else {
+            buddyFreeList[order] = block->next;
+        }
+        if (block->next != nullptr) {
+            block->next->prev = block->prev;
+        }
+        --buddyFreeCount[order];
+        buddyUnitState[unit] = 0;
+    }
+
+    /** Reserves the address space of the buddy heap when its first chunk is committed, like 
+        reserveTinyHeapAddressSpace. Returns false if it could not be reserved. Requires the lock. */
+    bool reserveBuddyHeapAddressSpace() {
+        if ((buddyHeap != nullptr) || buddyHeapUnavailable) {
+            return ! buddyHeapUnavailable;
+        }
+
+#       ifndef NO_BUDDY_HEAP
+            buddyHeap = (uint8*)reserveAddressSpace(buddyHeapSize);
+#       endif
+        buddyHeapUnavailable = (buddyHeap == nullptr);
+        if (! buddyHeapUnavailable) {
+            SystemAlloc::memset(buddyUnitState, 0, sizeof(buddyUnitState));
+        }
+        return ! buddyHeapUnavailable;
+    }
+
+    /** Commits a chunk of the buddy heap, preferably one that was decommitted, as a free block 
+        of the largest order. Returns false when the buddy heap is exhausted. Requires the lock. */
+    bool buddyAddChunk() {
+        const bool reuse = (buddyDecommittedCount > 0);
+        if (! reserveBuddyHeapAddressSpace() || (! reuse && (buddyChunksCarved == maxBuddyChunks))) {
+            return false;
+        }
+
+        const size_t index = reuse ? buddyDecommitted[buddyDecommittedCount - 1] : (size_t)int64(buddyChunksCarved);
+        if (! commitAddressSpace((uint8*)buddyHeap + index * buddyChunkSize, buddyChunkSize)) {
+            return false;
+        }
+        if (reuse) {
+            --buddyDecommittedCount;
+        } else {
+            ++buddyChunksCarved;
+        }
+        buddyPush(index * buddyUnitsPerChunk, numBuddyOrders - 1);
+        return true;
+    }
+
+    /** Allocates a block of the buddy heap for \a bytes (medBufferSize < bytes <= maxBuddyBlockSize), 
+        splitting a larger free block if there is none of its order. Returns nullptr when the buddy 
+        heap is exhausted. Requires the lock. */
+    UserPtr buddyMalloc(size_t bytes) {
+        const int order = buddyOrderOf(bytes);
+
+        int k = order;
+        while ((k < numBuddyOrders) && (buddyFreeList[k] == nullptr)) {
+            ++k;
+        }
+        if (k == numBuddyOrders) {
+            if (! buddyAddChunk()) {
+                return nullptr;
+            }
+            k = numBuddyOrders - 1;
+        }
+
+        const size_t unit = buddyUnitOf(buddyFreeList[k]);
+        buddyUnlink(unit, k);
+
+        // Keep the lower half of each split and free the upper one
+        while (k > order) {
+            --k;
+            buddyPush(unit + ((size_t)1 << k), k);
+            ++buddySplits;
+        }
+
+        buddyUnitState[unit]     = (uint8)(order + 1);
+        buddyUnitRequested[unit] = (uint32)bytes;
+        buddyBytesInUse     += buddyBlockBytes(order);
+        buddyBytesRequested += bytes;
+        bytesInUse[Stats::LARGE_BLOCKS] += buddyBlockBytes(order);
+        return buddyBlockAt(unit);
+    }
+
+    /** Returns a block to the buddy heap, merging it with its buddy as long as that is free. 
+        Requires the lock. */
+    void buddyFree(UserPtr ptr) {
+        size_t unit = buddyUnitOf(ptr);
+        int order = buddyOrderAt(unit);
+
+        buddyBytesInUse     -= buddyBlockBytes(order);
+        buddyBytesRequested -= buddyUnitRequested[unit];
+        bytesInUse[Stats::LARGE_BLOCKS] -= buddyBlockBytes(order);
+        buddyUnitState[unit] = 0;
+
+        // Chunks are aligned to buddyUnitsPerChunk units, so the buddy differs in a single bit
+        while (order < numBuddyOrders - 1) {
+            const size_t buddy = unit ^ ((size_t)1 << order);
+            if (buddyUnitState[buddy] != (uint8)(buddyFreeFlag | (order + 1))) {
+                break;
+            }
+            buddyUnlink(buddy, order);
+            unit &= ~((size_t)1 << order);
+            ++order;
+            ++buddyMerges;
+        }
+        buddyPush(unit, order);
+    }
+
+    /** Grows the buddy block \a ptr in place to hold \a bytes by merging it with the free blocks 
+        that follow it, i.e. as long as it is the lower half of the next larger block and the upper 
+        half is free. Returns false if it cannot, or if \a bytes needs a smaller block. Does not 
+        require the lock. */
+    bool buddyExpand(UserPtr ptr, size_t bytes) {
+        if ((bytes > maxBuddyBlockSize) || (bytes <= medBufferSize)) {
+            return false;
+        }
+        const size_t unit     = buddyUnitOf(ptr);
+        const int    newOrder = buddyOrderOf(bytes);
+
+        lock();
+        const int order = buddyOrderAt(unit);
+        bool expandable = (newOrder >= order);
+        for (int k = order; expandable && (k < newOrder); ++k) {
+            expandable = ((unit & ((size_t)1 << k)) == 0) && 
+                         (buddyUnitState[unit + ((size_t)1 << k)] == (uint8)(buddyFreeFlag | (k + 1)));
+        }
+        if (expandable && (newOrder > order)) {
+            for (int k = order; k < newOrder; ++k) {
+                buddyUnlink(unit + ((size_t)1 << k), k);
+                ++buddyMerges;
+            }
+            const size_t grown = buddyBlockBytes(newOrder) - buddyBlockBytes(order);
+            buddyUnitState[unit] = (uint8)(newOrder + 1);
+            buddyBytesInUse     += grown;
+            buddyBytesRequested += (int64)bytes - (int64)buddyUnitRequested[unit];
+            buddyUnitRequested[unit] = (uint32)bytes;
+            bytesInUse[Stats::LARGE_BLOCKS] += grown;
+        }
+        unlock();
+
+        return expandable;
+    }
+
+    /** Decommits chunks of the buddy heap that have been wholly free for at least \a minIdleEpochs, 
+        up to \a maxBytes. Returns the bytes decommitted. Requires the lock. */
+    size_t releaseBuddyChunks(size_t maxBytes, uint32 minIdleEpochs) {
+        const int top = numBuddyOrders - 1;
+        size_t released = 0;
+
+        for (BuddyBlock* block = buddyFreeList[top]; (block != nullptr) && (released < maxBytes); ) {
+            BuddyBlock* next = block->next;
+            if (trimEpoch - block->freeEpoch >= minIdleEpochs) {
+                const size_t unit = buddyUnitOf(block);
+                buddyUnlink(unit, top);
+                decommitAddressSpace(block, buddyChunkSize);
+                buddyDecommitted[buddyDecommittedCount] = (uint16)(unit / buddyUnitsPerChunk);
+                ++buddyDecommittedCount;
+                released += buddyChunkSize;
+            }
+            block = next;
+        }
+
+        return released;
+    }
+
+public:
+
+    /** Count of memory allocations that have occurred. */
+    LockedCounter<uint64> totalMallocs;
+    LockedCounter<uint64> mallocsFromTinyPool;
+    LockedCounter<uint64> mallocsFromSmallPool;
+    LockedCounter<uint64> mallocsFromMedPool;
+    LockedCounter<uint64> mallocsFromBuddyHeap;
+
+    /** Most free blocks the small and medium pools hold, see setPoolLimits */
+    LockedCounter<int64> maxSmallBuffers;
+    LockedCounter<int64> maxMedBuffers;
+
+    LockedCounter<uint64> smallPoolPurgeCount;
+    LockedCounter<uint64> medPoolPurgeCount;
+    LockedCounter<uint64> smallPoolEvictions;
+    LockedCounter<uint64> medPoolEvictions;
+
+    /** See Stats::remoteFrees */
+    LockedCounter<uint64> remoteFrees;
+
+    /** Number of blocks currently parked in the per-thread caches (see ThreadCache).
+        These are neither in the pools nor in use by the application. */
+    LockedCounter<int64> tinyBuffersInThreadCaches;
+    LockedCounter<int64> smallBuffersInThreadCaches;
+    LockedCounter<int64> medBuffersInThreadCaches;
+
+    /** See Stats::bytesInUse. Signed, because other threads' changes may be folded in out of order. */
+    LockedCounter<int64> bytesInUse[Stats::numPools];
+
+    LockedCounter<uint64> mallocSizeHistogram[Stats::numSizeBuckets];
+
+    /** Amount of memory currently allocated (according to the application). 
+        This does not count the memory still remaining in the buffer pool,
+        but does count extra memory required for rounding off to the size
+        of a buffer.
+        Primarily useful for detecting leaks.*/
+    LockedCounter<uint64> bytesAllocated;
+
+    /** Returns true if this is a pointer into the tiny heap. */
+    bool inTinyHeap(UserPtr ptr) const {
+        const uint8* heap = tinyHeap;
+        return 
+            (heap != nullptr) &&
+            (ptr >= heap) && 
+            (ptr < heap + tinyHeapSize);
+    }
+
+    /** Returns true if this is a pointer into the buddy heap. */
+    bool inBuddyHeap(UserPtr ptr) const {
+        const uint8* heap = buddyHeap;
+        return 
+            (heap != nullptr) &&
+            (ptr >= heap) && 
+            (ptr < heap + buddyHeapSize);
+    }
+
+    /** User size of a block of malloc that is not in the tiny heap. Blocks of the buddy 
+        heap have no size header; they hold the whole buddy block. */
+    inline size_t userSizeOf(UserPtr ptr) const {
+        return inBuddyHeap(ptr) ? buddyBlockBytes(buddyOrderAt(buddyUnitOf(ptr))) : USERSIZE_FROM_USERPTR(ptr);
+    }
+
+    /** Tiny class of a pointer into the tiny heap */
+    inline int tinyClassOf(const void* ptr) const {
+        return tinyChunkClass[tinyChunkOf(ptr)];
+    }
+
+    /** Owner of the chunk of a tiny buffer, see tinyChunkOwner */
+    inline int tinyOwnerOf(const void* ptr) const {
+        return tinyChunkOwner[tinyChunkOf(ptr)];
+    }
+
+    /** \a trackHeapBlocks makes the destructor release blocks that are still in use, 
+        at the cost of 16 bytes per small, medium and large block. Unless \a synchronized,
+        the pool takes no lock and must only be used by one thread. */
+    explicit BufferPool(bool trackHeapBlocks = false, bool synchronized = true) 
+        : trackHeapBlocks(trackHeapBlocks), heapBlocks(nullptr), isSynchronized(synchronized) {
+#       ifdef G3D_DEBUG
+            ownerThread = std::thread::id();
+#       endif
+
+        totalMallocs         = 0;
+
+        mallocsFromTinyPool  = 0;
+        mallocsFromSmallPool = 0;
+        mallocsFromMedPool   = 0;
+        mallocsFromBuddyHeap = 0;
+
+        remoteFrees          = 0;
+
+        bytesAllocated       = 0;
+
+        for (int c = 0; c < numTinyClasses; ++c) {
+            TinyClass& tc = tinyClass[c];
+            tc.freeList              = nullptr;
+            tc.freeCount             = 0;
+            tc.carve                 = nullptr;
+            tc.carveEnd              = nullptr;
+            tc.chunks                = 0;
+            tc.carved                = 0;
+            tc.buffersInThreadCaches = 0;
+        }
+        tinyPoolSize         = 0;
+        tinyHeap             = nullptr;
+        tinyHeapMapped       = 0;
+        tinyHeapUnavailable  = false;
+        tinyHeapPages        = Stats::REGULAR_PAGE_MODE;
+        tinyChunksCarved     = 0;
+        tinyDecommittedCount = 0;
+
+        trimEpoch            = 0;
+        bytesTrimmed         = 0;
+
+        smallPoolSize        = 0;
+
+        medPoolSize          = 0;
+
+        for (int bin = 0; bin < numAllBins; ++bin) {
+            binHead[bin] = nullptr;
+            binTail[bin] = nullptr;
+            binSize[bin] = 0;
+        }
+        binMask              = 0;
+
+        binClock             = 0;
+
+        maxSmallBuffers     = defaultMaxSmallBuffers;
+        maxMedBuffers       = defaultMaxMedBuffers;
+
+        smallPoolPurgeCount = 0;
+        medPoolPurgeCount   = 0;
+        smallPoolEvictions  = 0;
+        medPoolEvictions    = 0;
+
+        tinyBuffersInThreadCaches  = 0;
+        smallBuffersInThreadCaches = 0;
+        medBuffersInThreadCaches   = 0;
+
+        extentCacheCount     = 0;
+        extentBytesMapped    = 0;
+        extentBytesCached    = 0;
+        extentCacheHits      = 0;
+        extentRemaps         = 0;
+
+        for (int k = 0; k < numBuddyOrders; ++k) {
+            buddyFreeList[k]  = nullptr;
+            buddyFreeCount[k] = 0;
+        }
+        buddyHeap             = nullptr;
+        buddyHeapUnavailable  = false;
+        buddyChunksCarved     = 0;
+        buddyDecommittedCount = 0;
+        buddyBytesInUse       = 0;
+        buddyBytesRequested   = 0;
+        buddySplits           = 0;
+        buddyMerges           = 0;
+
+        // The tiny and buddy heaps are reserved on first use (see reserveTinyHeapAddressSpace),
+        // so that every PoolHeap does not take 320 MB of address space up front. The buddy 
+        // heap's unit states are cleared then as well.
+
+#       ifdef OBFUSCATE_FREELIST
+            // Any value that differs between runs and pools will do
+            tinyLinkKey = ((uintptr_t)this * 0x9E3779B97F4A7C15ull) ^ (uintptr_t)&tinyLinkKey ^ (uintptr_t)time(nullptr);
+#       endif
+    }
+
+
+    ~BufferPool() {
+        if (tinyHeap != nullptr) {
+            releaseAddressSpace(tinyHeap, tinyHeapMapped);
+        }
+        if (buddyHeap != nullptr) {
+            releaseAddressSpace(buddyHeap, buddyHeapSize);
+        }
+        flushBins(0, numAllBins);
+        while (extentCacheCount > 0) {
+            const Extent extent = uncacheExtent(extentCacheCount - 1);
+            releaseAddressSpace(extent.start, extent.length);
+        }
+
+        // Blocks still in use
+        while (heapBlocks != nullptr) {
+            HeapBlock* block = heapBlocks;
+            heapBlocks = block->next;
+            ::free(heapBlockBase(REALPTR_TO_USERPTR(block + 1)));
+        }
+    }
+
+    
+    UserPtr realloc(UserPtr ptr, size_t bytes) {
+        if (ptr == nullptr) {
+            return malloc(bytes);
+        }
+
+        if (inTinyHeap(ptr)) {
+            const size_t tinySize = tinyClassBytes(tinyClassOf(ptr));
+            if (bytes <= tinySize) {
+                // The old pointer actually had enough space.
+                return ptr;
+            } else {
+                // Free the old pointer and malloc
+                
+                UserPtr newPtr = malloc(bytes);
+                SystemAlloc::memcpy(newPtr, ptr, tinySize);
+                free(ptr);
+                return newPtr;
+
+            }
+        } else {
+            // In one of our heaps.
+
+            // See how big the block really was
+            size_t userSize = userSizeOf(ptr);
+            if (bytes <= userSize) {
+                // The old block was big enough.
+                return ptr;
+            }
+
+            if (inBuddyHeap(ptr)) {
+                if (buddyExpand(ptr, bytes)) {
+                    return ptr;
+                }
+            } else if (isExtentBlock(userSize, HEADER_BINS) && ! hasCachedExtentFor(bytes, HEADER_BINS)) {
+                // Copying into a cached extent whose pages are backed beats faulting in new ones
+                UserPtr grown = remapExtent(ptr, HEADER_BINS, userSize, bytes);
+                if (grown != nullptr) {
+                    return grown;
+                }
+            }
+
+            // Need to reallocate and move
+            UserPtr newPtr = malloc(bytes);
+            SystemAlloc::memcpy(newPtr, ptr, userSize);
+            free(ptr);
+            return newPtr;
+        }
+    }
+
+
+    /** Grows the extent of the block \a ptr of \a oldBytes and \a kind to hold \a bytes, 
+        moving its pages instead of copying them if it cannot grow in place. Returns nullptr 
+        where mremap is not available or fails. */
+    UserPtr remapExtent(UserPtr ptr, int kind, size_t oldBytes, size_t bytes) {
+#       if defined(G3D_LINUX) && defined(MREMAP_MAYMOVE)
+            const size_t oldLength = extentLength(oldBytes, kind);
+            const size_t length    = extentLength(bytes, kind);
+            RealPtr oldStart = (kind == HEADER_BINS) ? USERPTR_TO_REALPTR(ptr) : ptr;
+            void* start = mremap(oldStart, oldLength, length, MREMAP_MAYMOVE);
+            if (start == MAP_FAILED) {
+                return nullptr;
+            }
+
+            // Both blocks were counted with the whole extent
+            lock();
+            bytesInUse[Stats::LARGE_BLOCKS] += length - oldLength;
+            bytesAllocated    += length - oldLength;
+            extentBytesMapped += length - oldLength;
+            ++extentRemaps;
+            unlock();
+
+            if (kind != HEADER_BINS) {
+                return start;
+            }
+            ((size_t*)start)[0] = extentUserBytes(length, HEADER_BINS);
+            return REALPTR_TO_USERPTR(start);
+#       else
+            (void)ptr;
+            (void)kind;
+            (void)oldBytes;
+            (void)bytes;
+            return nullptr;
+#       endif
+    }
+
+
+    /** Bytes that the block \a ptr of mallocSized(\a bytes, \a alignment) can hold, see 
+        SystemAlloc::usableSize. Does not require the lock. */
+    size_t usableSizeSized(UserPtr ptr, size_t bytes, size_t alignment) const {
+        bytes = alignedRequestBytes(bytes, alignment);
+        if ((bytes <= tinyBufferSize) && inTinyHeap(ptr)) {
+            return tinyClassBytes(tinyClassIndex(bytes));
+        } else if (inBuddyHeap(ptr)) {
+            return userSizeOf(ptr);
+        } else if (alignment > maxBinAlignment) {
+            return bytes;
+        }
+        return heapBlockBytes(bytes, sizedBinKind(alignment));
+    }
+
+
+    /** Grows the block \a ptr of mallocSized(\a oldBytes, \a alignment) to \a bytes by 
+        remapping its extent or merging its buddy block with the free ones that follow it. 
+        Returns nullptr if it has to be moved by copying instead, e.g. because it is neither,
+        or a cached extent can take it. Does not require the lock. */
+    UserPtr remapSized(UserPtr ptr, size_t oldBytes, size_t bytes, size_t alignment) {
+        if (inBuddyHeap(ptr)) {
+            // A shrunk block would be freed with a size that selects a bin
+            return ((bytes >= oldBytes) && buddyExpand(ptr, bytes)) ? ptr : nullptr;
+        }
+        const int kind = sizedBinKind(alignment);
+        oldBytes = alignedRequestBytes(oldBytes, alignment);
+        if ((bytes > oldBytes) && isExtentBlock(oldBytes, kind) && ! hasCachedExtentFor(bytes, kind)) {
+            return remapExtent(ptr, kind, oldBytes, bytes);
+        }
+        return nullptr;
+    }
+
+
+    /** Allocates a block of \a kind from the tiny pool or the bins. Returns nullptr if it 
+        has to come from the heap, after rounding \a bytes and \a alignment up to those of
+        the block to allocate. Newly carved tiny chunks go to \a owner. Requires the lock. */
+    UserPtr poolAllocate(size_t& bytes, int kind, size_t& alignment, int owner = noTinyOwner) {
+        if (bytes <= tinyBufferSize) {
+
+            UserPtr ptr = tinyMalloc(bytes, owner);
+
+            if (ptr) {
+                debugAssertM((intptr_t)ptr % 16 == 0, "BufferPool::tinyMalloc returned non-16 byte aligned memory");
+                ++mallocsFromTinyPool;
+                bytesInUse[Stats::TINY_POOL] += tinyClassBytes(tinyClassIndex(bytes));
+                return ptr;
+            }
+
+        } 
+        
+        // Failure to allocate a tiny buffer is allowed to flow
+        // through to a small buffer
+        if ((bytes <= medBufferSize) && (alignment <= maxBinAlignment)) {
+
+            const int bin = kind * numBins + binIndex(bytes);
+            UserPtr ptr = poolMalloc(bin);
+
+            if (ptr) {
+                debugAssertM((intptr_t)ptr % 16 == 0, "BufferPool::poolMalloc returned non-16 byte aligned memory");
+                if (bytes <= smallBufferSize) {
+                    ++mallocsFromSmallPool;
+                } else {
+                    ++mallocsFromMedPool;
+                }
+                // A block with header may be from a larger bin
+                const size_t blockBytes = (kind == HEADER_BINS) ? USERSIZE_FROM_USERPTR(ptr) : binBytes(bin);
+                bytesInUse[poolOfSize(blockBytes)] += blockBytes;
+                return ptr;
+            }
+
+            // Round up so that the block can be returned to its bin
+            bytes = binBytes(bin);
+            if (kind == ALIGNED_BINS) {
+                alignment = maxBinAlignment;
+            }
+        } else if ((bytes > medBufferSize) && (bytes <= maxBuddyBlockSize) && (alignment <= maxBuddyAlignment)) {
+
+            UserPtr ptr = buddyMalloc(bytes);
+
+            if (ptr) {
+                ++mallocsFromBuddyHeap;
+                return ptr;
+            }
+        }
+
+        // Failure to allocate a buddy block is allowed to flow through to the heap
+        if (isExtentBlock(bytes, kind)) {
+            // The rest of the extent's last page is part of the block
+            bytes = extentUserBytes(extentLength(bytes, kind), kind);
+        }
+        return nullptr;
+    }
+
+    /** Allocates a block of \a kind (see numAllBins) aligned to \a alignment. Blocks without 
+        header must be freed with freeSized. For ALIGNED_BINS, \a bytes must have been rounded 
+        by alignedRequestBytes. */
+    UserPtr allocate(size_t bytes, int kind, size_t alignment) {
+
+        lock();
+        ++totalMallocs;
+        ++mallocSizeHistogram[Stats::sizeBucket(bytes)];
+
+        UserPtr pooled = poolAllocate(bytes, kind, alignment);
+        if (pooled) {
+            unlock();
+            return pooled;
+        }
+
+        countHeapBlock(bytes, kind);
+        unlock();
+
+        return heapAllocate(bytes, kind, alignment);
+    }
+
+    /** Counts a block of \a bytes and \a kind that heapAllocate is about to allocate. 
+        Requires the lock. */
+    inline void countHeapBlock(size_t bytes, int kind) {
+        bytesAllocated += (kind == HEADER_BINS) ? USERSIZE_TO_REALSIZE(bytes) : bytes;
+        bytesInUse[poolOfSize(bytes)] += bytes;
+    }
+
+    /** Allocates a block of \a kind from the heap after countHeapBlock, which \a bytes and 
+        \a alignment have been rounded for by poolAllocate. Does not require the lock. */
+    UserPtr heapAllocate(size_t bytes, int kind, size_t alignment) {
+        const size_t realBytes = (kind == HEADER_BINS) ? USERSIZE_TO_REALSIZE(bytes) : bytes;
+
+        // With header, allocate 16 extra bytes for our size header (unfortunate,
+        // since malloc already added its own header).
+        RealPtr ptr = heapMalloc(kind, bytes, alignment);
+        if (ptr == nullptr) {
+#           ifdef G3D_WINDOWS
+                // Check for memory corruption
+                alwaysAssertM(_CrtCheckMemory() == TRUE, "Heap corruption detected.");
+#           endif
+
+            // Flush memory pools to try and recover space
+            lock();
+            flushBins(0, numAllBins);
+            unlock();
+            ptr = heapMalloc(kind, bytes, alignment);
+        }
+
+        if (ptr == nullptr) {
+            if ((SystemAlloc::outOfMemoryCallback() != nullptr) &&
+                (SystemAlloc::outOfMemoryCallback()(realBytes, true) == true)) {
+                // Re-attempt the malloc
+                ptr = heapMalloc(kind, bytes, alignment);
+                
+            }
+        }
+
+        if (ptr == nullptr) {
+            if (SystemAlloc::outOfMemoryCallback() != nullptr) {
+                // Notify the application
+                SystemAlloc::outOfMemoryCallback()(realBytes, false);
+            }
+#           ifdef G3D_DEBUG
+            debugPrintf("::malloc(%d) returned nullptr\n", (int)realBytes);
+#           endif
             debugAssertM(ptr != nullptr, 
                          "::malloc returned nullptr. Either the "
                          "operating SystemAlloc is out of memory or the "
                          "heap is corrupt.");
+
+            lock();
+            bytesAllocated -= realBytes;
+            bytesInUse[poolOfSize(bytes)] -= bytes;
+            unlock();
+            return nullptr;
+        }
+
+        if (kind != HEADER_BINS) {
+            debugAssertM((intptr_t)ptr % alignment == 0, "::malloc returned insufficiently aligned memory");
+            if (trackHeapBlocks) {
+                lock();
+                linkHeapBlock(ptr);
+                unlock();
+            }
+            return ptr;
+        }
+
+        ((size_t*)ptr)[0] = bytes;
+        debugAssertM((intptr_t)REALPTR_TO_USERPTR(ptr) % 16 == 0, "::malloc returned non-16 byte aligned memory");
+
+        if (trackHeapBlocks) {
+            lock();
+            linkHeapBlock(REALPTR_TO_USERPTR(ptr));
+            unlock();
+        }
+        return REALPTR_TO_USERPTR(ptr);
+    }
+
+
+    UserPtr malloc(size_t bytes) {
+        return allocate(bytes, HEADER_BINS, minAlignment);
+    }
+
+
+    /** See SystemAlloc::mallocSized */
+    UserPtr mallocSized(size_t bytes, size_t alignment = minAlignment) {
+        return allocate(alignedRequestBytes(bytes, alignment), sizedBinKind(alignment), alignment);
+    }
+
+
+    /** Returns a block allocated by malloc to the tiny pool, its bin or the buddy heap. Returns 
+        false if the block is too big to store; the caller must then release it with heapBlockFree. 
+        Requires the lock. */
+    bool release(UserPtr ptr) {
+        if (inTinyHeap(ptr)) {
+            bytesInUse[Stats::TINY_POOL] -= tinyClassBytes(tinyClassOf(ptr));
+            tinyFree(ptr);
+            return true;
+        }
+
+        if (inBuddyHeap(ptr)) {
+            buddyFree(ptr);
+            return true;
+        }
+
+        size_t bytes = USERSIZE_FROM_USERPTR(ptr);
+
+        bytesInUse[poolOfSize(bytes)] -= bytes;
+        if (bytes <= medBufferSize) {
+            const int bin = binIndex(bytes);
+            debugAssertM(binBytes(bin) == bytes, "SystemAlloc::free heap corruption detected: block size is not a bin size");
+            if (poolFree(bin, ptr)) {
+                return true;
+            }
+        }
+        bytesAllocated -= USERSIZE_TO_REALSIZE(bytes);
+        unlinkHeapBlock(ptr);
+        return false;
+    }
+
+    /** Like release, for a block allocated by mallocSized(\a bytes, \a alignment), which the caller 
+        must release with heapFree(sizedBinKind(\a alignment), ...) if this returns false. 
+        Requires the lock. */
+    bool releaseSized(UserPtr ptr, size_t bytes, size_t alignment) {
+        bytes = alignedRequestBytes(bytes, alignment);
+
+        if ((bytes <= tinyBufferSize) && inTinyHeap(ptr)) {
+            debugAssertM(tinyClassOf(ptr) == tinyClassIndex(bytes), "SystemAlloc::freeSized: wrong size");
+            bytesInUse[Stats::TINY_POOL] -= tinyClassBytes(tinyClassIndex(bytes));
+            tinyFree(ptr);
+            return true;
+        }
+
+        if (inBuddyHeap(ptr)) {
+            // The size of the block is kept by the buddy heap
+            buddyFree(ptr);
+            return true;
+        }
+
+        if ((bytes <= medBufferSize) && (alignment <= maxBinAlignment)) {
+            const int bin = sizedBinKind(alignment) * numBins + binIndex(bytes);
+            bytes = binBytes(bin);
+            bytesInUse[poolOfSize(bytes)] -= bytes;
+            if (poolFree(bin, ptr)) {
+                return true;
+            }
+        } else {
+            if (isExtentBlock(bytes, sizedBinKind(alignment))) {
+                bytes = extentUserBytes(extentLength(bytes, SIZED_BINS), SIZED_BINS);
+            }
+            bytesInUse[poolOfSize(bytes)] -= bytes;
+        }
+        bytesAllocated -= bytes;
+        unlinkHeapBlock(ptr);
+        return false;
+    }
+
+    void free(UserPtr ptr) {
+        if (ptr == nullptr) {
+            // Free does nothing on null pointers
+            return;
+        }
+
+        assert(isValidPointer(ptr));
+
+        lock();
+        const bool pooled = release(ptr);
+        unlock();
+
+        if (! pooled) {
+            // Free; the buffer pools are full or this is too big to store.
+            heapBlockFree(ptr);
+        }
+    }
+
+    /** Frees a block allocated by mallocSized(\a bytes, \a alignment) */
+    void freeSized(UserPtr ptr, size_t bytes, size_t alignment = minAlignment) {
+        if (ptr == nullptr) {
+            return;
+        }
+
+        lock();
+        const bool pooled = releaseSized(ptr, bytes, alignment);
+        unlock();
+
+        if (! pooled) {
+            heapFree(sizedBinKind(alignment), ptr, alignedRequestBytes(bytes, alignment));
+        }
+    }
+
+    /** See SystemAlloc::mallocNode. A newly carved tiny chunk goes to \a owner. */
+    UserPtr mallocNode(size_t bytes, int owner = noTinyOwner) {
+        if (bytes <= tinyBufferSize) {
+            const int c = nodeClassIndex(bytes);
+
+            lock();
+            UserPtr ptr = tinyMallocClass(c, owner);
+            if (ptr) {
+                ++totalMallocs;
+                ++mallocSizeHistogram[Stats::sizeBucket(bytes)];
+                ++mallocsFromTinyPool;
+                bytesInUse[Stats::TINY_POOL] += tinyClassBytes(c);
+                unlock();
+                return ptr;
+            }
+            unlock();
+        }
+
+        // Too big for a node class, or the tiny heap is exhausted
+        return mallocSized(bytes);
+    }
+
+    /** Frees a block allocated by mallocNode(\a bytes) */
+    void freeNode(UserPtr ptr, size_t bytes) {
+        if ((ptr != nullptr) && inTinyHeap(ptr)) {
+            // Tiny buffers are released by the class of their chunk
+            lock();
+            release(ptr);
+            unlock();
+            return;
+        }
+        freeSized(ptr, bytes);
+    }
+
+    /** Allocates blocks of \a sizes[i] bytes into the entries of \a out that are nullptr, 
+        taking the lock once. \a sized: the blocks have no header, see mallocSized. Entries 
+        of \a out remain nullptr where the allocation failed. */
+    void allocateMany(const size_t* sizes, size_t count, UserPtr* out, bool sized, int owner = noTinyOwner) {
+        debugAssertM(! trackHeapBlocks, "BufferPool::allocateMany does not track heap blocks");
+        const int kind = sized ? SIZED_BINS : HEADER_BINS;
+
+        // Marks the entries that go to the heap, which is called outside of the lock
+        UserPtr const fromHeap = (UserPtr)&heapBlocks;
+        size_t heapCount = 0;
+
+        lock();
+        for (size_t i = 0; i < count; ++i) {
+            if (out[i] != nullptr) {
+                continue;
+            }
+            size_t bytes     = sizes[i];
+            size_t alignment = minAlignment;
+            ++totalMallocs;
+            ++mallocSizeHistogram[Stats::sizeBucket(bytes)];
+            out[i] = poolAllocate(bytes, kind, alignment, owner);
+            if (out[i] == nullptr) {
+                countHeapBlock(bytes, kind);
+                out[i] = fromHeap;
+                ++heapCount;
+            }
+        }
+        unlock();
+
+        // Large blocks and blocks the pools ran out of, rounded as by poolAllocate
+        for (size_t i = 0; (i < count) && (heapCount > 0); ++i) {
+            if (out[i] == fromHeap) {
+                out[i] = heapAllocate(heapBlockBytes(sizes[i], kind), kind, minAlignment);
+                --heapCount;
+            }
+        }
+    }
+
+    /** Frees \a count blocks, taking the lock once. \a sizes is nullptr for blocks from 
+        malloc, or holds the sizes passed to mallocSized. Null entries are skipped. 
+        Overwrites the contents of \a ptrs. */
+    void releaseMany(UserPtr* ptrs, size_t count, const size_t* sizes) {
+        // Clear the pooled blocks, so that the rest is released to the heap 
+        // outside of the lock
+        size_t overflowSize = 0;
+
+        lock();
+        for (size_t i = 0; i < count; ++i) {
+            UserPtr ptr = ptrs[i];
+            if (ptr == nullptr) {
+                continue;
+            }
+            assert((sizes != nullptr) || isValidPointer(ptr));
+            if ((sizes != nullptr) ? releaseSized(ptr, sizes[i], minAlignment) : release(ptr)) {
+                ptrs[i] = nullptr;
+            } else {
+                ++overflowSize;
+            }
+        }
+        unlock();
+
+        for (size_t i = 0; (i < count) && (overflowSize > 0); ++i) {
+            if (ptrs[i] != nullptr) {
+                heapFree((sizes != nullptr) ? SIZED_BINS : HEADER_BINS, ptrs[i], (sizes != nullptr) ? sizes[i] : 0);
+                --overflowSize;
+            }
+        }
+    }
+
+    /** Moves up to \a count free blocks of \a sizeClass (see numSizeClasses) into \a out
+        under a single lock acquisition and folds \a counters into the shared counters.
+        Newly carved tiny chunks go to \a owner. Returns the number of blocks moved. */
+    int mallocBatch(int sizeClass, UserPtr* out, int count, Counters& counters, int owner = noTinyOwner) {
+        lock();
+        addCounters(counters);
+
+        int n = 0;
+        if (isTinyClass(sizeClass)) {
+            while (n < count) {
+                UserPtr ptr = tinyMallocClass(sizeClass, owner);
+                if (ptr == nullptr) {
+                    break;
+                }
+                out[n] = ptr;
+                ++n;
+            }
+            tinyClass[sizeClass].buffersInThreadCaches += n;
+            tinyBuffersInThreadCaches                  += n;
+        } else {
+            const int bin = sizeClass - numTinyClasses;
+            while ((n < count) && (binHead[bin] != nullptr)) {
+                out[n] = binPop(bin);
+                ++n;
+            }
+            if (isSmallBin(bin)) {
+                smallBuffersInThreadCaches += n;
+            } else {
+                medBuffersInThreadCaches += n;
+            }
+        }
+        unlock();
+
+        return n;
+    }
+
+    /** Returns \a count free blocks of \a sizeClass to the pool under a single lock 
+        acquisition. Blocks that do not fit into the pool are released to the heap. 
+        Overwrites the contents of \a ptrs. */
+    void freeBatch(int sizeClass, UserPtr* ptrs, int count, Counters& counters) {
+        if (isTinyClass(sizeClass)) {
+            lock();
+            addCounters(counters);
+            for (int i = 0; i < count; ++i) {
+                tinyFree(ptrs[i]);
+            }
+            tinyClass[sizeClass].buffersInThreadCaches -= count;
+            tinyBuffersInThreadCaches                  -= count;
+            unlock();
+            return;
+        }
+
+        const int bin = sizeClass - numTinyClasses;
+
+        // Compact the overflow to the front of ptrs so that ::free is called 
+        // outside of the lock, as in BufferPool::free
+        int overflowSize = 0;
+
+        lock();
+        addCounters(counters);
+        for (int i = 0; i < count; ++i) {
+            if (! poolFree(bin, ptrs[i])) {
+                unlinkHeapBlock(ptrs[i]);
+                ptrs[overflowSize] = ptrs[i];
+                ++overflowSize;
+            }
+        }
+        if (isSmallBin(bin)) {
+            smallBuffersInThreadCaches -= count;
+        } else {
+            medBuffersInThreadCaches -= count;
+        }
+        bytesAllocated -= binRealBytes(bin) * overflowSize;
+        unlock();
+
+        for (int i = 0; i < overflowSize; ++i) {
+            binBlockFree(bin, ptrs[i]);
+        }
+    }
+
+    /** Sets maxSmallBuffers and maxMedBuffers, unless 0, see SystemAlloc::setPoolLimits. 
+        A pool above its new limit shrinks as blocks are freed into it. */
+    void setPoolLimits(size_t smallBlocks, size_t medBlocks) {
+        lock();
+        if (smallBlocks > 0) {
+            maxSmallBuffers = (int64)max(smallBlocks, (size_t)evictionFraction);
+        }
+        if (medBlocks > 0) {
+            maxMedBuffers = (int64)max(medBlocks, (size_t)evictionFraction);
+        }
+        unlock();
+    }
+
+    /** Commits the chunks of the tiny heap that the next \a bytes of tiny buffers will be 
+        carved from, and touches their pages if \a prefault. Returns the bytes committed. */
+    size_t reserveTinyHeap(size_t bytes, bool prefault) {
+        // Under the lock, since chunks are carved under it
+        lock();
+        if (! reserveTinyHeapAddressSpace()) {
+            unlock();
+            return 0;
+        }
+
+        // In the order carveTinyBuffer takes them: the chunks that trim decommitted, 
+        // from the end of tinyDecommitted, then the ones never carved
+        size_t chunks    = (bytes + tinyChunkSize - 1) / tinyChunkSize;
+        size_t committed = 0;
+        for (int64 i = int64(tinyDecommittedCount) - 1; (i >= 0) && (chunks > 0); --i, --chunks) {
+            committed += commitTinyChunk(tinyDecommitted[i], prefault);
+        }
+        for (size_t index = (size_t)int64(tinyChunksCarved); (index < maxTinyChunks) && (chunks > 0); ++index, --chunks) {
+            committed += commitTinyChunk(index, prefault);
+        }
+        unlock();
+
+        return committed;
+    }
+
+    /** Commits chunk \a index of the tiny heap for reserveTinyHeap. Returns the bytes committed. 
+        Requires the lock. */
+    size_t commitTinyChunk(size_t index, bool prefault) {
+        uint8* chunk = (uint8*)tinyHeap + index * tinyChunkSize;
+        if (! commitAddressSpace(chunk, tinyChunkSize)) {
+            return 0;
+        }
+        if (prefault) {
+            prefaultPages(chunk, tinyChunkSize);
+        }
+        return tinyChunkSize;
+    }
+
+    /** Adds up to \a count new blocks from the heap to \a bin, as far as its pool has room. 
+        Touches their pages if \a prefault. Returns the number of blocks added. */
+    size_t reserveBin(int bin, size_t count, bool prefault) {
+        size_t       bytes     = binBytes(bin);
+        const size_t alignment = (binKind(bin) == ALIGNED_BINS) ? maxBinAlignment : minAlignment;
+
+        lock();
+        const int64 room = (isSmallBin(bin) ? maxSmallBuffers : maxMedBuffers) - poolSizeOfBin(bin);
+        unlock();
+        if ((int64)count > room) {
+            count = (room > 0) ? (size_t)room : 0;
+        }
+
+        // Allocate outside of the lock
+        FreeBlock* list = nullptr;
+        for (size_t i = 0; i < count; ++i) {
+            RealPtr ptr = heapMalloc(binKind(bin), bytes, alignment);
+            if (ptr == nullptr) {
+                break;
+            }
+            if (prefault) {
+                prefaultPages(ptr, binRealBytes(bin));
+            }
+            FreeBlock* block = (FreeBlock*)ptr;
+            if (binKind(bin) == HEADER_BINS) {
+                ((size_t*)ptr)[0] = bytes;
+                block = (FreeBlock*)REALPTR_TO_USERPTR(ptr);
+            }
+            block->next = list;
+            list = block;
+        }
+
+        size_t added = 0;
+        lock();
+        while (list != nullptr) {
+            FreeBlock* next = list->next;
+            if (! poolFree(bin, list, false)) {
+                // Other threads have filled the pool in the meantime
+                break;
+            }
+            if (trackHeapBlocks) {
+                linkHeapBlock(list);
+            }
+            bytesAllocated += binRealBytes(bin);
+            ++added;
+            list = next;
+        }
+        unlock();
+
+        freeBlockList(bin, list);
+        return added;
+    }
+
+    /** Unmaps cached extents, returns free small and medium blocks to the heap and decommits 
+        free chunks of the tiny heap until at most \a targetBytes are held in free blocks, releasing only 
+        blocks and chunks that have been free for at least \a minIdleEpochs scavenge() 
+        calls. The largest blocks are released first, and the oldest blocks of each bin. 
+        Returns the bytes released. */
+    size_t trim(size_t targetBytes, uint32 minIdleEpochs = 0) {
+        FreeBlock* detached[numAllBins];
+        Extent     unmapped[extentCacheSize];
+        int        unmappedCount = 0;
+        size_t trimmed = 0;
+
+        lock();
+        size_t held = (size_t)int64(extentBytesCached);
+        for (int bin = 0; bin < numAllBins; ++bin) {
+            held += (size_t)int64(binSize[bin]) * binBytes(bin);
+        }
+        for (int c = 0; c < numTinyClasses; ++c) {
+            held += (size_t)int64(tinyClass[c].freeCount) * tinyClassBytes(c);
+        }
+        // Only wholly free chunks of the buddy heap can be released
+        held += (size_t)int64(buddyFreeCount[numBuddyOrders - 1]) * buddyChunkSize;
+
+        // Cached extents first, oldest first
+        for (int i = 0; (i < extentCacheCount) && (held > targetBytes); ) {
+            if (trimEpoch - extentCache[i].freeEpoch >= minIdleEpochs) {
+                unmapped[unmappedCount] = uncacheExtent(i);
+                extentBytesMapped -= unmapped[unmappedCount].length;
+                held    -= unmapped[unmappedCount].length;
+                trimmed += unmapped[unmappedCount].length;
+                ++unmappedCount;
+            } else {
+                ++i;
+            }
+        }
+
+        if (held > targetBytes) {
+            const size_t released = releaseBuddyChunks(held - targetBytes, minIdleEpochs);
+            held    -= released;
+            trimmed += released;
+        }
+
+        // Largest blocks first, of all kinds
+        for (int i = numAllBins - 1; i >= 0; --i) {
+            const int bin = (i % numBinKinds) * numBins + i / numBinKinds;
+            detached[bin] = nullptr;
+            if (held > targetBytes) {
+                const int64 excess = (int64)((held - targetBytes + binBytes(bin) - 1) / binBytes(bin));
+                int64 count = 0;
+                detached[bin] = binDetachOld(bin, binSize[bin] - excess, minIdleEpochs, count);
+                held    -= (size_t)count * binBytes(bin);
+                trimmed += (size_t)count * binRealBytes(bin);
+            }
+        }
+
+        if (held > targetBytes) {
+            trimmed += releaseTinyChunks(held - targetBytes, minIdleEpochs);
+        }
+        bytesTrimmed += trimmed;
+        unlock();
+
+        for (int bin = 0; bin < numAllBins; ++bin) {
+            freeBlockList(bin, detached[bin]);
+        }
+        for (int i = 0; i < unmappedCount; ++i) {
+            releaseAddressSpace(unmapped[i].start, unmapped[i].length);
+        }
+
+#       ifdef __GLIBC__
+            // Have the C library return the freed blocks to the OS
+            if (trimmed > 0) {
+                malloc_trim(0);
+            }
+#       endif
+
+        return trimmed;
+    }
+
+    /** Starts a new epoch and releases what has been free for more than \a maxIdleEpochs 
+        full epochs. See SystemAlloc::startScavenger. */
+    size_t scavenge(uint32 maxIdleEpochs) {
+        lock();
+        ++trimEpoch;
+        unlock();
+        return trim(0, maxIdleEpochs + 1);
+    }
+
+    /** Folds counters gathered by a ThreadCache into the shared ones. */
+    void flushCounters(Counters& counters) {
+        lock();
+        addCounters(counters);
+        unlock();
+    }
+
+    static inline uint64 nonNegative(int64 count) {
+        return (count < 0) ? 0 : (uint64)count;
+    }
+
+    /** Reads the counters without taking the lock, see SystemAlloc::mallocStats */
+    void getStats(Stats& stats) const {
+        stats.totalMallocs         = totalMallocs;
+        stats.mallocsFromTinyPool  = mallocsFromTinyPool;
+        stats.mallocsFromSmallPool = mallocsFromSmallPool;
+        stats.mallocsFromMedPool   = mallocsFromMedPool;
+        stats.mallocsFromBuddyHeap = mallocsFromBuddyHeap;
+
+        for (int p = 0; p < Stats::numPools; ++p) {
+            stats.bytesInUse[p] = nonNegative(bytesInUse[p]);
+        }
+
+        stats.buffersFree[Stats::TINY_POOL]             = nonNegative(tinyPoolSize);
+        stats.buffersFree[Stats::SMALL_POOL]            = nonNegative(smallPoolSize);
+        stats.buffersFree[Stats::MED_POOL]              = nonNegative(medPoolSize);
+        stats.buffersFree[Stats::LARGE_BLOCKS]          = 0;
+
+        stats.buffersInThreadCaches[Stats::TINY_POOL]    = nonNegative(tinyBuffersInThreadCaches);
+        stats.buffersInThreadCaches[Stats::SMALL_POOL]   = nonNegative(smallBuffersInThreadCaches);
+        stats.buffersInThreadCaches[Stats::MED_POOL]     = nonNegative(medBuffersInThreadCaches);
+        stats.buffersInThreadCaches[Stats::LARGE_BLOCKS] = 0;
+        stats.remoteFrees                                = remoteFrees;
+
+        for (int c = 0; c < numTinyClasses; ++c) {
+            const TinyClass& tc = tinyClass[c];
+            stats.tinyClassBuffersInUse[c] = nonNegative(tc.carved - tc.freeCount - tc.buffersInThreadCaches);
+            stats.tinyClassBuffersFree[c]  = nonNegative(tc.freeCount);
+            stats.tinyClassChunks[c]       = nonNegative(tc.chunks);
+        }
+
+        for (int bin = 0; bin < numBins; ++bin) {
+            int64 free = 0;
+            for (int kind = 0; kind < numBinKinds; ++kind) {
+                free += binSize[kind * numBins + bin];
+            }
+            stats.binBuffersFree[bin] = nonNegative(free);
+        }
+
+        stats.tinyHeapBytesCarved   = (uint64)int64(tinyChunksCarved) * tinyChunkSize;
+        stats.tinyHeapBytesReserved = (tinyHeap != nullptr) ? tinyHeapSize : 0;
+        stats.tinyHeapPages         = (Stats::PageMode)int(tinyHeapPages);
+        stats.tinyHeapBytesDecommitted = (uint64)int64(tinyDecommittedCount) * tinyChunkSize;
+        stats.bytesTrimmed          = bytesTrimmed;
+        stats.extentBytesMapped     = nonNegative(extentBytesMapped);
+        stats.extentBytesCached     = nonNegative(extentBytesCached);
+        stats.extentCacheHits       = extentCacheHits;
+        stats.extentRemaps          = extentRemaps;
+
+        const int64 buddyCommitted  = (buddyChunksCarved - buddyDecommittedCount) * (int64)buddyChunkSize;
+        stats.buddyBytesInUse       = nonNegative(buddyBytesInUse);
+        stats.buddyBytesRequested   = nonNegative(buddyBytesRequested);
+        stats.buddyBytesCommitted   = nonNegative(buddyCommitted);
+        stats.buddyBytesFree        = nonNegative(buddyCommitted - buddyBytesInUse);
+        stats.buddyLargestFreeBlock = 0;
+        for (int k = 0; k < numBuddyOrders; ++k) {
+            stats.buddyBlocksFree[k] = nonNegative(buddyFreeCount[k]);
+            if (stats.buddyBlocksFree[k] > 0) {
+                stats.buddyLargestFreeBlock = buddyBlockBytes(k);
+            }
+        }
+        stats.buddySplits           = buddySplits;
+        stats.buddyMerges           = buddyMerges;
+
+        const Spinlock::Stats lockStats = m_lock.stats();
+        stats.lockAcquisitions      = lockStats.acquisitions;
+        stats.lockContended         = lockStats.contended;
+        stats.lockParked            = lockStats.parked;
+        stats.lockWaitNanoseconds   = lockStats.waitNanoseconds;
+
+        stats.maxSmallBuffers       = maxSmallBuffers;
+        stats.maxMedBuffers         = maxMedBuffers;
+        stats.smallPoolPurges       = smallPoolPurgeCount;
+        stats.medPoolPurges         = medPoolPurgeCount;
+        stats.smallPoolEvictions    = smallPoolEvictions;
+        stats.medPoolEvictions      = medPoolEvictions;
+        stats.heapBytesAllocated    = bytesAllocated;
+
+        for (int b = 0; b < Stats::numSizeBuckets; ++b) {
+            stats.mallocSizeHistogram[b] = mallocSizeHistogram[b];
+        }
+    }
+
+    void resetCounters() {
+        lock();
+        totalMallocs         = 0;
+        mallocsFromMedPool   = 0;
+        mallocsFromSmallPool = 0;
+        mallocsFromTinyPool  = 0;
+        mallocsFromBuddyHeap = 0;
+        remoteFrees          = 0;
+        for (int b = 0; b < Stats::numSizeBuckets; ++b) {
+            mallocSizeHistogram[b] = 0;
+        }
+        unlock();
+    }
+
+    String status() const {
+        Stats stats;
+        getStats(stats);
+        return SystemAlloc::formatMallocStats(stats);
+    }
+};
+
+// Dynamically allocated because we need to ensure that
+// the buffer pool is still around when the last global variable 
+// is deallocated.
+static BufferPool* bufferpool = nullptr;
+
+
+#ifndef NO_THREAD_CACHE
+/** Set once the calling thread's ThreadCache has been destroyed */
+static thread_local bool threadCacheDestroyed = false;
+
+#ifndef NO_REMOTE_FREE
+/**
+ Tiny buffers freed by other threads than the owner of their chunk (see 
+ BufferPool::tinyChunkOwner), one stack per tiny class. Other threads push 
+ buffers without taking a lock; the owner takes a whole stack at once when 
+ its magazine of that class runs empty. As buffers are only ever removed 
+ by taking the whole stack, the stack needs no ABA protection.
+*/
+class RemoteFreeQueue {
+public:
+    /** Link stored in the first bytes of a queued buffer */
+    class Block {
+    public:
+        Block*  next;
+    };
+
+    std::atomic<Block*>     head[BufferPool::numTinyClasses];
+
+    /** Set while a ThreadCache owns the queue */
+    std::atomic<bool>       taken;
+
+    /** Value of head while the queue has no owner. Pushing fails, so the buffer 
+        stays with the freeing thread. */
+    static Block* closed() {
+        static Block sentinel;
+        return &sentinel;
+    }
+
+    /** Returns false if the queue is closed */
+    inline bool push(int c, void* ptr) {
+        Block* block = (Block*)ptr;
+        Block* first = head[c].load(std::memory_order_relaxed);
+        do {
+            if (first == closed()) {
+                return false;
+            }
+            block->next = first;
+        } while (! head[c].compare_exchange_weak(first, block, std::memory_order_release, std::memory_order_relaxed));
+        return true;
+    }
+
+    /** Takes all buffers of class \a c, unless the queue is closed */
+    inline Block* takeAll(int c) {
+        Block* first = head[c].load(std::memory_order_relaxed);
+        while ((first != nullptr) && (first != closed())) {
+            if (head[c].compare_exchange_weak(first, nullptr, std::memory_order_acquire, std::memory_order_relaxed)) {
+                return first;
+            }
+        }
+        return nullptr;
+    }
+};
+
+/** Indexed by owner; the entry for BufferPool::noTinyOwner is unused */
+static RemoteFreeQueue remoteFreeQueues[BufferPool::maxTinyOwners + 1];
+#endif
+
+/**
+ Per-thread cache of free blocks ("magazines") in front of the shared BufferPool.
+
+ Allocating and freeing on the same thread is served from the magazine of the 
+ block's size class (the tiny pool or one of the bins) without taking the 
+ BufferPool lock. Empty magazines are refilled and full magazines are flushed
+ in batches, so the lock is taken once per batchSize operations. The cache is 
+ drained back into the BufferPool when the thread exits.
+
+ Unless NO_REMOTE_FREE is defined, each ThreadCache also owns the tiny chunks 
+ it carves. A tiny buffer freed by another thread is pushed onto the owner's 
+ RemoteFreeQueue instead of that thread's magazine, so that a producer thread
+ gets back the buffers that a consumer thread frees without either of them 
+ taking the BufferPool lock.
+*/
+class ThreadCache {
+public:
+    enum {magazineSize = 64, batchSize = magazineSize / 2};
+
+private:
+    typedef BufferPool::UserPtr  UserPtr;
+
+    class Magazine {
+    public:
+        UserPtr     ptr[magazineSize];
+        int         size;
+
+        inline Magazine() : size(0) {}
+    };
+
+    Magazine                m_magazine[BufferPool::numSizeClasses];
+
+    /** Allocations served by this thread, not yet folded into the BufferPool's counters */
+    BufferPool::Counters    m_counters;
+
+    /** Index of this cache's RemoteFreeQueue, or BufferPool::noTinyOwner */
+    int                     m_owner;
+
+#ifndef NO_REMOTE_FREE
+    /** Buffers taken from this cache's RemoteFreeQueue that did not fit into the magazine */
+    RemoteFreeQueue::Block* m_reclaimed[BufferPool::numTinyClasses];
+
+    /** Claims a free RemoteFreeQueue. Returns BufferPool::noTinyOwner if there is none. */
+    static int acquireOwner() {
+        for (int owner = 1; owner <= BufferPool::maxTinyOwners; ++owner) {
+            RemoteFreeQueue& queue = remoteFreeQueues[owner];
+            bool expected = false;
+            if (! queue.taken.load(std::memory_order_relaxed) && 
+                queue.taken.compare_exchange_strong(expected, true, std::memory_order_acquire)) {
+                for (int c = 0; c < BufferPool::numTinyClasses; ++c) {
+                    queue.head[c].store(nullptr, std::memory_order_release);
+                }
+                return owner;
+            }
+        }
+        return BufferPool::noTinyOwner;
+    }
+
+    /** Closes this cache's RemoteFreeQueue and moves the buffers queued on it into the magazines */
+    void releaseOwner() {
+        if (m_owner == BufferPool::noTinyOwner) {
+            return;
+        }
+        RemoteFreeQueue& queue = remoteFreeQueues[m_owner];
+        for (int c = 0; c < BufferPool::numTinyClasses; ++c) {
+            RemoteFreeQueue::Block* block = queue.head[c].exchange(RemoteFreeQueue::closed(), std::memory_order_acquire);
+            stashChain(c, block);
+        }
+        queue.taken.store(false, std::memory_order_release);
+        m_owner = BufferPool::noTinyOwner;
+    }
+
+    /** Moves a chain of queued buffers of tiny class \a c into its magazine, which they 
+        have already been counted for (see countCached) */
+    void stashChain(int c, RemoteFreeQueue::Block* block) {
+        while (block != nullptr) {
+            RemoteFreeQueue::Block* next = block->next;
+            stash(c, block);
+            block = next;
+        }
+    }
+
+    /** Refills the empty magazine of tiny class \a c from the buffers freed by other 
+        threads. Returns the number of buffers. */
+    int reclaim(int c) {
+        RemoteFreeQueue::Block* block = m_reclaimed[c];
+        if (block == nullptr) {
+            block = remoteFreeQueues[m_owner].takeAll(c);
+        }
+
+        Magazine& mag = m_magazine[c];
+        while ((block != nullptr) && (mag.size < magazineSize)) {
+            mag.ptr[mag.size] = block;
+            ++mag.size;
+            block = block->next;
+        }
+        m_reclaimed[c] = block;
+        return mag.size;
+    }
+
+    /** Hands a tiny buffer of class \a c owned by another thread to that thread. 
+        Returns false if the buffer is this thread's own or its owner has exited. */
+    inline bool remoteFree(int c, UserPtr ptr) {
+        const int owner = bufferpool->tinyOwnerOf(ptr);
+        if ((owner == m_owner) || (owner == BufferPool::noTinyOwner) || ! remoteFreeQueues[owner].push(c, ptr)) {
+            return false;
+        }
+        countCached(c, +1);
+        ++m_counters.remoteFrees;
+        return true;
+    }
+#endif
+
+    /** Flushes the oldest half of the magazine back to the BufferPool */
+    void flush(int sizeClass) {
+        Magazine& mag = m_magazine[sizeClass];
+        const int n = std::min<int>(batchSize, mag.size);
+
+        bufferpool->freeBatch(sizeClass, mag.ptr, n, m_counters);
+
+        // Keep the most recently freed (i.e., hottest) blocks
+        mag.size -= n;
+        for (int i = 0; i < mag.size; ++i) {
+            mag.ptr[i] = mag.ptr[i + n];
+        }
+    }
+
+    /** A block moves between the application and the magazine of \a sizeClass */
+    inline void countCached(int sizeClass, int delta) {
+        const int bin = sizeClass - BufferPool::numTinyClasses;
+        if (BufferPool::isTinyClass(sizeClass)) {
+            m_counters.tinyBuffersCached[sizeClass] += delta;
+            m_counters.bytesInUse[BufferPool::Stats::TINY_POOL] -= delta * (int64)BufferPool::tinyClassBytes(sizeClass);
+        } else if (BufferPool::isSmallBin(bin)) {
+            m_counters.smallBuffersCached += delta;
+            m_counters.bytesInUse[BufferPool::Stats::SMALL_POOL] -= delta * (int64)BufferPool::binBytes(bin);
+        } else {
+            m_counters.medBuffersCached += delta;
+            m_counters.bytesInUse[BufferPool::Stats::MED_POOL] -= delta * (int64)BufferPool::binBytes(bin);
+        }
+    }
+
+    /** Refills the empty magazine of \a sizeClass, preferably with the buffers freed by 
+        other threads. Returns the number of blocks in it. */
+    int refill(int sizeClass) {
+        Magazine& mag = m_magazine[sizeClass];
+#       ifndef NO_REMOTE_FREE
+            if (BufferPool::isTinyClass(sizeClass) && (m_owner != BufferPool::noTinyOwner) && (reclaim(sizeClass) > 0)) {
+                return mag.size;
+            }
+#       endif
+        mag.size = bufferpool->mallocBatch(sizeClass, mag.ptr, batchSize, m_counters, m_owner);
+        return mag.size;
+    }
+
+    inline UserPtr pop(int sizeClass) {
+        Magazine& mag = m_magazine[sizeClass];
+        if ((mag.size == 0) && (refill(sizeClass) == 0)) {
+            return nullptr;
+        }
+
+        --mag.size;
+        countCached(sizeClass, -1);
+        if (BufferPool::isTinyClass(sizeClass)) {
+            ++m_counters.mallocsFromTinyPool;
+        } else if (BufferPool::isSmallBin(sizeClass - BufferPool::numTinyClasses)) {
+            ++m_counters.mallocsFromSmallPool;
+        } else {
+            ++m_counters.mallocsFromMedPool;
+        }
+        return mag.ptr[mag.size];
+    }
+
+public:
+
+#ifndef NO_REMOTE_FREE
+    ThreadCache() : m_owner(acquireOwner()), m_reclaimed() {}
+#else
+    ThreadCache() : m_owner(BufferPool::noTinyOwner) {}
+#endif
+
+    ~ThreadCache() {
+#       ifndef NO_REMOTE_FREE
+            releaseOwner();
+#       endif
+        drain();
+    }
+
+    /** See BufferPool::tinyChunkOwner */
+    int owner() const {
+        return m_owner;
+    }
+
+    /** Makes this thread's allocations visible in the BufferPool's counters */
+    void flushCounters() {
+        bufferpool->flushCounters(m_counters);
+    }
+
+    /** Returns every cached block, including the buffers freed by other threads, to the BufferPool */
+    void drain() {
+#       ifndef NO_REMOTE_FREE
+            for (int c = 0; c < BufferPool::numTinyClasses; ++c) {
+                stashChain(c, m_reclaimed[c]);
+                m_reclaimed[c] = nullptr;
+                if (m_owner != BufferPool::noTinyOwner) {
+                    stashChain(c, remoteFreeQueues[m_owner].takeAll(c));
+                }
+            }
+#       endif
+        for (int c = 0; c < BufferPool::numSizeClasses; ++c) {
+            while (m_magazine[c].size > 0) {
+                flush(c);
+            }
+        }
+        flushCounters();
+    }
+
+    /** Size class of a request for \a bytes from the bins of \a kind, or -1 if it is not cached */
+    static inline int sizeClassOf(size_t bytes, int kind) {
+        if (bytes <= BufferPool::tinyBufferSize) {
+            return BufferPool::tinyClassIndex(bytes);
+        } else if (bytes <= BufferPool::medBufferSize) {
+            return BufferPool::binSizeClass(kind * BufferPool::numBins + BufferPool::binIndex(bytes));
+        }
+        return -1;
+    }
+
+    inline UserPtr popCached(int sizeClass, size_t bytes) {
+        UserPtr ptr = pop(sizeClass);
+        if (ptr != nullptr) {
+            ++m_counters.totalMallocs;
+            ++m_counters.mallocSizeHistogram[BufferPool::Stats::sizeBucket(bytes)];
+        }
+        return ptr;
+    }
+
+    UserPtr malloc(size_t bytes) {
+        const int sizeClass = sizeClassOf(bytes, BufferPool::HEADER_BINS);
+        if (sizeClass >= 0) {
+            UserPtr ptr = popCached(sizeClass, bytes);
+            if (ptr != nullptr) {
+                return ptr;
+            }
+        }
+
+        // Fall back to the shared pools and the heap
+        return bufferpool->malloc(bytes);
+    }
+
+    /** \sa BufferPool::mallocSized */
+    UserPtr mallocSized(size_t bytes, size_t alignment) {
+        if (alignment <= BufferPool::maxBinAlignment) {
+            const int sizeClass = sizeClassOf(BufferPool::alignedRequestBytes(bytes, alignment), BufferPool::sizedBinKind(alignment));
+            if (sizeClass >= 0) {
+                UserPtr ptr = popCached(sizeClass, bytes);
+                if (ptr != nullptr) {
+                    return ptr;
+                }
+            }
+        }
+        return bufferpool->mallocSized(bytes, alignment);
+    }
+
+    /** Puts \a ptr into the magazine of \a sizeClass without counting it */
+    inline void stash(int sizeClass, UserPtr ptr) {
+        Magazine& mag = m_magazine[sizeClass];
+        if (mag.size == magazineSize) {
+            flush(sizeClass);
+        }
+        mag.ptr[mag.size] = ptr;
+        ++mag.size;
+    }
+
+    /** Fills \a out[i] with a cached block of \a sizes[i] bytes where the magazine of its size 
+        class is not empty, else with nullptr, without refilling the magazines. \a sized: see 
+        BufferPool::allocateMany. */
+    void mallocCached(const size_t* sizes, size_t count, UserPtr* out, bool sized) {
+        const int kind = sized ? BufferPool::SIZED_BINS : BufferPool::HEADER_BINS;
+        for (size_t i = 0; i < count; ++i) {
+            const int sizeClass = sizeClassOf(sizes[i], kind);
+            out[i] = ((sizeClass >= 0) && (m_magazine[sizeClass].size > 0)) ? popCached(sizeClass, sizes[i]) : nullptr;
+        }
+    }
+
+    /** Caches \a ptr in the magazine of \a sizeClass */
+    inline void push(int sizeClass, UserPtr ptr) {
+        stash(sizeClass, ptr);
+        countCached(sizeClass, +1);
+    }
+
+    /** Caches the tiny buffer \a ptr of class \a c, or hands it to its owner */
+    inline void pushTiny(int c, UserPtr ptr) {
+#       ifndef NO_REMOTE_FREE
+            if (remoteFree(c, ptr)) {
+                return;
+            }
+#       endif
+        push(c, ptr);
+    }
+
+    /** \sa BufferPool::freeSized */
+    void freeSized(UserPtr ptr, size_t bytes, size_t alignment) {
+        if (ptr == nullptr) {
+            return;
+        }
+
+        // The size selects the size class, so the block itself is not read
+        const size_t blockBytes = BufferPool::alignedRequestBytes(bytes, alignment);
+        int sizeClass = -1;
+        if ((blockBytes <= BufferPool::tinyBufferSize) && bufferpool->inTinyHeap(ptr)) {
+            debugAssertM(bufferpool->tinyClassOf(ptr) == BufferPool::tinyClassIndex(blockBytes), "SystemAlloc::freeSized: wrong size");
+            pushTiny(BufferPool::tinyClassIndex(blockBytes), ptr);
+            return;
+        } else if ((blockBytes <= BufferPool::medBufferSize) && (alignment <= BufferPool::maxBinAlignment) && 
+                   ! bufferpool->inBuddyHeap(ptr)) {
+            sizeClass = BufferPool::binSizeClass(BufferPool::sizedBinKind(alignment) * BufferPool::numBins + BufferPool::binIndex(blockBytes));
+        }
+
+        if (sizeClass < 0) {
+            // Too big to cache, or a buddy block, which keeps its own size
+            bufferpool->freeSized(ptr, bytes, alignment);
+            return;
+        }
+        push(sizeClass, ptr);
+    }
+
+    /** \sa BufferPool::mallocNode */
+    UserPtr mallocNode(size_t bytes) {
+        if (bytes <= BufferPool::tinyBufferSize) {
+            UserPtr ptr = popCached(BufferPool::nodeClassIndex(bytes), bytes);
+            if (ptr != nullptr) {
+                return ptr;
+            }
+        }
+        return bufferpool->mallocNode(bytes, m_owner);
+    }
+
+    /** \sa BufferPool::freeNode */
+    void freeNode(UserPtr ptr, size_t bytes) {
+        if ((ptr != nullptr) && bufferpool->inTinyHeap(ptr)) {
+            pushTiny(bufferpool->tinyClassOf(ptr), ptr);
+            return;
+        }
+        freeSized(ptr, bytes, BufferPool::minAlignment);
+    }
+
+    void free(UserPtr ptr) {
+        if (ptr == nullptr) {
+            return;
+        }
+
+        assert(isValidPointer(ptr));
+
+        if (bufferpool->inTinyHeap(ptr)) {
+            pushTiny(bufferpool->tinyClassOf(ptr), ptr);
+            return;
+        }
+
+        const size_t bytes = bufferpool->userSizeOf(ptr);
+        if (bytes > BufferPool::medBufferSize) {
+            // Too big to cache
+            bufferpool->free(ptr);
+            return;
+        }
+        push(BufferPool::binSizeClass(BufferPool::binIndex(bytes)), ptr);
+    }
+
+    /** Caches the blocks of \a ptrs whose magazines have room and replaces them with nullptr, 
+        without flushing the magazines. \a sizes: see BufferPool::releaseMany. */
+    void freeCached(UserPtr* ptrs, size_t count, const size_t* sizes) {
+        const int kind = (sizes != nullptr) ? BufferPool::SIZED_BINS : BufferPool::HEADER_BINS;
+        for (size_t i = 0; i < count; ++i) {
+            UserPtr ptr = ptrs[i];
+            if (ptr == nullptr) {
+                continue;
+            }
+
+            const bool tiny = bufferpool->inTinyHeap(ptr);
+            int sizeClass = -1;
+            if (tiny) {
+                sizeClass = bufferpool->tinyClassOf(ptr);
+            } else {
+                const size_t bytes = (sizes != nullptr) ? sizes[i] : bufferpool->userSizeOf(ptr);
+                if (bytes <= BufferPool::medBufferSize) {
+                    sizeClass = BufferPool::binSizeClass(kind * BufferPool::numBins + BufferPool::binIndex(bytes));
+                }
+            }
+
+            if ((sizeClass >= 0) && (m_magazine[sizeClass].size < magazineSize)) {
+                if (tiny) {
+                    pushTiny(sizeClass, ptr);
+                } else {
+                    push(sizeClass, ptr);
+                }
+                ptrs[i] = nullptr;
+            }
+        }
+    }
+};
+
+
+/** Owns the calling thread's ThreadCache. Only this pointer is thread-local: the magazines 
+    (about 40 KB) are allocated when the thread first uses the cache, so that threads which 
+    never allocate don't pay for them, and a library loaded with dlopen does not need that 
+    much static TLS. */
+class ThreadCacheHolder {
+public:
+    ThreadCache*    cache = nullptr;
+
+    ~ThreadCacheHolder() {
+        threadCacheDestroyed = true;
+        if (cache != nullptr) {
+            cache->~ThreadCache();
+            ::free(cache);
+            cache = nullptr;
+        }
+    }
+};
+
+/** Returns nullptr once the calling thread's cache has been destroyed during
+    thread shutdown, after which the thread goes directly to the BufferPool, 
+    or if the cache cannot be allocated. */
+inline ThreadCache* threadCache() {
+    if (threadCacheDestroyed) {
+        return nullptr;
+    }
+    static thread_local ThreadCacheHolder holder;
+    if (holder.cache == nullptr) {
+        // Not from the BufferPool, which would come back here
+        void* storage = ::malloc(sizeof(ThreadCache));
+        if (storage == nullptr) {
             return nullptr;
         }
+        holder.cache = new (storage) ThreadCache();
+    }
+    return holder.cache;
+}
+#endif
+
+
+#ifndef NO_BUFFERPOOL
+/** Serves SystemAlloc::mallocBatch and mallocSizedBatch from the calling thread's cache 
+    as far as it holds blocks, and the rest under a single lock of the BufferPool */
+static void mallocMany(const size_t* sizes, size_t count, void** out, bool sized) {
+#ifndef NO_THREAD_CACHE
+    ThreadCache* cache = threadCache();
+    if (cache != nullptr) {
+        cache->mallocCached(sizes, count, out, sized);
+        bufferpool->allocateMany(sizes, count, out, sized, cache->owner());
+        return;
+    }
+#endif
+    for (size_t i = 0; i < count; ++i) {
+        out[i] = nullptr;
+    }
+    bufferpool->allocateMany(sizes, count, out, sized);
+}
+
+
+/** Caches the blocks of SystemAlloc::freeBatch and freeSizedBatch in the calling thread's 
+    cache as far as it has room, and returns the rest under a single lock of the BufferPool */
+static void freeMany(void** ptrs, size_t count, const size_t* sizes) {
+#ifndef NO_THREAD_CACHE
+    ThreadCache* cache = threadCache();
+    if (cache != nullptr) {
+        cache->freeCached(ptrs, count, sizes);
+    }
+#endif
+    bufferpool->releaseMany(ptrs, count, sizes);
+}
+
+
+/** Returns the tiny buffers queued for all thread caches (see RemoteFreeQueue) to the
+    BufferPool, so that trim can release them. */
+static void drainRemoteFreeQueues() {
+#if ! defined(NO_THREAD_CACHE) && ! defined(NO_REMOTE_FREE)
+    BufferPool::Counters none;
+    BufferPool::UserPtr  batch[ThreadCache::batchSize];
+    for (int owner = 1; owner <= BufferPool::maxTinyOwners; ++owner) {
+        RemoteFreeQueue& queue = remoteFreeQueues[owner];
+        if (! queue.taken.load(std::memory_order_relaxed)) {
+            continue;
+        }
+        for (int c = 0; c < BufferPool::numTinyClasses; ++c) {
+            RemoteFreeQueue::Block* block = queue.takeAll(c);
+            while (block != nullptr) {
+                int n = 0;
+                while ((block != nullptr) && (n < ThreadCache::batchSize)) {
+                    batch[n] = block;
+                    ++n;
+                    block = block->next;
+                }
+                bufferpool->freeBatch(c, batch, n, none);
+            }
+        }
+    }
+#endif
+}
+#endif
+
+int SystemAlloc::Stats::sizeBucket(size_t bytes) {
+    if (bytes <= 16) {
+        return 0;
+    }
+    const int b = highestBit(bytes - 1) - 3;
+    return (b < numSizeBuckets) ? b : (numSizeBuckets - 1);
+}
+
+
+size_t SystemAlloc::Stats::tinyClassBytes(int c) {
+    return BufferPool::tinyClassBytes(c);
+}
+
+size_t SystemAlloc::Stats::buddyBlockBytes(int order) {
+    return BufferPool::buddyBlockBytes(order);
+}
+
+
+String SystemAlloc::formatMallocStats(const Stats& stats) {
+    typedef unsigned long long ull;
+
+    String result;
+    if (stats.totalMallocs > 0) {
+        const uint64 pooled = stats.mallocsFromTinyPool + stats.mallocsFromSmallPool + stats.mallocsFromMedPool;
+        const double total  = (double)stats.totalMallocs;
+
+        result = format("Percent of Mallocs: %5.1f%% <= %db, %5.1f%% <= %db, "
+                        "%5.1f%% <= %db, %5.1f%% > %db",
+                        100.0 * stats.mallocsFromTinyPool  / total,
+                        BufferPool::tinyBufferSize,
+                        100.0 * stats.mallocsFromSmallPool / total,
+                        BufferPool::smallBufferSize,
+                        100.0 * stats.mallocsFromMedPool   / total,
+                        BufferPool::medBufferSize,
+                        100.0 * (1.0 - (double)pooled / total),
+                        BufferPool::medBufferSize);
+    } else {
+        result = "No SystemAlloc::malloc calls made yet.";
+    }
+
+    // Tiny heap space that is not in use (including space not yet carved into 
+    // buffers) counts as free, measured in tinyBufferSize buffers
+    const uint64 tinyReserved = stats.tinyHeapBytesReserved;
+    const uint64 tinyInUse    = std::min(stats.bytesInUse[Stats::TINY_POOL], tinyReserved);
+    result += format("\nPool Sizes: %5d/%d x %db, %5d/%d x %db, %5d/%d x %db",
+                     (int)((tinyReserved - tinyInUse) / BufferPool::tinyBufferSize), 
+                     (int)(tinyReserved / BufferPool::tinyBufferSize),            BufferPool::tinyBufferSize, 
+                     (int)stats.buffersFree[Stats::SMALL_POOL], (int)stats.maxSmallBuffers, BufferPool::smallBufferSize,
+                     (int)stats.buffersFree[Stats::MED_POOL],   (int)stats.maxMedBuffers,   BufferPool::medBufferSize);
+
+    result += format("\nBytes In Use: %llu KB tiny, %llu KB small, %llu KB med, %llu KB large",
+                     (ull)(stats.bytesInUse[Stats::TINY_POOL]    / 1024),
+                     (ull)(stats.bytesInUse[Stats::SMALL_POOL]   / 1024),
+                     (ull)(stats.bytesInUse[Stats::MED_POOL]     / 1024),
+                     (ull)(stats.bytesInUse[Stats::LARGE_BLOCKS] / 1024));
+
+    static const char* pageModeName[] = {"regular pages", "huge pages", "regular pages (huge pages unavailable)"};
+    result += format("\nTiny Heap: %llu/%llu KB carved, %s", (ull)(stats.tinyHeapBytesCarved / 1024), 
+                     (ull)(tinyReserved / 1024), pageModeName[stats.tinyHeapPages]);
+
+    result += "\nTiny Classes (used/free/chunks):";
+    for (int c = 0; c < Stats::numTinyClasses; ++c) {
+        if ((c >= Stats::numPow2TinyClasses) && (stats.tinyClassChunks[c] == 0)) {
+            // Node classes are only listed once mallocNode has used them
+            continue;
+        }
+        result += format(" %db: %llu/%llu/%llu", (int)Stats::tinyClassBytes(c), (ull)stats.tinyClassBuffersInUse[c], 
+                         (ull)stats.tinyClassBuffersFree[c], (ull)stats.tinyClassChunks[c]);
+    }
+
+    result += "\nBin Sizes:";
+    for (int bin = 0; bin < Stats::numBins; ++bin) {
+        result += format(" %llu", (ull)stats.binBuffersFree[bin]);
+    }
+
+    const uint64 pooled = stats.mallocsFromTinyPool + stats.mallocsFromSmallPool + stats.mallocsFromMedPool + stats.mallocsFromBuddyHeap;
+    result += format("\nTotal out of pools mallocs: %llu; Bytes allocated: %llu", 
+                     (ull)(stats.totalMallocs - std::min(pooled, stats.totalMallocs)), (ull)stats.heapBytesAllocated);
+    result += format("\nSmall Pool Purges: %llu (%llu blocks evicted); Med Pool Purges: %llu (%llu blocks evicted)", 
+                     (ull)stats.smallPoolPurges, (ull)stats.smallPoolEvictions, (ull)stats.medPoolPurges, (ull)stats.medPoolEvictions);
+    result += format("\nTrimmed: %llu KB; Tiny Heap Decommitted: %llu KB", 
+                     (ull)(stats.bytesTrimmed / 1024), (ull)(stats.tinyHeapBytesDecommitted / 1024));
+    result += format("\nLarge Extents: %llu KB mapped, %llu KB cached; Cache Hits: %llu; Remaps: %llu", 
+                     (ull)(stats.extentBytesMapped / 1024), (ull)(stats.extentBytesCached / 1024), 
+                     (ull)stats.extentCacheHits, (ull)stats.extentRemaps);
+
+    // Internal: bytes of the blocks in use that were not requested. External: free bytes in 
+    // chunks that are partly in use, which can neither serve a request of a whole chunk nor be trimmed.
+    result += format("\nBuddy Heap: %llu KB in use (%llu KB requested), %llu KB free of %llu KB; Mallocs: %llu; "
+                     "Splits: %llu; Merges: %llu",
+                     (ull)(stats.buddyBytesInUse / 1024), (ull)(stats.buddyBytesRequested / 1024), 
+                     (ull)(stats.buddyBytesFree / 1024), (ull)(stats.buddyBytesCommitted / 1024), 
+                     (ull)stats.mallocsFromBuddyHeap, (ull)stats.buddySplits, (ull)stats.buddyMerges);
+    const uint64 freeChunkBytes = stats.buddyBlocksFree[Stats::numBuddyOrders - 1] * Stats::buddyBlockBytes(Stats::numBuddyOrders - 1);
+    result += format("\nBuddy Fragmentation: %5.1f%% internal, %5.1f%% external; Free Blocks:",
+                     (stats.buddyBytesInUse > 0) ? 
+                        100.0 * (1.0 - (double)std::min(stats.buddyBytesRequested, stats.buddyBytesInUse) / (double)stats.buddyBytesInUse) : 0.0,
+                     (stats.buddyBytesFree > 0) ? 
+                        100.0 * (1.0 - (double)std::min(freeChunkBytes, stats.buddyBytesFree) / (double)stats.buddyBytesFree) : 0.0);
+    for (int k = 0; k < Stats::numBuddyOrders; ++k) {
+        result += format(" %lluK: %llu", (ull)(Stats::buddyBlockBytes(k) / 1024), (ull)stats.buddyBlocksFree[k]);
+    }
+    result += format("\nLock: %llu acquisitions, %llu contended, %llu parked; Waited: %.3f ms", 
+                     (ull)stats.lockAcquisitions, (ull)stats.lockContended, (ull)stats.lockParked, 
+                     (double)stats.lockWaitNanoseconds / 1e6);
+    result += format("\nThread Cache Sizes: %5d x <=%db, %5d x <=%db, %5d x <=%db",
+                     (int)stats.buffersInThreadCaches[Stats::TINY_POOL],  BufferPool::tinyBufferSize,
+                     (int)stats.buffersInThreadCaches[Stats::SMALL_POOL], BufferPool::smallBufferSize,
+                     (int)stats.buffersInThreadCaches[Stats::MED_POOL],   BufferPool::medBufferSize);
+    result += format("; Remote Frees: %llu", (ull)stats.remoteFrees);
+
+    result += "\nRequest Sizes:";
+    for (int b = 0; b < Stats::numSizeBuckets; ++b) {
+        if (b < Stats::numSizeBuckets - 1) {
+            result += format(" <=%llu: %llu", (ull)Stats::sizeBucketLimit(b), (ull)stats.mallocSizeHistogram[b]);
+        } else {
+            result += format(" more: %llu", (ull)stats.mallocSizeHistogram[b]);
+        }
+    }
+
+    return result;
+}
+
+
+String SystemAlloc::mallocStatus() {    
+#ifndef NO_BUFFERPOOL
+#   ifndef NO_THREAD_CACHE
+    // Other threads' caches are folded in on their next refill or flush
+    ThreadCache* cache = threadCache();
+    if (cache != nullptr) {
+        cache->flushCounters();
+    }
+#   endif
+    return bufferpool->status();
+#else
+    return "NO_BUFFERPOOL";
+#endif
+}
+
+
+void SystemAlloc::resetMallocPerformanceCounters() {
+#ifndef NO_BUFFERPOOL
+#   ifndef NO_THREAD_CACHE
+    ThreadCache* cache = threadCache();
+    if (cache != nullptr) {
+        cache->flushCounters();
+    }
+#   endif
+    bufferpool->resetCounters();
+#endif
+}
+
+
+#ifndef NO_BUFFERPOOL
+/** Bins of the blocks of \a kind */
+static inline int binKindOf(SystemAlloc::ReserveKind kind) {
+    return (kind == SystemAlloc::MALLOC_BLOCKS) ? BufferPool::HEADER_BINS : BufferPool::SIZED_BINS;
+}
+#endif
+
+/** See SystemAlloc::reserve. Requires an initialized bufferpool. */
+static size_t reservePools(size_t tinyBlocks, size_t smallBlocks, size_t medBlocks, bool prefault, SystemAlloc::ReserveKind kind) {
+#ifndef NO_BUFFERPOOL
+    size_t bytes = bufferpool->reserveTinyHeap(tinyBlocks * BufferPool::tinyBufferSize, prefault);
+
+    // Spread the blocks evenly over the bins of each pool
+    for (int b = 0; b < BufferPool::numBins; ++b) {
+        const bool   small = (b < BufferPool::numSmallBins);
+        const size_t total = small ? smallBlocks : medBlocks;
+        const size_t bins  = small ? BufferPool::numSmallBins : (BufferPool::numBins - BufferPool::numSmallBins);
+        const size_t i     = small ? b : (b - BufferPool::numSmallBins);
+        const size_t count = total / bins + ((i < total % bins) ? 1 : 0);
+        if (count > 0) {
+            bytes += bufferpool->reserveBin(binKindOf(kind) * BufferPool::numBins + b, count, prefault) * BufferPool::binBytes(b);
+        }
+    }
+    return bytes;
+#else
+    (void)tinyBlocks;
+    (void)smallBlocks;
+    (void)medBlocks;
+    (void)prefault;
+    (void)kind;
+    return 0;
+#endif
+}
+
+/** See SystemAlloc::reserveSize. Requires an initialized bufferpool. */
+static size_t reserveBlocks(size_t bytes, size_t count, bool prefault, SystemAlloc::ReserveKind kind) {
+#ifndef NO_BUFFERPOOL
+    if (bytes <= BufferPool::tinyBufferSize) {
+        return bufferpool->reserveTinyHeap(count * BufferPool::tinyClassBytes(BufferPool::tinyClassIndex(bytes)), prefault);
+    } else if (bytes > BufferPool::medBufferSize) {
+        return 0;
+    }
+    const int bin = binKindOf(kind) * BufferPool::numBins + BufferPool::binIndex(bytes);
+    return bufferpool->reserveBin(bin, count, prefault) * BufferPool::binBytes(bin);
+#else
+    (void)bytes;
+    (void)count;
+    (void)prefault;
+    (void)kind;
+    return 0;
+#endif
+}
+
+/** Contents of a config file of SystemAlloc::reserveFromFile. Reading one does not 
+    allocate, so that it can be done while the buffer pool is created. */
+class ReserveConfig {
+public:
+    enum {maxSizes = 32, maxLine = 256};
+
+    size_t  maxSmallBuffers;
+    size_t  maxMedBuffers;
+
+    size_t  tinyBlocks;
+    size_t  smallBlocks;
+    size_t  medBlocks;
+    bool    prefault;
+
+    /** Blocks of SystemAlloc::malloc */
+    size_t  mallocSmallBlocks;
+    size_t  mallocMedBlocks;
+
+    /** The "blocks.<bytes> = <count>" and "mallocBlocks.<bytes> = <count>" lines */
+    size_t  sizeBytes[maxSizes];
+    size_t  sizeCount[maxSizes];
+    SystemAlloc::ReserveKind sizeKind[maxSizes];
+    int     numSizes;
+
+    ReserveConfig() : maxSmallBuffers(0), maxMedBuffers(0), tinyBlocks(0), smallBlocks(0), medBlocks(0), prefault(true), 
+                      mallocSmallBlocks(0), mallocMedBlocks(0), numSizes(0) {}
+
+    /** Returns false if \a filename cannot be opened or has an invalid line */
+    bool read(const char* filename) {
+#       ifdef G3D_WINDOWS
+            FILE* file = nullptr;
+            if (fopen_s(&file, filename, "r") != 0) {
+                return false;
+            }
+#       else
+            FILE* file = fopen(filename, "r");
+#       endif
+        if (file == nullptr) {
+            return false;
+        }
+
+        bool valid = true;
+        char line[maxLine];
+        while (valid && (fgets(line, sizeof(line), file) != nullptr)) {
+            valid = parseLine(line);
+        }
+        fclose(file);
+
+#       ifdef G3D_DEBUG
+            // Not debugPrintf, which allocates while the pool may be being created
+            if (! valid) {
+                fprintf(stderr, "SystemAlloc::reserveFromFile: invalid line in %s: %s\n", filename, line);
+            }
+#       endif
+        return valid;
+    }
+
+    /** Returns the bytes reserved */
+    size_t apply() const {
+#       ifndef NO_BUFFERPOOL
+            // Before reserving, which fills the pools up to their limits
+            bufferpool->setPoolLimits(maxSmallBuffers, maxMedBuffers);
+#       endif
+        size_t bytes = reservePools(tinyBlocks, smallBlocks, medBlocks, prefault, SystemAlloc::SIZED_BLOCKS) +
+                       reservePools(0, mallocSmallBlocks, mallocMedBlocks, prefault, SystemAlloc::MALLOC_BLOCKS);
+        for (int i = 0; i < numSizes; ++i) {
+            bytes += reserveBlocks(sizeBytes[i], sizeCount[i], prefault, sizeKind[i]);
+        }
+        return bytes;
+    }
+
+private:
+
+    /** Parses a "<key> = <value>" line, a comment starting with '#' or an empty line */
+    bool parseLine(const char* line) {
+        const char* key = line + strspn(line, " \t");
+        if ((*key == '#') || (*key == '\r') || (*key == '\n') || (*key == '\0')) {
+            return true;
+        }
+
+        const size_t keyLength = strcspn(key, " \t=");
+        const char* p = key + keyLength;
+        p += strspn(p, " \t");
+        if (*p != '=') {
+            return false;
+        }
+        ++p;
+
+        size_t value = 0;
+        if (! parseNumber(p, strlen(p), value)) {
+            return false;
+        }
+
+        if (isKey(key, keyLength, "maxSmallBuffers")) {
+            maxSmallBuffers = value;
+        } else if (isKey(key, keyLength, "maxMedBuffers")) {
+            maxMedBuffers = value;
+        } else if (isKey(key, keyLength, "tinyBlocks")) {
+            tinyBlocks = value;
+        } else if (isKey(key, keyLength, "smallBlocks")) {
+            smallBlocks = value;
+        } else if (isKey(key, keyLength, "medBlocks")) {
+            medBlocks = value;
+        } else if (isKey(key, keyLength, "prefault")) {
+            prefault = (value != 0);
+        } else if (isKey(key, keyLength, "mallocSmallBlocks")) {
+            mallocSmallBlocks = value;
+        } else if (isKey(key, keyLength, "mallocMedBlocks")) {
+            mallocMedBlocks = value;
+        } else if ((keyLength > 7) && (strncmp(key, "blocks.", 7) == 0) && (numSizes < maxSizes)) {
+            return parseSize(key + 7, keyLength - 7, value, SystemAlloc::SIZED_BLOCKS);
+        } else if ((keyLength > 13) && (strncmp(key, "mallocBlocks.", 13) == 0) && (numSizes < maxSizes)) {
+            return parseSize(key + 13, keyLength - 13, value, SystemAlloc::MALLOC_BLOCKS);
+        } else {
+            return false;
+        }
+        return true;
+    }
+
+    /** Adds the line "<prefix>.<bytes> = \a count", whose <bytes> are the first \a length characters of \a bytes */
+    bool parseSize(const char* bytes, size_t length, size_t count, SystemAlloc::ReserveKind kind) {
+        if (! parseNumber(bytes, length, sizeBytes[numSizes])) {
+            return false;
+        }
+        sizeCount[numSizes] = count;
+        sizeKind[numSizes]  = kind;
+        ++numSizes;
+        return true;
+    }
+
+    static bool isKey(const char* key, size_t keyLength, const char* name) {
+        return (strlen(name) == keyLength) && (strncmp(key, name, keyLength) == 0);
+    }
+
+    /** Parses the decimal number in the first \a length characters of \a str, which may 
+        be surrounded by white space */
+    static bool parseNumber(const char* str, size_t length, size_t& value) {
+        size_t i = 0;
+        while ((i < length) && ((str[i] == ' ') || (str[i] == '\t'))) {
+            ++i;
+        }
+        const size_t first = i;
+        value = 0;
+        while ((i < length) && (str[i] >= '0') && (str[i] <= '9')) {
+            value = value * 10 + (size_t)(str[i] - '0');
+            ++i;
+        }
+        if (i == first) {
+            return false;
+        }
+        while ((i < length) && ((str[i] == ' ') || (str[i] == '\t') || (str[i] == '\r') || (str[i] == '\n'))) {
+            ++i;
+        }
+        return i == length;
+    }
+};
+
+
+#ifndef NO_BUFFERPOOL
+/** 
+ Block sizes and lifetimes recorded by SystemAlloc::startProfile, from which 
+ SystemAlloc::writeProfile derives a config file for SystemAlloc::reserveFromFile.
+
+ Blocks are counted per tiny class, bin size, buddy order and for larger blocks, on 
+ counters shared by all threads, and only while recording. Blocks allocated before the
+ recording started are not counted when they are freed.
+
+ The lifetime of a block is measured in mallocs of any size, counted by a clock shared 
+ by all classes. Each class sums the clock at the frees of its blocks minus the clock at 
+ their mallocs, so that the mean lifetime of its blocks needs no per-block state.
+ */
+class PoolProfile {
+public:
+    /** Tiny classes, the bins of mallocSized and of malloc, which are reserved separately 
+        (see SystemAlloc::ReserveKind), buddy orders and larger blocks */
+    enum {firstBinClass = BufferPool::numTinyClasses, firstMallocBinClass = firstBinClass + BufferPool::numBins, 
+          firstBuddyClass = firstMallocBinClass + BufferPool::numBins, 
+          largeClass = firstBuddyClass + BufferPool::numBuddyOrders, numClasses};
+
+    /** Buckets of the lifetime histogram: up to 16, 256, 4096, 65536 mallocs and longer */
+    enum {numLifetimeBuckets = 5};
+
+private:
+    // Zero-initialized as a static object, i.e. before the first allocation
+
+    std::atomic<bool>   m_recording;
+
+    /** Mallocs of all classes */
+    std::atomic<int64>  m_clock;
+
+    std::atomic<int64>  m_mallocs[numClasses];
+    std::atomic<int64>  m_live[numClasses];
+    std::atomic<int64>  m_peakLive[numClasses];
+
+    /** Sum of m_clock at the frees of the blocks of the class minus at their mallocs */
+    std::atomic<int64>  m_lifetimeSum[numClasses];
+
+    /** Class of the block \a ptr of \a bytes and \a kind. Tiny buffers are counted in the class 
+        they were carved for, which may be larger than \a bytes (see SystemAlloc::mallocSized). */
+    static int classOf(const void* ptr, size_t bytes, SystemAlloc::ReserveKind kind) {
+        if (bufferpool->inTinyHeap(const_cast<void*>(ptr))) {
+            return bufferpool->tinyClassOf(ptr);
+        } else if (bytes <= BufferPool::tinyBufferSize) {
+            return BufferPool::tinyClassIndex(bytes);
+        } else if (bytes <= BufferPool::medBufferSize) {
+            return ((kind == SystemAlloc::MALLOC_BLOCKS) ? firstMallocBinClass : firstBinClass) + BufferPool::binIndex(bytes);
+        } else if (bytes <= BufferPool::maxBuddyBlockSize) {
+            return firstBuddyClass + BufferPool::buddyOrderOf(bytes);
+        }
+        return largeClass;
+    }
+
+    /** Size of the blocks of class \a c; 0 for larger blocks */
+    static size_t classBytes(int c) {
+        if (c < firstBinClass) {
+            return BufferPool::tinyClassBytes(c);
+        } else if (c < firstBuddyClass) {
+            return BufferPool::binBytes((c - firstBinClass) % BufferPool::numBins);
+        } else if (c < largeClass) {
+            return BufferPool::buddyBlockBytes(c - firstBuddyClass);
+        }
+        return 0;
+    }
+
+    /** Mean lifetime of the blocks of class \a c in mallocs, blocks that are still live 
+        counting as freed at \a now */
+    double lifetime(int c, int64 now) const {
+        const int64 mallocs = m_mallocs[c].load(std::memory_order_relaxed);
+        const int64 sum     = m_lifetimeSum[c].load(std::memory_order_relaxed) + m_live[c].load(std::memory_order_relaxed) * now;
+        return (mallocs > 0) ? (double)sum / (double)mallocs : 0.0;
+    }
+
+    static int lifetimeBucket(double lifetime) {
+        int b = 0;
+        for (double limit = 16.0; (b < numLifetimeBuckets - 1) && (lifetime > limit); limit *= 16.0) {
+            ++b;
+        }
+        return b;
+    }
+
+    /** The peak number of live blocks of class \a c */
+    int64 peakLive(int c) const {
+        return m_peakLive[c].load(std::memory_order_relaxed);
+    }
+
+    /** Pool limit for \a peakBlocks live blocks: 25% more, and at least 1/8 of the default, so
+        that sizes the recorded run did not use are still pooled */
+    static int64 poolLimit(int64 peakBlocks, int64 defaultLimit) {
+        return max(peakBlocks + peakBlocks / 4, defaultLimit / 8);
+    }
+
+public:
+
+    inline bool recording() const {
+        return m_recording.load(std::memory_order_relaxed);
+    }
+
+    void start() {
+        m_recording.store(false, std::memory_order_relaxed);
+        m_clock.store(0, std::memory_order_relaxed);
+        for (int c = 0; c < numClasses; ++c) {
+            m_mallocs[c].store(0, std::memory_order_relaxed);
+            m_live[c].store(0, std::memory_order_relaxed);
+            m_peakLive[c].store(0, std::memory_order_relaxed);
+            m_lifetimeSum[c].store(0, std::memory_order_relaxed);
+        }
+        m_recording.store(true, std::memory_order_relaxed);
+    }
+
+    void stop() {
+        m_recording.store(false, std::memory_order_relaxed);
+    }
+
+    void recordMalloc(const void* ptr, size_t bytes, SystemAlloc::ReserveKind kind) {
+        if (ptr == nullptr) {
+            return;
+        }
+        const int   c    = classOf(ptr, bytes, kind);
+        const int64 live = m_live[c].fetch_add(1, std::memory_order_relaxed) + 1;
+        m_mallocs[c].fetch_add(1, std::memory_order_relaxed);
+        m_lifetimeSum[c].fetch_sub(m_clock.fetch_add(1, std::memory_order_relaxed), std::memory_order_relaxed);
+
+        int64 peak = m_peakLive[c].load(std::memory_order_relaxed);
+        while ((live > peak) && ! m_peakLive[c].compare_exchange_weak(peak, live, std::memory_order_relaxed)) {
+        }
+    }
+
+    void recordFree(const void* ptr, size_t bytes, SystemAlloc::ReserveKind kind) {
+        if (ptr == nullptr) {
+            return;
+        }
+        const int c = classOf(ptr, bytes, kind);
+        if (m_live[c].fetch_sub(1, std::memory_order_relaxed) <= 0) {
+            // Allocated before the recording started
+            m_live[c].fetch_add(1, std::memory_order_relaxed);
+        } else {
+            m_lifetimeSum[c].fetch_add(m_clock.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        }
+    }
+
+    /** See SystemAlloc::writeProfile */
+    bool write(const char* filename) const {
+#       ifdef G3D_WINDOWS
+            FILE* file = nullptr;
+            if (fopen_s(&file, filename, "w") != 0) {
+                return false;
+            }
+#       else
+            FILE* file = fopen(filename, "w");
+#       endif
+        if (file == nullptr) {
+            return false;
+        }
+
+        const int64 totalMallocs = m_clock.load(std::memory_order_relaxed);
+
+        typedef unsigned long long ull;
+        fprintf(file, "# G3D::SystemAlloc::writeProfile of %llu mallocs\n#\n", (ull)totalMallocs);
+        fprintf(file, "# block bytes       mallocs   peak live   mean lifetime (mallocs)\n");
+
+        int64  peakSmall = 0;
+        int64  peakMed   = 0;
+        size_t tinyBytes = 0;
+        int64  lifetimeHistogram[numLifetimeBuckets] = {};
+        for (int c = 0; c < numClasses; ++c) {
+            const int64 mallocs = m_mallocs[c].load(std::memory_order_relaxed);
+            if (mallocs == 0) {
+                continue;
+            }
+            const double life = lifetime(c, totalMallocs);
+            lifetimeHistogram[lifetimeBucket(life)] += mallocs;
+            if (c == largeClass) {
+                fprintf(file, "#      larger %13llu %11llu %15.0f\n", (ull)mallocs, (ull)peakLive(c), life);
+            } else {
+                fprintf(file, "# %11llu %13llu %11llu %15.0f%s\n", (ull)classBytes(c), (ull)mallocs, (ull)peakLive(c), life,
+                        ((c >= firstMallocBinClass) && (c < firstBuddyClass)) ? "  (malloc)" : "");
+            }
+
+            if (c < firstBinClass) {
+                tinyBytes += (size_t)peakLive(c) * classBytes(c);
+            } else if (c < firstBuddyClass) {
+                (BufferPool::isSmallBin((c - firstBinClass) % BufferPool::numBins) ? peakSmall : peakMed) += peakLive(c);
+            }
+        }
+
+        fprintf(file, "#\n# mallocs by the mean lifetime of their block size:");
+        for (int b = 0; b < numLifetimeBuckets; ++b) {
+            if (b < numLifetimeBuckets - 1) {
+                fprintf(file, " <=%d: %llu", 1 << (4 * (b + 1)), (ull)lifetimeHistogram[b]);
+            } else {
+                fprintf(file, " more: %llu\n", (ull)lifetimeHistogram[b]);
+            }
+        }
 
-        ((size_t*)ptr)[0] = bytes;
-        debugAssertM((intptr_t)REALPTR_TO_USERPTR(ptr) % 16 == 0, "::malloc returned non-16 byte aligned memory");
-        return REALPTR_TO_USERPTR(ptr);
+        fprintf(file, "\n# the peak live small and medium blocks, plus 25%%\n");
+        fprintf(file, "maxSmallBuffers = %llu\n", (ull)poolLimit(peakSmall, BufferPool::defaultMaxSmallBuffers));
+        fprintf(file, "maxMedBuffers   = %llu\n", (ull)poolLimit(peakMed,   BufferPool::defaultMaxMedBuffers));
+        fprintf(file, "# the tiny heap for the peak live tiny buffers, and the peak live blocks of each bin\n");
+        fprintf(file, "tinyBlocks = %llu\n", (ull)((tinyBytes + BufferPool::tinyBufferSize - 1) / BufferPool::tinyBufferSize));
+        fprintf(file, "prefault   = 1\n");
+        for (int c = firstBinClass; c < firstBuddyClass; ++c) {
+            if (peakLive(c) > 0) {
+                fprintf(file, "%s.%llu = %llu\n", (c < firstMallocBinClass) ? "blocks" : "mallocBlocks", (ull)classBytes(c), (ull)peakLive(c));
+            }
+        }
+
+        const bool written = (ferror(file) == 0);
+        return (fclose(file) == 0) && written;
     }
+};
 
+static PoolProfile poolProfile;
 
-    void free(UserPtr ptr) {
-        if (ptr == nullptr) {
-            // Free does nothing on null pointers
-            return;
-        }
+/** Records a block of \a kind returned by SystemAlloc while profiling, see SystemAlloc::startProfile */
+static inline void* profileMalloc(void* ptr, size_t bytes, SystemAlloc::ReserveKind kind) {
+    if (poolProfile.recording()) {
+        poolProfile.recordMalloc(ptr, bytes, kind);
+    }
+    return ptr;
+}
 
-        assert(isValidPointer(ptr));
+/** Records a block of mallocSized(\a bytes) being freed while profiling */
+static inline void profileFree(const void* ptr, size_t bytes) {
+    if (poolProfile.recording()) {
+        poolProfile.recordFree(ptr, bytes, SystemAlloc::SIZED_BLOCKS);
+    }
+}
 
-        if (inTinyHeap(ptr)) {
-            lock();
-            tinyFree(ptr);
-            unlock();
-            return;
+/** Records a block of SystemAlloc::malloc being freed while profiling */
+static inline void profileFree(const void* ptr) {
+    if (poolProfile.recording() && (ptr != nullptr)) {
+        poolProfile.recordFree(ptr, bufferpool->inTinyHeap(const_cast<void*>(ptr)) ? 0 : bufferpool->userSizeOf(const_cast<void*>(ptr)),
+                               SystemAlloc::MALLOC_BLOCKS);
+    }
+}
+
+/** File named by the environment variable G3D_POOL_PROFILE */
+static char profileFilename[1024];
+
+static void writeProfileAtExit() {
+    poolProfile.write(profileFilename);
+}
+
+/** Starts recording if the environment variable G3D_POOL_PROFILE names a file, and 
+    writes the profile to it at exit, see SystemAlloc::startProfile */
+static bool profileFromEnvironment() {
+#   ifdef G3D_WINDOWS
+        const DWORD length = GetEnvironmentVariableA("G3D_POOL_PROFILE", profileFilename, sizeof(profileFilename));
+        if ((length == 0) || (length >= sizeof(profileFilename))) {
+            return false;
         }
+#   else
+        const char* filename = getenv("G3D_POOL_PROFILE");
+        if ((filename == nullptr) || (*filename == '\0') || (strlen(filename) >= sizeof(profileFilename))) {
+            return false;
+        }
+        strcpy(profileFilename, filename);
+#   endif
 
-        size_t bytes = USERSIZE_FROM_USERPTR(ptr);
+    poolProfile.start();
+    return atexit(writeProfileAtExit) == 0;
+}
+#endif
 
-        lock();
-        if (bytes <= smallBufferSize) {
-            if (smallPoolSize < maxSmallBuffers) {
-                smallPool[smallPoolSize] = MemBlock(ptr, bytes);
-                ++smallPoolSize;
-                unlock();
-                return;
-            }
-        } else if (bytes <= medBufferSize) {
-            if (medPoolSize < maxMedBuffers) {
-                medPool[medPoolSize] = MemBlock(ptr, bytes);
-                ++medPoolSize;
-                unlock();
-                return;
-            }
+
+#ifndef NO_BUFFERPOOL
+/** Applies the config file named by the environment variable G3D_POOL_CONFIG, if any, 
+    see SystemAlloc::reserveFromFile */
+static bool reserveFromEnvironment() {
+#   ifdef G3D_WINDOWS
+        char filename[MAX_PATH];
+        const DWORD length = GetEnvironmentVariableA("G3D_POOL_CONFIG", filename, MAX_PATH);
+        if ((length == 0) || (length >= MAX_PATH)) {
+            return false;
         }
-        bytesAllocated.fetch_sub(USERSIZE_TO_REALSIZE(bytes));
-        unlock();
+#   else
+        const char* filename = getenv("G3D_POOL_CONFIG");
+        if ((filename == nullptr) || (*filename == '\0')) {
+            return false;
+        }
+#   endif
 
-        // Free; the buffer pools are full or this is too big to store.
-        ::free(USERPTR_TO_REALPTR(ptr));
+    ReserveConfig config;
+    if (! config.read(filename)) {
+        return false;
     }
+    config.apply();
+    return true;
+}
 
-    String mallocRatioString() const {
-        if (totalMallocs > 0) {
-            int pooled = mallocsFromTinyPool +
-                         mallocsFromSmallPool + 
-                         mallocsFromMedPool;
 
-            int total = totalMallocs;
+inline void initMem() {
+    // Putting the test here ensures that the SystemAlloc is always
+    // initialized, even when globals are being allocated.
+    // The static initializer is threadsafe, so concurrent first calls
+    // cannot create two pools. The pool is not allocated with new, which
+    // may itself be served by SystemAlloc (see PoolOperatorNew.h).
+    alignas(BufferPool) static uint8 storage[sizeof(BufferPool)];
+    static bool initialized = (bufferpool = new (storage) BufferPool(), reserveFromEnvironment(), profileFromEnvironment(), true);
+    (void)initialized;
+}
+#endif
 
-            return format("Percent of Mallocs: %5.1f%% <= %db, %5.1f%% <= %db, "
-                          "%5.1f%% <= %db, %5.1f%% > %db",
-                          100.0 * mallocsFromTinyPool  / total,
-                          BufferPool::tinyBufferSize,
-                          100.0 * mallocsFromSmallPool / total,
-                          BufferPool::smallBufferSize,
-                          100.0 * mallocsFromMedPool   / total,
-                          BufferPool::medBufferSize,
-                          100.0 * (1.0 - (double)pooled / total),
-                          BufferPool::medBufferSize);
-        } else {
-            return "No SystemAlloc::malloc calls made yet.";
-        }
+
+size_t SystemAlloc::trim(size_t targetBytes) {
+#ifndef NO_BUFFERPOOL
+    initMem();
+#   ifndef NO_THREAD_CACHE
+    ThreadCache* cache = threadCache();
+    if (cache != nullptr) {
+        cache->drain();
     }
+#   endif
+    drainRemoteFreeQueues();
+    return bufferpool->trim(targetBytes);
+#else
+    (void)targetBytes;
+    return 0;
+#endif
+}
 
-    String status() const {
-        String tinyPoolString = format("Tiny Pool: %5.1f%% of %d x %db Free", 100.0 * tinyPoolSize / maxTinyBuffers, 
-                                       maxTinyBuffers, tinyBufferSize);
-        String poolSizeString = format("Pool Sizes: %5d/%d x %db, %5d/%d x %db, %5d/%d x %db",
-                                       tinyPoolSize,     maxTinyBuffers,     tinyBufferSize, 
-                                       smallPoolSize,    maxSmallBuffers,    smallBufferSize,
-                                       medPoolSize,      maxMedBuffers,      medBufferSize);
-
-        int pooled = mallocsFromTinyPool +
-            mallocsFromSmallPool + 
-            mallocsFromMedPool;
-        int outOfPoolsMallocs = totalMallocs - pooled;
-        String outOfBufferMemoryString = format("Total out of pools mallocs: %d; Bytes allocated: %d", outOfPoolsMallocs, int(bytesAllocated));
-        String purgeString = format("Small Pool Purges: %d; Med Pool Purges: %d", smallPoolPurgeCount, medPoolPurgeCount);
-        return mallocRatioString() + "\n" + poolSizeString + "\n" + outOfBufferMemoryString + "\n" + purgeString;
 
+size_t SystemAlloc::reserve(size_t tinyBlocks, size_t smallBlocks, size_t medBlocks, bool prefault, ReserveKind kind) {
+#ifndef NO_BUFFERPOOL
+    initMem();
+#endif
+    return reservePools(tinyBlocks, smallBlocks, medBlocks, prefault, kind);
+}
+
+
+size_t SystemAlloc::reserveSize(size_t bytes, size_t count, bool prefault, ReserveKind kind) {
+#ifndef NO_BUFFERPOOL
+    initMem();
+#endif
+    return reserveBlocks(bytes, count, prefault, kind);
+}
+
+
+bool SystemAlloc::reserveFromFile(const char* filename) {
+    ReserveConfig config;
+    if (! config.read(filename)) {
+        return false;
     }
-};
+#ifndef NO_BUFFERPOOL
+    initMem();
+#endif
+    config.apply();
+    return true;
+}
 
-// Dynamically allocated because we need to ensure that
-// the buffer pool is still around when the last global variable 
-// is deallocated.
-static BufferPool* bufferpool = nullptr;
 
-String SystemAlloc::mallocStatus() {    
+void SystemAlloc::setPoolLimits(size_t maxSmallBuffers, size_t maxMedBuffers) {
 #ifndef NO_BUFFERPOOL
-    return bufferpool->status();
+    initMem();
+    bufferpool->setPoolLimits(maxSmallBuffers, maxMedBuffers);
 #else
-    return "NO_BUFFERPOOL";
+    (void)maxSmallBuffers;
+    (void)maxMedBuffers;
 #endif
 }
 
 
-void SystemAlloc::resetMallocPerformanceCounters() {
+void SystemAlloc::startProfile() {
 #ifndef NO_BUFFERPOOL
-    bufferpool->totalMallocs         = 0;
-    bufferpool->mallocsFromMedPool   = 0;
-    bufferpool->mallocsFromSmallPool = 0;
-    bufferpool->mallocsFromTinyPool  = 0;
+    initMem();
+    poolProfile.start();
 #endif
 }
 
 
+void SystemAlloc::stopProfile() {
 #ifndef NO_BUFFERPOOL
-inline void initMem() {
-    // Putting the test here ensures that the SystemAlloc is always
-    // initialized, even when globals are being allocated.
-    static bool initialized = false;
-    if (! initialized) {
-        bufferpool = new BufferPool();
-        initialized = true;
+    poolProfile.stop();
+#endif
+}
+
+
+bool SystemAlloc::writeProfile(const char* filename) {
+#ifndef NO_BUFFERPOOL
+    return poolProfile.write(filename);
+#else
+    (void)filename;
+    return false;
+#endif
+}
+
+
+#ifndef NO_BUFFERPOOL
+/** The background thread of SystemAlloc::startScavenger */
+class Scavenger {
+private:
+    /** Serializes start and stop */
+    std::mutex              m_control;
+
+    std::mutex              m_mutex;
+    std::condition_variable m_wake;
+    bool                    m_stop;
+    std::thread             m_thread;
+
+    void run(std::chrono::duration<double> period, uint32 maxIdleEpochs) {
+        std::unique_lock<std::mutex> guard(m_mutex);
+        while (! m_wake.wait_for(guard, period, [this] { return m_stop; })) {
+            guard.unlock();
+            drainRemoteFreeQueues();
+            bufferpool->scavenge(maxIdleEpochs);
+            guard.lock();
+        }
+    }
+
+    /** Requires m_control */
+    void join() {
+        if (m_thread.joinable()) {
+            {
+                std::lock_guard<std::mutex> guard(m_mutex);
+                m_stop = true;
+            }
+            m_wake.notify_all();
+            m_thread.join();
+        }
+    }
+
+public:
+
+    Scavenger() : m_stop(false) {}
+
+    /** Stops the thread at program exit */
+    ~Scavenger() {
+        stop();
+    }
+
+    void start(double periodSeconds, uint32 maxIdleEpochs) {
+        std::lock_guard<std::mutex> control(m_control);
+        join();
+        m_stop = false;
+        m_thread = std::thread(&Scavenger::run, this, std::chrono::duration<double>(periodSeconds), maxIdleEpochs);
+    }
+
+    void stop() {
+        std::lock_guard<std::mutex> control(m_control);
+        join();
+    }
+};
+
+static Scavenger& scavenger() {
+    static Scavenger theScavenger;
+    return theScavenger;
+}
+#endif
+
+
+void SystemAlloc::startScavenger(double maxIdleSeconds, double periodSeconds) {
+#ifndef NO_BUFFERPOOL
+    alwaysAssertM((periodSeconds > 0) && (maxIdleSeconds >= 0), "invalid scavenger times");
+    initMem();
+    uint32 maxIdleEpochs = (uint32)(maxIdleSeconds / periodSeconds);
+    if (maxIdleEpochs * periodSeconds < maxIdleSeconds) {
+        ++maxIdleEpochs;
     }
+    scavenger().start(periodSeconds, maxIdleEpochs);
+#else
+    (void)maxIdleSeconds;
+    (void)periodSeconds;
+#endif
+}
+
+
+void SystemAlloc::stopScavenger() {
+#ifndef NO_BUFFERPOOL
+    scavenger().stop();
+#endif
 }
+
+
+void SystemAlloc::mallocStats(Stats& stats) {
+#ifndef NO_BUFFERPOOL
+    initMem();
+    bufferpool->getStats(stats);
+#else
+    stats = Stats();
 #endif
+}
 
 
 void* SystemAlloc::malloc(size_t bytes) {
 #ifndef NO_BUFFERPOOL
     initMem();
-    return bufferpool->malloc(bytes);
+#   ifndef NO_THREAD_CACHE
+    ThreadCache* cache = threadCache();
+    if (cache != nullptr) {
+        return profileMalloc(cache->malloc(bytes), bytes, MALLOC_BLOCKS);
+    }
+#   endif
+    return profileMalloc(bufferpool->malloc(bytes), bytes, MALLOC_BLOCKS);
 #else
     return ::malloc(bytes);
 #endif
@@ -651,7 +4214,8 @@ void* SystemAlloc::calloc(size_t n, size_t x) {
 void* SystemAlloc::realloc(void* block, size_t bytes) {
 #ifndef NO_BUFFERPOOL
     initMem();
-    return bufferpool->realloc(block, bytes);
+    profileFree(block);
+    return profileMalloc(bufferpool->realloc(block, bytes), bytes, MALLOC_BLOCKS);
 #else
     return ::realloc(block, bytes);
 #endif
@@ -660,6 +4224,14 @@ void* SystemAlloc::realloc(void* block, size_t bytes) {
 
 void SystemAlloc::free(void* p) {
 #ifndef NO_BUFFERPOOL
+    profileFree(p);
+#   ifndef NO_THREAD_CACHE
+    ThreadCache* cache = threadCache();
+    if (cache != nullptr) {
+        cache->free(p);
+        return;
+    }
+#   endif
     bufferpool->free(p);
 #else
     return ::free(p);
@@ -667,6 +4239,184 @@ void SystemAlloc::free(void* p) {
 }
 
 
+void* SystemAlloc::mallocSized(size_t bytes, size_t alignment) {
+    debugAssertM(isPow2((uint32)alignment), "alignment must be a power of 2");
+#ifndef NO_BUFFERPOOL
+    initMem();
+#   ifndef NO_THREAD_CACHE
+    ThreadCache* cache = threadCache();
+    if (cache != nullptr) {
+        return profileMalloc(cache->mallocSized(bytes, alignment), bytes, SIZED_BLOCKS);
+    }
+#   endif
+    return profileMalloc(bufferpool->mallocSized(bytes, alignment), bytes, SIZED_BLOCKS);
+#else
+#   ifdef G3D_WINDOWS
+        return _aligned_malloc(bytes, max(alignment, (size_t)16));
+#   else
+        void* ptr = nullptr;
+        return (posix_memalign(&ptr, max(alignment, sizeof(void*)), bytes) == 0) ? ptr : nullptr;
+#   endif
+#endif
+}
+
+
+void SystemAlloc::freeSized(void* p, size_t bytes, size_t alignment) {
+#ifndef NO_BUFFERPOOL
+    profileFree(p, bytes);
+#   ifndef NO_THREAD_CACHE
+    ThreadCache* cache = threadCache();
+    if (cache != nullptr) {
+        cache->freeSized(p, bytes, alignment);
+        return;
+    }
+#   endif
+    bufferpool->freeSized(p, bytes, alignment);
+#else
+    (void)bytes;
+    (void)alignment;
+#   ifdef G3D_WINDOWS
+        _aligned_free(p);
+#   else
+        ::free(p);
+#   endif
+#endif
+}
+
+
+void* SystemAlloc::mallocNode(size_t bytes) {
+#ifndef NO_BUFFERPOOL
+    initMem();
+#   ifndef NO_THREAD_CACHE
+    ThreadCache* cache = threadCache();
+    if (cache != nullptr) {
+        return profileMalloc(cache->mallocNode(bytes), bytes, SIZED_BLOCKS);
+    }
+#   endif
+    return profileMalloc(bufferpool->mallocNode(bytes), bytes, SIZED_BLOCKS);
+#else
+    return mallocSized(bytes);
+#endif
+}
+
+
+void SystemAlloc::freeNode(void* p, size_t bytes) {
+#ifndef NO_BUFFERPOOL
+    profileFree(p, bytes);
+#   ifndef NO_THREAD_CACHE
+    ThreadCache* cache = threadCache();
+    if (cache != nullptr) {
+        cache->freeNode(p, bytes);
+        return;
+    }
+#   endif
+    bufferpool->freeNode(p, bytes);
+#else
+    freeSized(p, bytes);
+#endif
+}
+
+
+size_t SystemAlloc::usableSize(const void* p, size_t bytes, size_t alignment) {
+#ifndef NO_BUFFERPOOL
+    initMem();
+    return bufferpool->usableSizeSized(const_cast<void*>(p), bytes, alignment);
+#else
+    (void)p;
+    (void)alignment;
+    return bytes;
+#endif
+}
+
+
+void* SystemAlloc::reallocSized(void* p, size_t oldBytes, size_t bytes, size_t alignment) {
+    if (p == nullptr) {
+        return mallocSized(bytes, alignment);
+    }
+    if ((bytes >= oldBytes) && (bytes <= usableSize(p, oldBytes, alignment))) {
+        return p;
+    }
+
+#ifndef NO_BUFFERPOOL
+    void* remapped = bufferpool->remapSized(p, oldBytes, bytes, alignment);
+    if (remapped != nullptr) {
+        profileFree(p, oldBytes);
+        return profileMalloc(remapped, bytes, SIZED_BLOCKS);
+    }
+#endif
+
+    void* newPtr = mallocSized(bytes, alignment);
+    if (newPtr == nullptr) {
+        return nullptr;
+    }
+    SystemAlloc::memcpy(newPtr, p, (oldBytes < bytes) ? oldBytes : bytes);
+    freeSized(p, oldBytes, alignment);
+    return newPtr;
+}
+
+
+void SystemAlloc::mallocBatch(const size_t* sizes, size_t count, void** out) {
+#ifndef NO_BUFFERPOOL
+    initMem();
+    mallocMany(sizes, count, out, false);
+    if (poolProfile.recording()) {
+        for (size_t i = 0; i < count; ++i) {
+            poolProfile.recordMalloc(out[i], sizes[i], MALLOC_BLOCKS);
+        }
+    }
+#else
+    for (size_t i = 0; i < count; ++i) {
+        out[i] = ::malloc(sizes[i]);
+    }
+#endif
+}
+
+
+void SystemAlloc::freeBatch(void** ptrs, size_t count) {
+#ifndef NO_BUFFERPOOL
+    for (size_t i = 0; (i < count) && poolProfile.recording(); ++i) {
+        profileFree(ptrs[i]);
+    }
+    freeMany(ptrs, count, nullptr);
+#else
+    for (size_t i = 0; i < count; ++i) {
+        ::free(ptrs[i]);
+    }
+#endif
+}
+
+
+void SystemAlloc::mallocSizedBatch(const size_t* sizes, size_t count, void** out) {
+#ifndef NO_BUFFERPOOL
+    initMem();
+    mallocMany(sizes, count, out, true);
+    if (poolProfile.recording()) {
+        for (size_t i = 0; i < count; ++i) {
+            poolProfile.recordMalloc(out[i], sizes[i], SIZED_BLOCKS);
+        }
+    }
+#else
+    for (size_t i = 0; i < count; ++i) {
+        out[i] = mallocSized(sizes[i]);
+    }
+#endif
+}
+
+
+void SystemAlloc::freeSizedBatch(void** ptrs, const size_t* sizes, size_t count) {
+#ifndef NO_BUFFERPOOL
+    for (size_t i = 0; (i < count) && poolProfile.recording(); ++i) {
+        profileFree(ptrs[i], sizes[i]);
+    }
+    freeMany(ptrs, count, sizes);
+#else
+    for (size_t i = 0; i < count; ++i) {
+        freeSized(ptrs[i], sizes[i]);
+    }
+#endif
+}
+
+
 void* SystemAlloc::alignedMalloc(size_t bytes, size_t alignment) {
 
     alwaysAssertM(isPow2((uint32)alignment), "alignment must be a power of 2");
@@ -751,6 +4501,51 @@ void SystemAlloc::alignedFree(void* _ptr) {
 }
 
 
+////////////////////////////////////////////////////////////////
+// PoolHeap
+
+PoolHeap::PoolHeap(Threading threading) : m_pool(new BufferPool(true, threading == SYNCHRONIZED)), m_threading(threading) {
+}
+
+PoolHeap::~PoolHeap() {
+    delete m_pool;
+}
+
+void* PoolHeap::malloc(size_t bytes) {
+    return m_pool->malloc(bytes);
+}
+
+void* PoolHeap::realloc(void* block, size_t bytes) {
+    return m_pool->realloc(block, bytes);
+}
+
+void PoolHeap::free(void* p) {
+    m_pool->free(p);
+}
+
+void* PoolHeap::mallocSized(size_t bytes, size_t alignment) {
+    debugAssertM(isPow2((uint32)alignment), "alignment must be a power of 2");
+    return m_pool->mallocSized(bytes, alignment);
+}
+
+void PoolHeap::freeSized(void* p, size_t bytes, size_t alignment) {
+    m_pool->freeSized(p, bytes, alignment);
+}
+
+void PoolHeap::release() {
+    delete m_pool;
+    m_pool = new BufferPool(true, m_threading == SYNCHRONIZED);
+}
+
+size_t PoolHeap::trim(size_t targetBytes) {
+    return m_pool->trim(targetBytes);
+}
+
+String PoolHeap::mallocStatus() const {
+    return m_pool->status();
+}
+
+
 void SystemAlloc::memcpy(void* dst, const void* src, size_t numBytes) {
     ::memcpy(dst, src, numBytes);
 }
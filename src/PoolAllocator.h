@@ -22,11 +22,18 @@
 
 // OPEN TODO::: mrkkrj ???
 #include <string>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <type_traits>
 #define String std::string
 
 // OPEN TODO::: mrkkrj ???
 #define uint8 std::uint8_t
+#define uint16 std::uint16_t
 #define uint32 std::uint32_t
+#define int64 std::int64_t
+#define uint64 std::uint64_t
 
 
 //
@@ -35,6 +42,8 @@
 
 namespace G3D {
 
+class BufferPool;
+
 class SystemAlloc {
 public:
     /**
@@ -49,6 +58,144 @@ public:
      */
     typedef bool (*OutOfMemoryCallback)(size_t size, bool recoverable);
 
+    /**
+       Snapshot of the counters of the buffer pools behind SystemAlloc::malloc, see mallocStats().
+
+       Plain data, so that it can be polled without allocating. The counters are read without 
+       taking the lock, so the fields are not exactly consistent with each other, and counts 
+       gathered by other threads' caches may lag by up to one batch of allocations.
+     */
+    class Stats {
+    public:
+        /** Pools by block size: tiny (<= 256 bytes), small (<= 2 KB), medium (<= 8 KB) and 
+            large blocks, which come from the buddy heap (up to 1 MB) or the heap. */
+        enum {TINY_POOL, SMALL_POOL, MED_POOL, LARGE_BLOCKS, numPools};
+
+        /** Size classes of the tiny pool: 16 << c bytes for the first numPow2TinyClasses, followed by the 
+            node classes of mallocNode for the other multiples of 16 bytes, see tinyClassBytes() */
+        enum {numPow2TinyClasses = 5, numTinyClasses = 16};
+
+        /** Bins of the small and medium pools */
+        enum {numBins = 20};
+
+        /** Buckets of mallocSizeHistogram */
+        enum {numSizeBuckets = 18};
+
+        /** Block sizes of the buddy heap: 16 KB << order, up to 1 MB, see buddyBlockBytes() */
+        enum {numBuddyOrders = 7};
+
+        /** Pages backing the tiny heap, see HUGE_PAGES in PoolAllocator.cpp: regular pages, 
+            transparent huge pages, or regular pages because huge pages were requested but 
+            are not available */
+        enum PageMode {REGULAR_PAGE_MODE, HUGE_PAGE_MODE, HUGE_PAGE_MODE_UNAVAILABLE};
+
+        uint64  totalMallocs;
+        uint64  mallocsFromTinyPool;
+        uint64  mallocsFromSmallPool;
+        uint64  mallocsFromMedPool;
+
+        /** Blocks of more than 8 KB and up to 1 MB served by the buddy heap (counted as large blocks otherwise) */
+        uint64  mallocsFromBuddyHeap;
+
+        /** Bytes held by the application, rounded up to the size of the blocks */
+        uint64  bytesInUse[numPools];
+
+        /** Free blocks held by each pool (LARGE_BLOCKS is always zero) */
+        uint64  buffersFree[numPools];
+
+        /** Free blocks held by the per-thread caches in front of each pool */
+        uint64  buffersInThreadCaches[numPools];
+
+        /** Tiny buffers freed by another thread than the one owning their chunk and handed
+            back to the owner's cache without taking the pool's lock */
+        uint64  remoteFrees;
+
+        uint64  tinyClassBuffersInUse[numTinyClasses];
+        uint64  tinyClassBuffersFree[numTinyClasses];
+        uint64  tinyClassChunks[numTinyClasses];
+
+        uint64  binBuffersFree[numBins];
+
+        uint64  tinyHeapBytesCarved;
+        uint64  tinyHeapBytesReserved;
+        PageMode tinyHeapPages;
+
+        /** Most free blocks the small and medium pools hold, see setPoolLimits() */
+        uint64  maxSmallBuffers;
+        uint64  maxMedBuffers;
+
+        /** Times a block was freed into the full small or medium pool, and the blocks evicted 
+            from the pool to the heap to make room, the largest and longest unused first */
+        uint64  smallPoolPurges;
+        uint64  medPoolPurges;
+        uint64  smallPoolEvictions;
+        uint64  medPoolEvictions;
+
+        /** Bytes returned to the OS by trim() and the scavenger since the start of the program */
+        uint64  bytesTrimmed;
+
+        /** Chunks of the tiny heap whose pages are currently returned to the OS */
+        uint64  tinyHeapBytesDecommitted;
+
+        /** Large blocks of at least 64 KB are mapped directly from the OS as extents. Bytes 
+            currently mapped, including the extents held in the cache of freed extents */
+        uint64  extentBytesMapped;
+        uint64  extentBytesCached;
+
+        /** Large blocks served from the extent cache without a system call */
+        uint64  extentCacheHits;
+
+        /** Large blocks grown or shrunk by SystemAlloc::realloc by remapping their pages instead of copying */
+        uint64  extentRemaps;
+
+        /** Buddy blocks in use (also counted in bytesInUse[LARGE_BLOCKS]) and the bytes requested 
+            for them; the difference is the internal fragmentation of the buddy heap */
+        uint64  buddyBytesInUse;
+        uint64  buddyBytesRequested;
+
+        /** Committed chunks of the buddy heap, and the bytes of their free blocks */
+        uint64  buddyBytesCommitted;
+        uint64  buddyBytesFree;
+
+        /** Free buddy blocks of each order and the size of the largest. Free blocks of the largest 
+            order are whole chunks; the rest of buddyBytesFree is the external fragmentation. */
+        uint64  buddyBlocksFree[numBuddyOrders];
+        uint64  buddyLargestFreeBlock;
+
+        /** Blocks split by allocations and merged by frees and realloc, since the start of the program */
+        uint64  buddySplits;
+        uint64  buddyMerges;
+
+        /** Acquisitions of the pool's lock (see G3D::Spinlock), those that found it held, those 
+            that had to park the thread, and the time spent waiting. Allocations served by the 
+            per-thread caches do not take the lock. */
+        uint64  lockAcquisitions;
+        uint64  lockContended;
+        uint64  lockParked;
+        uint64  lockWaitNanoseconds;
+
+        /** Bytes currently obtained from ::malloc, including the headers and the free blocks 
+            held by the small and medium pools. Primarily useful for detecting leaks. */
+        uint64  heapBytesAllocated;
+
+        /** Number of mallocs of up to sizeBucketLimit(b) bytes (and more than sizeBucketLimit(b - 1)) */
+        uint64  mallocSizeHistogram[numSizeBuckets];
+
+        /** Largest request counted in bucket \a b of mallocSizeHistogram */
+        static inline size_t sizeBucketLimit(int b) {
+            return (b == numSizeBuckets - 1) ? ~(size_t)0 : ((size_t)16 << b);
+        }
+
+        /** Bucket of mallocSizeHistogram counting requests of \a bytes */
+        static int sizeBucket(size_t bytes);
+
+        /** Size of the buffers in tiny class \a c */
+        static size_t tinyClassBytes(int c);
+
+        /** Size of the buddy blocks of \a order */
+        static size_t buddyBlockBytes(int order);
+    };
+
 private:
 
     OutOfMemoryCallback m_outOfMemoryCallback;
@@ -93,6 +240,77 @@ public:
      */
     static void free(void* p);
 
+    /**
+     Like malloc, but without the 16 byte size header in front of small, medium and 
+     large blocks; the caller keeps track of the size instead, as C++ allocators do.
+     Saves the header's memory and reading it back on free.
+
+     The result is aligned to \a alignment, a power of two. Alignments up to 16 cost
+     nothing. Up to 64 (e.g. for SIMD buffers or cache line aligned data), small requests 
+     are served by tiny buffers of at least \a alignment bytes, which are aligned to their 
+     size, and larger ones by pools of aligned blocks. Larger alignments are supported, 
+     but bypass the small and medium pools.
+
+     The result must be freed with freeSized, passing the same \a bytes and \a alignment. 
+     It must not be passed to free or realloc.
+     */
+    static void* mallocSized(size_t bytes, size_t alignment = 16);
+
+    /** Free data allocated with mallocSized(\a bytes, \a alignment). */
+    static void freeSized(void* p, size_t bytes, size_t alignment = 16);
+
+    /**
+     Allocates a block for a single object of \a bytes, e.g. a node of std::map, std::list or 
+     std::unordered_map, 16 byte aligned. Up to 256 bytes, the tiny pool serves it from a 
+     class of exactly \a bytes rounded up to a multiple of 16, instead of the next power of two 
+     as for mallocSized; larger blocks come from mallocSized.
+
+     The result must be freed with freeNode, passing the same \a bytes.
+     */
+    static void* mallocNode(size_t bytes);
+
+    /** Free data allocated with mallocNode(\a bytes). */
+    static void freeNode(void* p, size_t bytes);
+
+    /**
+     Bytes that the block \a p of mallocSized(\a bytes, \a alignment) can hold, i.e. the size of 
+     its tiny class, bin or extent. It may be used up to that size, and freeSized and reallocSized 
+     accept any size from \a bytes up to it.
+     */
+    static size_t usableSize(const void* p, size_t bytes, size_t alignment = 16);
+
+    /**
+     Like realloc, for a block \a p of mallocSized(\a oldBytes, \a alignment). Returns \a p if the 
+     block can hold \a bytes (see usableSize) and remaps large blocks where possible; otherwise, 
+     and whenever \a bytes is less than \a oldBytes, moves the contents to a new block. The result must be freed with freeSized(\a bytes). 
+     Returns nullptr, leaving \a p allocated, on failure.
+     */
+    static void* reallocSized(void* p, size_t oldBytes, size_t bytes, size_t alignment = 16);
+
+    /**
+     Allocates \a count blocks of \a sizes[i] bytes into \a out[i], as if by malloc. 
+     Blocks the calling thread has cached are used first; all others are taken from the 
+     buffer pool under a single lock instead of refilling the cache block by block. 
+     Large blocks come from the heap as usual. 
+     Entries of \a out are nullptr where the allocation failed.
+
+     The lock is held while the whole batch is served, so split very large batches 
+     in programs where other threads allocate at the same time.
+     */
+    static void mallocBatch(const size_t* sizes, size_t count, void** out);
+
+    /** Frees \a count blocks allocated by malloc or mallocBatch. Blocks that do not fit into the 
+        calling thread's cache are returned to the buffer pool under a single lock. Null 
+        entries are skipped. Overwrites the contents of \a ptrs. */
+    static void freeBatch(void** ptrs, size_t count);
+
+    /** Like mallocBatch, for blocks without size header that must be freed with 
+        freeSized or freeSizedBatch (16 byte aligned, see mallocSized). */
+    static void mallocSizedBatch(const size_t* sizes, size_t count, void** out);
+
+    /** Like freeBatch, for blocks allocated by mallocSized(\a sizes[i]) or mallocSizedBatch. */
+    static void freeSizedBatch(void** ptrs, const size_t* sizes, size_t count);
+
     /**
        Guarantees that the start of the array is aligned to the 
        specified number of bytes.
@@ -138,17 +356,159 @@ public:
        optimizing SystemAlloc::malloc, and describing how well SystemAlloc::malloc is using
         its internal pooled storage.  "heap" memory was slow to
         allocate; the other data sizes are comparatively fast.
+
+       Formats mallocStats(); use that to monitor the allocator without allocating.
      */
     static String mallocStatus();
 
+    /** Fills \a stats with the current counters of the buffer pools without taking their 
+        lock. Does not allocate. */
+    static void mallocStats(Stats& stats);
+
+    /** Formats \a stats as mallocStatus() does */
+    static String formatMallocStats(const Stats& stats);
+
     static void resetMallocPerformanceCounters();
+
+    /** 
+     Returns free memory held by the buffer pools to the operating system until at most 
+     \a targetBytes remain in free blocks: small and medium blocks are freed to the heap 
+     (and the C library is asked to release them), chunks of the tiny heap whose buffers 
+     are all free are decommitted.
+
+     The pools normally keep freed blocks until they overflow. Call trim() e.g. after a 
+     load spike. The calling thread's cache is drained first; the caches of other threads 
+     are not touched.
+
+     @return The number of bytes released
+     */
+    static size_t trim(size_t targetBytes = 0);
+
+    /** 
+     Starts a background thread that every \a periodSeconds releases (as trim() does) 
+     the free blocks and tiny heap chunks that have not been reused for \a maxIdleSeconds.
+     Ages are measured in whole periods. Restarts the thread if it is already running.
+
+     \sa Stats::bytesTrimmed
+     */
+    static void startScavenger(double maxIdleSeconds = 30.0, double periodSeconds = 1.0);
+
+    /** Stops the thread started by startScavenger() and waits for it to exit */
+    static void stopScavenger();
+
+    /** Blocks that reserve() and reserveSize() add to the small and medium pools, which keep 
+        the blocks with and without size header apart */
+    enum ReserveKind {
+        /** Blocks of mallocSized, i.e. of g3d_pool_allocator and g3d_buffer_pool_resource */
+        SIZED_BLOCKS,
+
+        /** Blocks of malloc, i.e. of realloc and of the operator new of PoolOperatorNew.h */
+        MALLOC_BLOCKS
+    };
+
+    /** 
+     Fills the pools up front, so that the first requests after startup neither miss the 
+     pools nor fault in fresh pages: the tiny heap chunks for \a tinyBlocks buffers of up to
+     256 bytes are committed, and \a smallBlocks blocks (<= 2 KB) and \a medBlocks blocks 
+     (<= 8 KB) are spread evenly over the bins of the small and medium pools, up to the 
+     pools' limits. With \a prefault, the pages of all of them are touched so that the OS 
+     backs them right away.
+
+     The small and medium blocks are those of \a kind, see ReserveKind. The tiny buffers 
+     serve both kinds. They are ordinary free blocks, which trim() and the scavenger release 
+     when they stay unused.
+
+     @return The number of bytes reserved
+     */
+    static size_t reserve(size_t tinyBlocks, size_t smallBlocks, size_t medBlocks, bool prefault = true, ReserveKind kind = SIZED_BLOCKS);
+
+    /** Like reserve, for \a count blocks of mallocSized(\a bytes), or of malloc(\a bytes) for 
+        MALLOC_BLOCKS. Blocks over 8 KB are not pooled. */
+    static size_t reserveSize(size_t bytes, size_t count, bool prefault = true, ReserveKind kind = SIZED_BLOCKS);
+
+    /** 
+     Calls setPoolLimits, reserve and reserveSize as given by the config file \a filename:
+
+         # setPoolLimits(60000, 8000)
+         maxSmallBuffers = 60000
+         maxMedBuffers   = 8000
+         # reserve(100000, 1200, 400, true)
+         tinyBlocks  = 100000
+         smallBlocks = 1200
+         medBlocks   = 400
+         prefault    = 1
+         # reserveSize(4096, 500)
+         blocks.4096 = 500
+         # reserve(0, 3000, 200, true, MALLOC_BLOCKS)
+         mallocSmallBlocks = 3000
+         mallocMedBlocks   = 200
+         # reserveSize(48, 10000, true, MALLOC_BLOCKS)
+         mallocBlocks.48 = 10000
+
+     The file named by the environment variable G3D_POOL_CONFIG is applied when the buffer 
+     pool is created, i.e. before the first allocation. writeProfile() writes such a file
+     for the workload of a recorded run.
+
+     @return false if the file cannot be read or has an invalid line; nothing is reserved then
+     */
+    static bool reserveFromFile(const char* filename);
+
+    /** 
+     Sets the most free blocks the small (<= 2 KB) and medium (<= 8 KB) pools hold, 40000 and 
+     5000 by default. A block freed into a full pool evicts older blocks to the heap (see 
+     Stats::smallPoolEvictions), so workloads that free more blocks at once and allocate them 
+     again, e.g. per frame or per request, fall through to ::malloc unless the limits fit them. 
+     A limit of 0 is left as it is. A pool above a lowered limit shrinks as blocks are freed.
+     */
+    static void setPoolLimits(size_t maxSmallBuffers, size_t maxMedBuffers);
+
+    /** 
+     Starts recording the sizes and lifetimes of the blocks allocated from now on, for 
+     writeProfile(). Restarts the recording if it is already running. While recording, 
+     each malloc and free costs a few atomic adds on counters shared by all threads.
+
+     If the environment variable G3D_POOL_PROFILE names a file, recording starts when the 
+     buffer pool is created and the profile is written to that file at exit.
+     */
+    static void startProfile();
+
+    /** Stops the recording of startProfile(). The profile is kept for writeProfile(). */
+    static void stopProfile();
+
+    /** 
+     Writes the profile recorded since startProfile() as a config file for reserveFromFile(), 
+     so that later runs of the same workload start out with the pools it needs: the peak 
+     numbers of live small and medium blocks, plus 25%, as the pool limits, and the peak 
+     number of live blocks of each tiny class and bin reserved, as blocks of mallocSized or of 
+     malloc (blocks.<n> and mallocBlocks.<n>, see reserveSize) like they were allocated. The mallocs, peak live blocks and mean lifetime of each block size are 
+     listed in comments.
+
+     @return false if the file cannot be written
+     */
+    static bool writeProfile(const char* filename);
 };
 
 
+#ifdef __cpp_lib_allocate_at_least
+using std::allocation_result;
+#else
+/** Like C++23 std::allocation_result: storage for \a count objects at \a ptr, returned by allocate_at_least() */
+template<class Pointer>
+struct allocation_result {
+    Pointer     ptr;
+    std::size_t count;
+};
+#endif
+
 /** 
  \brief Implementation of a C++ Allocator (for example std::allocator) that uses G3D::SystemAlloc::malloc and G3D::SystemAlloc::free. 
 
- All instances of g3d_pool_allocator are stateless.
+ All instances of g3d_pool_allocator are stateless and compare equal, so containers may be given 
+ any of them and rebind it to their node types.
+
+ Single objects of up to 256 bytes, e.g. the nodes that std::map, std::list or std::unordered_map 
+ allocate through the rebound allocator, get blocks that fit them exactly from the tiny pool's 
+ node classes (see G3D::SystemAlloc::mallocNode).
 
  mrkkrj: renamed g3d_allocator to g3d_pool_allocator as to enable parallel usage (!)
 
@@ -157,17 +517,210 @@ public:
 template<class T>
 class g3d_pool_allocator {
 public:
-    /** Allocates n * sizeof(T) bytes of uninitialized storage by calling G3D::SystemAlloc::malloc() */
+    typedef T               value_type;
+    typedef std::true_type  propagate_on_container_move_assignment;
+    typedef std::true_type  is_always_equal;
+
+    template<class U>
+    struct rebind {
+        typedef g3d_pool_allocator<U> other;
+    };
+
+    /** Whether allocate(1) takes a block of the exact size from SystemAlloc::mallocNode */
+    static constexpr bool isNodeSized = (sizeof(T) <= 256) && (alignof(T) <= 16);
+
+    constexpr g3d_pool_allocator() noexcept {}
+
+    template<class U>
+    constexpr g3d_pool_allocator(const g3d_pool_allocator<U>&) noexcept {}
+
+    /** Allocates n * sizeof(T) bytes of uninitialized storage, aligned for T, by calling G3D::SystemAlloc::mallocSized(), 
+        or G3D::SystemAlloc::mallocNode() for a single node sized object */
     [[nodiscard]] constexpr T* allocate(std::size_t n) {
-        return static_cast<T*>(SystemAlloc::malloc(sizeof(T) * n));
+        if (isNodeSized && (n == 1)) {
+            return static_cast<T*>(SystemAlloc::mallocNode(sizeof(T)));
+        }
+        return static_cast<T*>(SystemAlloc::mallocSized(sizeof(T) * n, alignof(T)));
     }
 
-    /** Deallocates the storage referenced by the pointer p, which must be a pointer obtained by an earlier call to allocate() */
+    /** Like allocate(n), but returns all objects that the pool's block can hold, n or more (see 
+        G3D::SystemAlloc::usableSize()), like C++23 std::allocator::allocate_at_least(). The storage 
+        must be deallocated with the returned count. */
+    [[nodiscard]] allocation_result<T*> allocate_at_least(std::size_t n) {
+        T* p = allocate(n);
+        if (p == nullptr) {
+            return {p, 0};
+        } else if (isNodeSized && (n == 1)) {
+            // Node blocks fit exactly
+            return {p, 1};
+        }
+        return {p, SystemAlloc::usableSize(p, sizeof(T) * n, alignof(T)) / sizeof(T)};
+    }
+
+    /** Deallocates the storage referenced by the pointer p, which must be a pointer obtained by an earlier call to allocate(n) */
     constexpr void deallocate(T* p, std::size_t n) {
-        SystemAlloc::free(p);
+        if (isNodeSized && (n == 1)) {
+            SystemAlloc::freeNode(p, sizeof(T));
+            return;
+        }
+        SystemAlloc::freeSized(p, sizeof(T) * n, alignof(T));
+    }
+
+    /** Returns true if the storage p of allocate(n) can hold newN objects without moving, see 
+        G3D::SystemAlloc::usableSize(). It must then be deallocated with newN. */
+    bool try_expand_in_place(T* p, std::size_t n, std::size_t newN) {
+        if (isNodeSized && (n == 1)) {
+            return newN == 1;
+        }
+        return (newN >= n) && (sizeof(T) * newN <= SystemAlloc::usableSize(p, sizeof(T) * n, alignof(T)));
+    }
+
+    /** Resizes the storage p of allocate(n) to newN objects by calling G3D::SystemAlloc::reallocSized(), 
+        moving its bytes if necessary. Returns nullptr, leaving p allocated, on failure. */
+    T* reallocate(T* p, std::size_t n, std::size_t newN) {
+        if (isNodeSized && ((n == 1) || (newN == 1))) {
+            // Node blocks come from another pool than arrays
+            T* q = allocate(newN);
+            if (q != nullptr) {
+                std::memcpy(q, p, sizeof(T) * ((n < newN) ? n : newN));
+                deallocate(p, n);
+            }
+            return q;
+        }
+        return static_cast<T*>(SystemAlloc::reallocSized(p, sizeof(T) * n, sizeof(T) * newN, alignof(T)));
     }
 };
 
+
+/** 
+ \brief An isolated set of buffer pools, managed like the ones behind G3D::SystemAlloc::malloc.
+
+ Memory allocated from a PoolHeap must be freed to the same PoolHeap. All of it can be
+ released in one call, which suits data with a common lifetime, e.g. the asset names of 
+ a level. Unlike SystemAlloc::malloc, a PoolHeap has no per-thread caches, so every call
+ takes the heap's lock.
+
+ The address space of the heap's tiny buffers and buddy blocks is only reserved when it 
+ first allocates one, so an application can create many heaps.
+
+ Threadsafe, unless constructed as UNSYNCHRONIZED.
+
+ \sa G3D::g3d_heap_allocator, g3d_pool_heap_resource
+*/
+class PoolHeap {
+public:
+
+    /** 
+     An UNSYNCHRONIZED heap (like std::pmr::unsynchronized_pool_resource) takes no lock, 
+     for subsystems whose strings and containers are owned by a single thread, e.g. a render 
+     or script thread. It must only be used by the thread that first allocates from it (until 
+     release()), which debug builds assert; it may be constructed and destroyed on another one.
+     */
+    enum Threading {SYNCHRONIZED, UNSYNCHRONIZED};
+
+private:
+
+    BufferPool* m_pool;
+
+    Threading   m_threading;
+
+    PoolHeap(const PoolHeap&) = delete;
+    PoolHeap& operator=(const PoolHeap&) = delete;
+
+public:
+
+    explicit PoolHeap(Threading threading = SYNCHRONIZED);
+
+    /** Releases all memory allocated from this heap */
+    ~PoolHeap();
+
+    void* malloc(size_t bytes);
+
+    void* realloc(void* block, size_t bytes);
+
+    /** Free data allocated with malloc or realloc on this heap. */
+    void free(void* p);
+
+    /** Like malloc, for a block aligned to \a alignment (a power of 2) whose size the caller
+        passes to freeSized instead of it being stored. \sa SystemAlloc::mallocSized */
+    void* mallocSized(size_t bytes, size_t alignment = 16);
+
+    /** Free data allocated with mallocSized(\a bytes, \a alignment) on this heap. */
+    void freeSized(void* p, size_t bytes, size_t alignment = 16);
+
+    /** Frees all memory allocated from this heap at once, whether or not it has been 
+        freed. Every pointer into the heap becomes invalid; objects living in the heap 
+        must not be used, or destroyed in a way that frees their memory, afterwards. */
+    void release();
+
+    /** \sa SystemAlloc::trim */
+    size_t trim(size_t targetBytes = 0);
+
+    /** \sa SystemAlloc::mallocStatus */
+    String mallocStatus() const;
+};
+
+
+/** 
+ \brief Implementation of a C++ Allocator that allocates from a G3D::PoolHeap.
+
+ Unlike g3d_pool_allocator, instances are stateful: two allocators are equal if 
+ they refer to the same heap, and the heap propagates along with the contents 
+ of a container on copy and move assignment and on swap.
+
+ \sa G3D::PoolHeap
+*/
+template<class T>
+class g3d_heap_allocator {
+private:
+    PoolHeap* m_heap;
+
+public:
+    typedef T               value_type;
+    typedef std::true_type  propagate_on_container_copy_assignment;
+    typedef std::true_type  propagate_on_container_move_assignment;
+    typedef std::true_type  propagate_on_container_swap;
+    typedef std::false_type is_always_equal;
+
+    explicit constexpr g3d_heap_allocator(PoolHeap& heap) noexcept : m_heap(&heap) {}
+
+    template<class U>
+    constexpr g3d_heap_allocator(const g3d_heap_allocator<U>& other) noexcept : m_heap(other.heap()) {}
+
+    /** Allocates n * sizeof(T) bytes of uninitialized storage by calling G3D::PoolHeap::malloc() */
+    [[nodiscard]] T* allocate(std::size_t n) {
+        return static_cast<T*>(m_heap->malloc(sizeof(T) * n));
+    }
+
+    /** Deallocates the storage referenced by the pointer p, which must be a pointer obtained by an earlier call to allocate() */
+    void deallocate(T* p, std::size_t n) {
+        (void)n;
+        m_heap->free(p);
+    }
+
+    /** Resizes the storage p of allocate(n) to newN objects by calling G3D::PoolHeap::realloc(), 
+        which keeps p if its block is large enough */
+    T* reallocate(T* p, std::size_t n, std::size_t newN) {
+        (void)n;
+        return static_cast<T*>(m_heap->realloc(p, sizeof(T) * newN));
+    }
+
+    constexpr PoolHeap* heap() const noexcept {
+        return m_heap;
+    }
+};
+
+// Found by argument-dependent lookup, so that std containers see them
+template< class T1, class T2 >
+constexpr bool operator==( const g3d_heap_allocator<T1>& lhs, const g3d_heap_allocator<T2>& rhs ) noexcept {
+    return lhs.heap() == rhs.heap();
+}
+
+template< class T1, class T2 >
+constexpr bool operator!=( const g3d_heap_allocator<T1>& lhs, const g3d_heap_allocator<T2>& rhs ) noexcept {
+    return lhs.heap() != rhs.heap();
+}
+
 } // namespace G3D
 
 // https://en.cppreference.com/w/cpp/memory/allocator/operator_cmp
@@ -176,4 +729,9 @@ constexpr bool operator==( const G3D::g3d_pool_allocator<T1>& lhs, const G3D::g3
     return true;
 }
 
+template< class T1, class T2 >
+constexpr bool operator!=( const G3D::g3d_pool_allocator<T1>& lhs, const G3D::g3d_pool_allocator<T2>& rhs ) noexcept {
+    return false;
+}
+
 #endif
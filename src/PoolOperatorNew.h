@@ -0,0 +1,162 @@
+/**
+  \file PoolOperatorNew.h
+
+  \brief Replaces the global operator new and operator delete with G3D::SystemAlloc
+
+  mrkkrj: opt-in, so that std::string, std::vector, std::function etc. allocate from the
+          buffer pools too. Include this header in exactly one source file of the program
+          (or configure CMake with -DReplaceOperatorNew=ON for SimdStringTest).
+*/
+
+#ifndef G3D_PoolOperatorNew_h
+#define G3D_PoolOperatorNew_h
+
+#include <cstddef>
+#include <new>
+
+#include "PoolAllocator.h"
+
+
+namespace G3D {
+
+/** Blocks of SystemAlloc::malloc are aligned to this many bytes; operator new with a
+    larger alignment uses SystemAlloc::alignedMalloc. */
+enum {poolNewAlignment = 16};
+
+/**
+ Allocates like the global operator new, from SystemAlloc: calls the new handler until the
+ request can be served, and throws std::bad_alloc if there is none.
+
+ Blocks always carry SystemAlloc::malloc's size header, since code compiled without sized
+ deallocation frees them with the unsized operator delete.
+
+ SystemAlloc creates its pool on first use, so objects constructed before static
+ initialization has finished may allocate as well.
+ */
+inline void* poolOperatorNew(std::size_t bytes, std::size_t alignment = poolNewAlignment) {
+    if (bytes == 0) {
+        // Each call must return a distinct pointer
+        bytes = 1;
+    }
+
+    for (;;) {
+        void* ptr = (alignment <= poolNewAlignment) ? SystemAlloc::malloc(bytes) : SystemAlloc::alignedMalloc(bytes, alignment);
+        if (ptr != nullptr) {
+            return ptr;
+        }
+
+        std::new_handler handler = std::get_new_handler();
+        if (handler == nullptr) {
+            throw std::bad_alloc();
+        }
+        handler();
+    }
+}
+
+/** Like poolOperatorNew, but returns nullptr instead of throwing */
+inline void* poolOperatorNewNothrow(std::size_t bytes, std::size_t alignment = poolNewAlignment) noexcept {
+    try {
+        return poolOperatorNew(bytes, alignment);
+    } catch (...) {
+        return nullptr;
+    }
+}
+
+/** Frees a block of poolOperatorNew with the same \a alignment */
+inline void poolOperatorDelete(void* ptr, std::size_t alignment = poolNewAlignment) noexcept {
+    if (ptr == nullptr) {
+        return;
+    }
+    if (alignment <= poolNewAlignment) {
+        SystemAlloc::free(ptr);
+    } else {
+        SystemAlloc::alignedFree(ptr);
+    }
+}
+
+} // namespace G3D
+
+
+// Replacement functions must not be inline, see [replacement.functions]
+
+void* operator new(std::size_t bytes) {
+    return G3D::poolOperatorNew(bytes);
+}
+
+void* operator new[](std::size_t bytes) {
+    return G3D::poolOperatorNew(bytes);
+}
+
+void* operator new(std::size_t bytes, const std::nothrow_t&) noexcept {
+    return G3D::poolOperatorNewNothrow(bytes);
+}
+
+void* operator new[](std::size_t bytes, const std::nothrow_t&) noexcept {
+    return G3D::poolOperatorNewNothrow(bytes);
+}
+
+void* operator new(std::size_t bytes, std::align_val_t alignment) {
+    return G3D::poolOperatorNew(bytes, (std::size_t)alignment);
+}
+
+void* operator new[](std::size_t bytes, std::align_val_t alignment) {
+    return G3D::poolOperatorNew(bytes, (std::size_t)alignment);
+}
+
+void* operator new(std::size_t bytes, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    return G3D::poolOperatorNewNothrow(bytes, (std::size_t)alignment);
+}
+
+void* operator new[](std::size_t bytes, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    return G3D::poolOperatorNewNothrow(bytes, (std::size_t)alignment);
+}
+
+void operator delete(void* ptr) noexcept {
+    G3D::poolOperatorDelete(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+    G3D::poolOperatorDelete(ptr);
+}
+
+void operator delete(void* ptr, const std::nothrow_t&) noexcept {
+    G3D::poolOperatorDelete(ptr);
+}
+
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept {
+    G3D::poolOperatorDelete(ptr);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept {
+    G3D::poolOperatorDelete(ptr);
+}
+
+void operator delete[](void* ptr, std::size_t) noexcept {
+    G3D::poolOperatorDelete(ptr);
+}
+
+void operator delete(void* ptr, std::align_val_t alignment) noexcept {
+    G3D::poolOperatorDelete(ptr, (std::size_t)alignment);
+}
+
+void operator delete[](void* ptr, std::align_val_t alignment) noexcept {
+    G3D::poolOperatorDelete(ptr, (std::size_t)alignment);
+}
+
+void operator delete(void* ptr, std::size_t, std::align_val_t alignment) noexcept {
+    G3D::poolOperatorDelete(ptr, (std::size_t)alignment);
+}
+
+void operator delete[](void* ptr, std::size_t, std::align_val_t alignment) noexcept {
+    G3D::poolOperatorDelete(ptr, (std::size_t)alignment);
+}
+
+void operator delete(void* ptr, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    G3D::poolOperatorDelete(ptr, (std::size_t)alignment);
+}
+
+void operator delete[](void* ptr, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    G3D::poolOperatorDelete(ptr, (std::size_t)alignment);
+}
+
+#endif
@@ -0,0 +1,72 @@
+/**
+  \file SIMDStringBatch.h
+
+  \brief Bulk construction of SIMDStrings on top of G3D::SystemAlloc::mallocSizedBatch
+
+  mrkkrj: for loading tables of many strings, where allocating the strings one at a 
+          time would go through the allocator once per string
+*/
+
+#ifndef G3D_SIMDStringBatch_h
+#define G3D_SIMDStringBatch_h
+
+#include <cstring>
+#include <string_view>
+#include <vector>
+
+#include "PoolAllocator.h"
+#include "SIMDString.h"
+
+
+namespace G3D {
+
+/**
+ Creates strings holding copies of \a views[0 .. count). The buffers of all strings that do not fit 
+ into the internal buffer are allocated by a single SystemAlloc::mallocSizedBatch call, without the 
+ room to append that a string constructed on its own gets.
+
+ The strings are freed one at a time by g3d_pool_allocator as usual.
+*/
+template<size_t INTERNAL_SIZE = 64>
+std::vector<SIMDString<INTERNAL_SIZE, g3d_pool_allocator<char>>> makeSIMDStrings(const std::string_view* views, size_t count) {
+    typedef SIMDString<INTERNAL_SIZE, g3d_pool_allocator<char>> PoolString;
+
+    std::vector<size_t> sizes;
+    sizes.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+        if (views[i].size() + 1 > INTERNAL_SIZE) {
+            sizes.push_back(views[i].size() + 1);
+        }
+    }
+    std::vector<void*> buffers(sizes.size());
+    if (! sizes.empty()) {
+        SystemAlloc::mallocSizedBatch(sizes.data(), sizes.size(), buffers.data());
+    }
+
+    std::vector<PoolString> strings;
+    strings.reserve(count);
+    size_t b = 0;
+    for (size_t i = 0; i < count; ++i) {
+        const std::string_view& view = views[i];
+        char* data = (view.size() + 1 > INTERNAL_SIZE) ? static_cast<char*>(buffers[b++]) : nullptr;
+        if (data != nullptr) {
+            ::memcpy(data, view.data(), view.size());
+            data[view.size()] = '\0';
+            // The string may use the rest of the pool's block
+            strings.emplace_back(SIMDStringAdoptBuffer(), data, view.size(), SystemAlloc::usableSize(data, view.size() + 1));
+        } else {
+            // Short strings, or the batch ran out of memory
+            strings.emplace_back(view.data(), view.size());
+        }
+    }
+    return strings;
+}
+
+template<size_t INTERNAL_SIZE = 64>
+std::vector<SIMDString<INTERNAL_SIZE, g3d_pool_allocator<char>>> makeSIMDStrings(const std::vector<std::string_view>& views) {
+    return makeSIMDStrings<INTERNAL_SIZE>(views.data(), views.size());
+}
+
+} // namespace G3D
+
+#endif
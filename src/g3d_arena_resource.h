@@ -0,0 +1,60 @@
+/**
+  \file g3d_arena_resource.h
+
+  \brief Implementation of g3d_arena_resource class
+
+  mrkkrj: a PMR wrapping the G3D::Arena monotonic allocator impl.
+*/
+
+#pragma once
+
+#ifndef PMR_ARENA_RESOURCE_H
+#define PMR_ARENA_RESOURCE_H
+
+#include <memory_resource>
+#include <new>
+#include "ArenaAllocator.h"
+
+
+/** Like std::pmr::monotonic_buffer_resource, but takes its chunks from G3D::SystemAlloc.
+    Deallocation is a no-op; reset() releases everything at once. */
+struct g3d_arena_resource
+   : public std::pmr::memory_resource
+{
+   explicit g3d_arena_resource(size_t initialChunkSize = G3D::Arena::defaultChunkSize)
+      : arena(initialChunkSize)
+   {
+   }
+
+   void reset()
+   {
+      arena.reset();
+   }
+
+   G3D::Arena arena;
+
+protected:
+
+   virtual void* do_allocate(size_t bytes, size_t align)
+   {
+      void* ptr = arena.allocate(bytes, align);
+      if (ptr == nullptr) {
+         throw std::bad_alloc();
+      }
+      return ptr;
+   }
+
+   virtual void do_deallocate(void* ptr, size_t bytes, size_t align)
+   {
+      (void)ptr;
+      (void)bytes;
+      (void)align;
+   }
+
+   virtual bool do_is_equal(const memory_resource& that) const noexcept
+   {
+      return this == &that;
+   }
+};
+
+#endif
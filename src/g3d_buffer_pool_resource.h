@@ -20,23 +20,19 @@ struct g3d_buffer_pool_resource
 {
    virtual void* do_allocate(size_t bytes, size_t align)
    {
-      return G3D::SystemAlloc::alignedMalloc(bytes, align);
+      return G3D::SystemAlloc::mallocSized(bytes, align);
    }
 
    virtual void do_deallocate(void* ptr, size_t bytes, size_t align)
    {
-      (void)bytes;
-      (void)align;
-
-      G3D::SystemAlloc::alignedFree(ptr);
+      G3D::SystemAlloc::freeSized(ptr, bytes, align);
    }
 
    virtual bool do_is_equal(const memory_resource& that) const noexcept
    {
-      (void)that;
-
-      // As all instances of g3d_pool_allocator are stateless.
-      return true;
+      // All instances share SystemAlloc, but memory from another kind of resource cannot
+      // be freed here.
+      return dynamic_cast<const g3d_buffer_pool_resource*>(&that) != nullptr;
    }
 };
 
@@ -0,0 +1,59 @@
+/**
+  \file g3d_pool_heap_resource.h
+
+  \brief Implementation of g3d_pool_heap_resource class
+
+  mrkkrj: a PMR wrapping its own G3D::PoolHeap, e.g. an unsynchronized one for a single thread
+*/
+
+#pragma once
+
+#ifndef PMR_POOL_HEAP_RESOURCE_H
+#define PMR_POOL_HEAP_RESOURCE_H
+
+#include <memory_resource>
+#include <new>
+#include "PoolAllocator.h"
+
+
+/** Like std::pmr::synchronized_pool_resource or, with G3D::PoolHeap::UNSYNCHRONIZED, like
+    std::pmr::unsynchronized_pool_resource: allocates from a G3D::PoolHeap of its own.
+    release() frees everything allocated from it at once. */
+struct g3d_pool_heap_resource
+   : public std::pmr::memory_resource
+{
+   explicit g3d_pool_heap_resource(G3D::PoolHeap::Threading threading = G3D::PoolHeap::SYNCHRONIZED)
+      : heap(threading)
+   {
+   }
+
+   void release()
+   {
+      heap.release();
+   }
+
+   G3D::PoolHeap heap;
+
+protected:
+
+   virtual void* do_allocate(size_t bytes, size_t align)
+   {
+      void* ptr = heap.mallocSized(bytes, align);
+      if (ptr == nullptr) {
+         throw std::bad_alloc();
+      }
+      return ptr;
+   }
+
+   virtual void do_deallocate(void* ptr, size_t bytes, size_t align)
+   {
+      heap.freeSized(ptr, bytes, align);
+   }
+
+   virtual bool do_is_equal(const memory_resource& that) const noexcept
+   {
+      return this == &that;
+   }
+};
+
+#endif